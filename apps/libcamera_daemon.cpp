@@ -0,0 +1,466 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * libcamera_daemon.cpp - long running capture server controlled over a UNIX socket.
+ */
+
+// Example: libcamera-daemon --socket /tmp/camera.sock --width 1920 --height 1080
+// and then, for instance:
+//   echo "capture /tmp/test.jpg" | socat - UNIX-CONNECT:/tmp/camera.sock
+//   echo "record /tmp/test.h264 5000" | socat - UNIX-CONNECT:/tmp/camera.sock
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <thread>
+
+#include "core/libcamera_encoder.hpp"
+#include "core/still_options.hpp"
+#include "image/save_queue.hpp"
+#include "output/output.hpp"
+
+struct DaemonOptions : public VideoOptions
+{
+	DaemonOptions() : VideoOptions()
+	{
+		using namespace boost::program_options;
+		options_.add_options()
+			("socket", value<std::string>(&socket)->default_value("/tmp/libcamera-daemon.sock"),
+			 "Name of the UNIX socket on which to listen for commands")
+			("idle-framerate", value<float>(&idle_framerate)->default_value(5.0),
+			 "Framerate at which to keep the camera running between jobs")
+			;
+	}
+
+	std::string socket;
+	float idle_framerate;
+
+	virtual void Print() const override
+	{
+		VideoOptions::Print();
+		std::cerr << "    socket: " << socket << std::endl;
+		std::cerr << "    idle-framerate: " << idle_framerate << std::endl;
+	}
+};
+
+class LibcameraDaemonApp : public LibcameraEncoder
+{
+public:
+	LibcameraDaemonApp() : LibcameraEncoder(std::make_unique<DaemonOptions>()) {}
+	DaemonOptions *GetOptions() const { return static_cast<DaemonOptions *>(options_.get()); }
+};
+
+// Commands arrive one per line on the socket, and each gets a one line reply starting with
+// "OK" or "ERROR". Connections are served one at a time on a separate thread, which hands
+// each command to the event loop, wakes it up, and waits for the command to be dealt with
+// there.
+
+struct Job
+{
+	std::vector<std::string> args;
+	std::promise<std::string> reply;
+};
+
+class CommandServer
+{
+public:
+	CommandServer(std::string const &path, std::function<void()> wakeup) : path_(path), wakeup_(wakeup)
+	{
+		listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listen_fd_ < 0)
+			throw std::runtime_error("CommandServer: failed to create socket");
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("CommandServer: socket name too long");
+		strcpy(addr.sun_path, path.c_str());
+		unlink(path.c_str());
+		if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 4) < 0)
+		{
+			close(listen_fd_);
+			throw std::runtime_error("CommandServer: failed to listen on " + path);
+		}
+		thread_ = std::thread(&CommandServer::serverThread, this);
+	}
+	~CommandServer()
+	{
+		abort_ = true;
+		thread_.join();
+		close(listen_fd_);
+		unlink(path_.c_str());
+	}
+	// Called from the event loop; returns null if there is nothing to do.
+	std::unique_ptr<Job> Next()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (jobs_.empty())
+			return nullptr;
+		std::unique_ptr<Job> job = std::move(jobs_.front());
+		jobs_.pop();
+		return job;
+	}
+
+private:
+	bool waitReadable(int fd)
+	{
+		pollfd p = { fd, POLLIN, 0 };
+		while (!abort_)
+		{
+			if (poll(&p, 1, 100) > 0)
+				return true;
+		}
+		return false;
+	}
+	void serverThread()
+	{
+		while (waitReadable(listen_fd_))
+		{
+			int fd = accept(listen_fd_, nullptr, nullptr);
+			if (fd < 0)
+				continue;
+			serveConnection(fd);
+			close(fd);
+		}
+	}
+	void serveConnection(int fd)
+	{
+		std::string pending;
+		char buf[256];
+		while (waitReadable(fd))
+		{
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n <= 0)
+				return;
+			pending.append(buf, n);
+			for (size_t pos; (pos = pending.find('\n')) != std::string::npos;)
+			{
+				std::string reply = runCommand(pending.substr(0, pos)) + "\n";
+				pending.erase(0, pos + 1);
+				if (write(fd, reply.data(), reply.size()) != (ssize_t)reply.size())
+					return;
+			}
+		}
+	}
+	std::string runCommand(std::string const &line)
+	{
+		std::unique_ptr<Job> job = std::make_unique<Job>();
+		std::istringstream words(line);
+		for (std::string word; words >> word;)
+			job->args.push_back(word);
+		if (job->args.empty())
+			return "ERROR empty command";
+		std::future<std::string> reply = job->reply.get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			jobs_.push(std::move(job));
+		}
+		wakeup_();
+		while (reply.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+		{
+			if (abort_)
+				return "ERROR daemon exiting";
+		}
+		try
+		{
+			return reply.get();
+		}
+		catch (std::future_error const &)
+		{
+			return "ERROR daemon exiting";
+		}
+	}
+
+	std::string path_;
+	std::function<void()> wakeup_;
+	int listen_fd_;
+	std::atomic<bool> abort_ = false;
+	std::thread thread_;
+	std::mutex mutex_;
+	std::queue<std::unique_ptr<Job>> jobs_;
+};
+
+// Between jobs we keep the camera running slowly, so that the AGC/AWB stay converged and
+// everything is ready to go, without wasting too much power.
+
+static void set_framerate(LibcameraApp &app, float framerate)
+{
+	libcamera::ControlList controls(controls::controls);
+	int64_t frame_time = 1000000 / framerate; // in us
+	controls.set(controls::FrameDurationLimits, { frame_time, frame_time });
+	app.SetControls(controls);
+}
+
+// Everything the event loop needs to remember between frames.
+
+struct DaemonState
+{
+	// The output for the current recording, and outputs of earlier recordings that still have
+	// frames inside the encoder, each with the timestamp of the last frame it's waiting for.
+	struct ClosingOutput
+	{
+		std::unique_ptr<Output> output;
+		int64_t last_timestamp_us;
+	};
+	std::mutex output_mutex;
+	std::unique_ptr<Output> output;
+	std::deque<ClosingOutput> closing_outputs;
+	int64_t last_encoded_us = -1;
+	bool recording = false;
+	std::string record_file;
+	std::chrono::high_resolution_clock::time_point record_end;
+};
+
+static void stop_recording(LibcameraDaemonApp &app, DaemonState &state)
+{
+	state.recording = false;
+	{
+		// The output can only go once the encoder has returned the last frame we gave it.
+		std::lock_guard<std::mutex> lock(state.output_mutex);
+		if (state.last_encoded_us >= 0)
+			state.closing_outputs.push_back({ std::move(state.output), state.last_encoded_us });
+		state.output.reset();
+	}
+	set_framerate(app, app.GetOptions()->idle_framerate);
+	std::cerr << "Finished recording " << state.record_file << std::endl;
+}
+
+// Encoded frames go to the output of the recording they were submitted for.
+
+static void output_ready(DaemonState &state, void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	std::lock_guard<std::mutex> lock(state.output_mutex);
+	auto closing = std::find_if(state.closing_outputs.begin(), state.closing_outputs.end(),
+								[timestamp_us](auto const &c) { return timestamp_us <= c.last_timestamp_us; });
+	if (closing != state.closing_outputs.end())
+		closing->output->OutputReady(mem, size, timestamp_us, keyframe);
+	else if (state.output)
+		state.output->OutputReady(mem, size, timestamp_us, keyframe);
+
+	while (!state.closing_outputs.empty() && state.closing_outputs.front().last_timestamp_us <= timestamp_us)
+		state.closing_outputs.pop_front();
+}
+
+// Some commands need a frame from the camera; the others are dealt with straight away.
+
+static bool needs_frame(std::vector<std::string> const &args)
+{
+	return args[0] == "capture";
+}
+
+static std::string handle_job(LibcameraDaemonApp &app, DaemonState &state, SaveQueue &save_queue,
+							  std::vector<std::string> const &args, CompletedRequestPtr &completed_request, bool &quit)
+{
+	DaemonOptions *options = app.GetOptions();
+	std::string const &command = args[0];
+
+	if (command == "capture" && args.size() == 2)
+	{
+		// The image is saved in the background. Should that fail, the error gets reported
+		// to the next capture instead.
+		save_queue.Save(completed_request, app.VideoStream(), args[1], false);
+		return "OK " + args[1];
+	}
+	else if (command == "record" && (args.size() == 2 || args.size() == 3))
+	{
+		if (state.recording)
+			return "ERROR already recording " + state.record_file;
+		unsigned int duration = args.size() == 3 ? std::stoul(args[2]) : 0;
+		options->output = args[1];
+		{
+			std::lock_guard<std::mutex> lock(state.output_mutex);
+			state.output = std::unique_ptr<Output>(Output::Create(options));
+			state.last_encoded_us = -1;
+		}
+		// Don't make the new file wait for the next scheduled keyframe.
+		app.GetEncoder()->RequestKeyframe();
+		state.recording = true;
+		state.record_file = args[1];
+		state.record_end = duration ? std::chrono::high_resolution_clock::now() + std::chrono::milliseconds(duration)
+									: std::chrono::high_resolution_clock::time_point::max();
+		set_framerate(app, options->framerate);
+		std::cerr << "Recording " << args[1] << std::endl;
+		return "OK " + args[1];
+	}
+	else if (command == "stop" && args.size() == 1)
+	{
+		if (!state.recording)
+			return "ERROR not recording";
+		stop_recording(app, state);
+		return "OK " + state.record_file;
+	}
+	else if (command == "status" && args.size() == 1)
+		return state.recording ? "OK recording " + state.record_file : "OK idle";
+	else if (command == "quit" && args.size() == 1)
+	{
+		quit = true;
+		return "OK";
+	}
+
+	return "ERROR bad command " + command;
+}
+
+static void run_job(LibcameraDaemonApp &app, DaemonState &state, SaveQueue &save_queue, Job &job,
+					CompletedRequestPtr &completed_request, bool &quit)
+{
+	try
+	{
+		job.reply.set_value(handle_job(app, state, save_queue, job.args, completed_request, quit));
+	}
+	catch (std::exception const &e)
+	{
+		job.reply.set_value(std::string("ERROR ") + e.what());
+	}
+}
+
+// The main even loop for the application.
+
+static void run_daemon(LibcameraDaemonApp &app, DaemonState &state)
+{
+	DaemonOptions *options = app.GetOptions();
+
+	// Captured images are saved using the stills options, for which the defaults will do.
+	StillOptions still_options;
+	char const *still_argv[] = { "libcamera-daemon" };
+	still_options.Parse(1, (char **)still_argv);
+	still_options.verbose = options->verbose;
+	SaveQueue save_queue(app, &still_options);
+
+	// The encoder stays around between recordings; only the output changes.
+	app.SetEncodeOutputReadyCallback(std::bind(&output_ready, std::ref(state), std::placeholders::_1,
+											   std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+	app.StartEncoder();
+
+	app.OpenCamera();
+	app.ConfigureVideo();
+	set_framerate(app, options->idle_framerate);
+	app.StartCamera();
+
+	// Commands shouldn't have to wait for the next (possibly slow) idle frame to be seen.
+	CommandServer server(options->socket, [&app]() {
+		LibcameraApp::MsgType type = LibcameraApp::MsgType::Wakeup;
+		LibcameraApp::MsgPayload payload;
+		app.PostMessage(type, payload);
+	});
+	std::cerr << "Listening on " << options->socket << std::endl;
+
+	std::vector<std::unique_ptr<Job>> waiting_for_frame;
+	for (unsigned int count = 0;;)
+	{
+		LibcameraEncoder::Msg msg = app.Wait();
+		if (msg.type == LibcameraEncoder::MsgType::Quit)
+			break;
+		else if (msg.type != LibcameraEncoder::MsgType::RequestComplete &&
+				 msg.type != LibcameraEncoder::MsgType::Wakeup)
+			throw std::runtime_error("unrecognised message!");
+
+		CompletedRequestPtr completed_request;
+		if (msg.type == LibcameraEncoder::MsgType::RequestComplete)
+		{
+			if (options->verbose)
+				std::cerr << "Viewfinder frame " << count << std::endl;
+			count++;
+			completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		}
+		auto now = std::chrono::high_resolution_clock::now();
+
+		bool quit = false;
+		for (std::unique_ptr<Job> job; (job = server.Next());)
+		{
+			if (needs_frame(job->args))
+				waiting_for_frame.push_back(std::move(job));
+			else
+				run_job(app, state, save_queue, *job, completed_request, quit);
+		}
+		if (completed_request)
+		{
+			for (auto &job : waiting_for_frame)
+				run_job(app, state, save_queue, *job, completed_request, quit);
+			waiting_for_frame.clear();
+		}
+		if (quit)
+		{
+			for (auto &job : waiting_for_frame)
+				job->reply.set_value("ERROR quitting");
+			break;
+		}
+
+		if (state.recording && now > state.record_end)
+			stop_recording(app, state);
+		if (!completed_request)
+			continue;
+		if (state.recording)
+		{
+			libcamera::FrameBuffer *buffer = completed_request->buffers[app.VideoStream()];
+			{
+				std::lock_guard<std::mutex> lock(state.output_mutex);
+				state.last_encoded_us = buffer->metadata().timestamp / 1000;
+			}
+			app.EncodeBuffer(completed_request, app.VideoStream());
+		}
+		app.ShowPreview(completed_request, app.VideoStream());
+	}
+
+	save_queue.Flush();
+}
+
+// The encoder's output callback refers to the state, so the encoder must be gone before
+// the state is, whichever way we leave.
+
+static void event_loop(LibcameraDaemonApp &app)
+{
+	DaemonState state;
+	try
+	{
+		run_daemon(app, state);
+	}
+	catch (...)
+	{
+		app.StopCamera();
+		app.StopEncoder();
+		throw;
+	}
+	app.StopCamera();
+	app.StopEncoder();
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		LibcameraDaemonApp app;
+		DaemonOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->verbose)
+				options->Print();
+			if (options->idle_framerate <= 0)
+				throw std::runtime_error("idle framerate must be positive");
+			// Every recording goes to a new file, so each needs its own headers and should
+			// get going quickly.
+			options->inline_headers = true;
+			if (!options->intra)
+				options->intra = options->framerate;
+
+			event_loop(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
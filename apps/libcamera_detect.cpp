@@ -11,6 +11,7 @@
 
 #include "core/libcamera_app.hpp"
 #include "core/still_options.hpp"
+#include "image/save_queue.hpp"
 #include "post_processing_stages/object_detect.hpp"
 
 struct DetectOptions : public StillOptions
@@ -42,18 +43,33 @@ public:
 	DetectOptions *GetOptions() const { return static_cast<DetectOptions *>(options_.get()); }
 };
 
-// In jpeg.cpp:
-void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
-			   libcamera::PixelFormat const &pixel_format, libcamera::ControlList const &metadata,
-			   std::string const &filename, std::string const &cam_name, StillOptions const *options);
+// Make a filename for the output and queue the still image to be saved. The queue takes a
+// copy of the image, so the camera can carry on straight away.
+
+static void save_image(LibcameraDetectApp &app, CompletedRequestPtr &completed_request, SaveQueue &save_queue)
+{
+	DetectOptions *options = app.GetOptions();
+	char filename[128];
+	snprintf(filename, sizeof(filename), options->output.c_str(), options->framestart);
+	filename[sizeof(filename) - 1] = 0;
+	options->framestart++;
+	std::cerr << "Save image " << filename << std::endl;
+	save_queue.Save(completed_request, app.StillStream(), std::string(filename), true);
+}
 
 // The main even loop for the application.
 
-static void event_loop(LibcameraDetectApp &app)
+static void event_loop(LibcameraDetectApp &app, SaveQueue &save_queue)
 {
 	DetectOptions *options = app.GetOptions();
 	app.OpenCamera();
-	app.ConfigureViewfinder();
+	// With zero shutter lag, every request carries a full resolution image, so the frame
+	// on which the object was detected can be saved directly. The save queue copies it, so
+	// we hold on to no frames beyond those the camera needs.
+	if (options->zsl)
+		app.ConfigureZsl(LibcameraApp::FLAG_STILL_NONE, 0);
+	else
+		app.ConfigureViewfinder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 	unsigned int last_capture_frame = 0;
@@ -82,7 +98,13 @@ static void event_loop(LibcameraDetectApp &app)
 
 			app.ShowPreview(completed_request, app.ViewfinderStream());
 
-			if (detected)
+			if (detected && options->zsl)
+			{
+				std::cerr << options->object << " detected" << std::endl;
+				last_capture_frame = completed_request->sequence;
+				save_image(app, completed_request, save_queue);
+			}
+			else if (detected)
 			{
 				app.StopCamera();
 				app.Teardown();
@@ -96,19 +118,7 @@ static void event_loop(LibcameraDetectApp &app)
 		{
 			app.StopCamera();
 			last_capture_frame = completed_request->sequence;
-
-			unsigned int w, h, stride;
-			libcamera::Stream *stream = app.StillStream(&w, &h, &stride);
-			const std::vector<libcamera::Span<uint8_t>> mem = app.Mmap(completed_request->buffers[stream]);
-
-			// Make a filename for the output and save it.
-			char filename[128];
-			snprintf(filename, sizeof(filename), options->output.c_str(), options->framestart);
-			filename[sizeof(filename) - 1] = 0;
-			options->framestart++;
-			std::cerr << "Save image " << filename << std::endl;
-			jpeg_save(mem, w, h, stride, stream->configuration().pixelFormat, completed_request->metadata,
-					  std::string(filename), app.CameraId(), options);
+			save_image(app, completed_request, save_queue);
 
 			// Restart camera in preview mode.
 			app.Teardown();
@@ -131,7 +141,9 @@ int main(int argc, char *argv[])
 			if (options->output.empty())
 				throw std::runtime_error("output file name required");
 
-			event_loop(app);
+			SaveQueue save_queue(app, options);
+			event_loop(app, save_queue);
+			save_queue.Flush();
 		}
 	}
 	catch (std::exception const &e)
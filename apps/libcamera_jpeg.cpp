@@ -8,6 +8,7 @@
 #include <chrono>
 
 #include "core/libcamera_app.hpp"
+#include "core/roi_background.hpp"
 #include "core/still_options.hpp"
 
 using namespace std::placeholders;
@@ -79,6 +80,11 @@ static void event_loop(LibcameraJpegApp &app)
 			app.StreamDimensions(stream, &w, &h, &stride);
 			CompletedRequestPtr &payload = std::get<CompletedRequestPtr>(msg.payload);
 			const std::vector<libcamera::Span<uint8_t>> mem = app.Mmap(payload->buffers[stream]);
+			// The camera has stopped, so nothing else needs this buffer and we can work in place.
+			std::vector<libcamera::Rectangle> regions;
+			if (options->roi_downsample && stream->configuration().pixelFormat == libcamera::formats::YUV420 &&
+				get_regions_of_interest(payload->post_process_metadata, regions))
+				roi_coarsen_background(mem[0].data(), w, h, stride, regions, options->roi_downsample);
 			jpeg_save(mem, w, h, stride, stream->configuration().pixelFormat, payload->metadata, options->output,
 					  app.CameraId(), options);
 			return;
@@ -5,12 +5,23 @@
  * libcamera_ros_publisher.cpp - libcamera ROS publisher node.
  */
 
+// Example: libcamera-ros-publisher -t 10000 --workers 2 --loopback-stats
+
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include <libcamera/stream.h>
 
 #include "core/libcamera_app.hpp"
 #include "core/options.hpp"
+#include "core/shm_frames.hpp"
 
 #include "opencv2/core.hpp"
 #include "opencv2/imgproc.hpp"
@@ -23,11 +34,335 @@ using Stream = libcamera::Stream;
 
 using namespace std::placeholders;
 
+struct PublisherOptions : public Options
+{
+	PublisherOptions() : Options()
+	{
+		using namespace boost::program_options;
+		options_.add_options()
+			("shm", value<std::string>(&shm),
+			 "Publish frames to other processes in the shared memory segment with this name, e.g. /libcamera-frames")
+			("shm-slots", value<unsigned int>(&shm_slots)->default_value(4),
+			 "Number of frames held in the shared memory segment")
+			("topic", value<std::string>(&topic)->default_value("camera"),
+			 "Prefix for the names of the topics published")
+			("workers", value<unsigned int>(&workers)->default_value(2),
+			 "Number of threads converting frames for publishing")
+			("quality,q", value<int>(&quality)->default_value(80),
+			 "JPEG quality of the compressed images")
+			("loopback-stats", value<bool>(&loopback_stats)->default_value(false)->implicit_value(true),
+			 "Subscribe locally to every topic and report what arrives")
+			;
+	}
+
+	std::string shm;
+	unsigned int shm_slots;
+	std::string topic;
+	unsigned int workers;
+	int quality;
+	bool loopback_stats;
+
+	virtual bool Parse(int argc, char *argv[]) override
+	{
+		if (Options::Parse(argc, argv) == false)
+			return false;
+		if (workers == 0)
+			throw std::runtime_error("at least one worker is required");
+		return true;
+	}
+	virtual void Print() const override
+	{
+		Options::Print();
+		std::cerr << "    shm: " << shm << std::endl;
+		std::cerr << "    shm-slots: " << shm_slots << std::endl;
+		std::cerr << "    topic: " << topic << std::endl;
+		std::cerr << "    workers: " << workers << std::endl;
+		std::cerr << "    quality: " << quality << std::endl;
+		std::cerr << "    loopback-stats: " << loopback_stats << std::endl;
+	}
+};
+
+class LibcameraPublisherApp : public LibcameraApp
+{
+public:
+	LibcameraPublisherApp() : LibcameraApp(std::make_unique<PublisherOptions>()) {}
+	PublisherOptions *GetOptions() const { return static_cast<PublisherOptions *>(options_.get()); }
+};
+
+// A queue that only ever holds the most recent item. Putting a new item replaces any that
+// hasn't been collected yet, so a slow consumer can never hold up the producer - it just
+// sees fewer items.
+
+template <typename T>
+class LatestOnlyQueue
+{
+public:
+	void Put(T item)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (full_)
+			dropped_++;
+		item_ = std::move(item);
+		full_ = true;
+		cond_.notify_one();
+	}
+	// Returns false once the queue is closed.
+	bool Get(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this] { return full_ || closed_; });
+		if (!full_)
+			return false;
+		item = std::move(item_);
+		item_ = T();
+		full_ = false;
+		return true;
+	}
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+		cond_.notify_all();
+	}
+	unsigned int Dropped() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return dropped_;
+	}
+
+private:
+	T item_;
+	bool full_ = false;
+	bool closed_ = false;
+	unsigned int dropped_ = 0;
+	mutable std::mutex mutex_;
+	std::condition_variable cond_;
+};
+
+// Messages look roughly like their ROS equivalents: sensor_msgs/Image (encoding "bgr8"),
+// sensor_msgs/CompressedImage (format "jpeg") and a timing message for each frame.
+
+struct Message
+{
+	unsigned int sequence;
+	int64_t stamp_ns; // sensor timestamp, CLOCK_MONOTONIC
+	std::string encoding;
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned int step = 0;
+	std::vector<uint8_t> data;
+	// For the timing topic, in microseconds from the frame's sensor timestamp.
+	std::map<std::string, double> timings;
+};
+using MessagePtr = std::shared_ptr<const Message>;
+
+// Messages go out through a transport. With no ROS installation to hand, the loopback
+// transport delivers them straight to subscribers in this process. Every subscriber gets
+// a thread and a latest-only queue of its own, so one slow subscriber delays nobody else.
+
+class Transport
+{
+public:
+	virtual ~Transport() {}
+	virtual void Publish(std::string const &topic, MessagePtr const &message) = 0;
+};
+
+class LoopbackTransport : public Transport
+{
+public:
+	using Callback = std::function<void(std::string const &, MessagePtr const &)>;
+
+	~LoopbackTransport()
+	{
+		for (auto &subscriber : subscribers_)
+			subscriber->queue.Close();
+		for (auto &subscriber : subscribers_)
+			subscriber->thread.join();
+	}
+	// Subscribers must all be added before anything is published.
+	void Subscribe(std::string const &topic, Callback callback)
+	{
+		subscribers_.push_back(std::make_unique<Subscriber>());
+		Subscriber *subscriber = subscribers_.back().get();
+		subscriber->topic = topic;
+		subscriber->thread = std::thread([subscriber, callback]() {
+			MessagePtr message;
+			while (subscriber->queue.Get(message))
+				callback(subscriber->topic, message);
+		});
+	}
+	void Publish(std::string const &topic, MessagePtr const &message) override
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		// Workers can finish out of order; never let a subscriber see time go backwards.
+		unsigned int &last = last_sequence_[topic];
+		if (message->sequence < last)
+			return;
+		last = message->sequence;
+		for (auto &subscriber : subscribers_)
+		{
+			if (subscriber->topic == topic)
+				subscriber->queue.Put(message);
+		}
+	}
+
+private:
+	struct Subscriber
+	{
+		std::string topic;
+		LatestOnlyQueue<MessagePtr> queue;
+		std::thread thread;
+	};
+	std::vector<std::unique_ptr<Subscriber>> subscribers_;
+	std::mutex mutex_;
+	std::map<std::string, unsigned int> last_sequence_;
+};
+
+// Conversion to BGR and JPEG happens on a pool of workers. Each worker takes the most
+// recent frame there is, so if the workers fall behind they skip frames. Frames are copied
+// out of the camera buffer as they are submitted, so however many workers there are, none
+// of them can hold on to camera buffers and starve the camera. The copies are recycled.
+
+class FramePublisher
+{
+public:
+	FramePublisher(PublisherOptions const *options, Transport &transport, unsigned int w, unsigned int h,
+				   unsigned int stride)
+		: options_(options), transport_(transport), w_(w), h_(h), stride_(stride)
+	{
+		for (unsigned int i = 0; i < options_->workers; i++)
+			workers_.emplace_back(&FramePublisher::workerThread, this);
+	}
+	~FramePublisher()
+	{
+		queue_.Close();
+		for (auto &worker : workers_)
+			worker.join();
+	}
+	void Submit(CompletedRequestPtr const &completed_request, libcamera::Span<uint8_t> const &buffer)
+	{
+		Job job;
+		job.arrival = std::chrono::steady_clock::now();
+		job.sequence = completed_request->sequence;
+		libcamera::ControlList const &metadata = completed_request->metadata;
+		job.stamp = metadata.contains(controls::SensorTimestamp) ? metadata.get(controls::SensorTimestamp) : nowNs();
+		{
+			std::lock_guard<std::mutex> lock(spare_mutex_);
+			if (!spare_frames_.empty())
+			{
+				job.frame = std::move(spare_frames_.back());
+				spare_frames_.pop_back();
+			}
+		}
+		job.frame.assign(buffer.begin(), buffer.end());
+		queue_.Put(std::move(job));
+	}
+	unsigned int Dropped() const { return queue_.Dropped(); }
+
+private:
+	struct Job
+	{
+		unsigned int sequence;
+		int64_t stamp; // sensor timestamp
+		std::vector<uint8_t> frame;
+		std::chrono::steady_clock::time_point arrival;
+	};
+
+	static int64_t nowNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::steady_clock::now().time_since_epoch())
+			.count();
+	}
+
+	void workerThread()
+	{
+		Job job;
+		while (queue_.Get(job))
+		{
+			unsigned int sequence = job.sequence;
+			int64_t stamp = job.stamp;
+			auto since_stamp = [stamp]() { return (nowNs() - stamp) / 1000.0; };
+			auto timing = std::make_shared<Message>();
+			timing->sequence = sequence;
+			timing->stamp_ns = stamp;
+			timing->encoding = "timing";
+			timing->timings["arrival"] =
+				std::chrono::duration_cast<std::chrono::nanoseconds>(job.arrival.time_since_epoch()).count() / 1000.0 -
+				stamp / 1000.0;
+			timing->timings["dequeue"] = since_stamp();
+
+			// The Y, U and V planes of a YUV420 buffer with a stride are laid out exactly as an
+			// I420 image of width "stride", so convert that and crop off the padding.
+			Mat yuv(h_ * 3 / 2, stride_, CV_8U, job.frame.data());
+			Mat bgr_padded;
+			cvtColor(yuv, bgr_padded, COLOR_YUV2BGR_I420);
+			Mat bgr = bgr_padded(Rect(0, 0, w_, h_)).clone();
+			{
+				std::lock_guard<std::mutex> lock(spare_mutex_);
+				if (spare_frames_.size() <= options_->workers)
+					spare_frames_.push_back(std::move(job.frame));
+			}
+			timing->timings["converted"] = since_stamp();
+
+			auto image = std::make_shared<Message>();
+			image->sequence = sequence;
+			image->stamp_ns = stamp;
+			image->encoding = "bgr8";
+			image->width = w_;
+			image->height = h_;
+			image->step = w_ * 3;
+			image->data.assign(bgr.data, bgr.data + bgr.total() * bgr.elemSize());
+			transport_.Publish(options_->topic + "/image_raw", image);
+			timing->timings["image"] = since_stamp();
+
+			auto compressed = std::make_shared<Message>();
+			compressed->sequence = sequence;
+			compressed->stamp_ns = stamp;
+			compressed->encoding = "jpeg";
+			compressed->width = w_;
+			compressed->height = h_;
+			std::vector<int> params = { IMWRITE_JPEG_QUALITY, options_->quality };
+			imencode(".jpg", bgr, compressed->data, params);
+			transport_.Publish(options_->topic + "/image_raw/compressed", compressed);
+			timing->timings["compressed"] = since_stamp();
+
+			transport_.Publish(options_->topic + "/timing", timing);
+		}
+	}
+
+	PublisherOptions const *options_;
+	Transport &transport_;
+	unsigned int w_, h_, stride_;
+	LatestOnlyQueue<Job> queue_;
+	std::vector<std::thread> workers_;
+	std::mutex spare_mutex_;
+	std::vector<std::vector<uint8_t>> spare_frames_;
+};
+
+// A local subscriber that reports what it receives, so the node can be tried out without ROS.
+
+static void report_message(std::string const &topic, MessagePtr const &message)
+{
+	std::stringstream line;
+	line << topic << " " << message->sequence;
+	if (message->encoding == "timing")
+	{
+		line << std::fixed << std::setprecision(0);
+		for (auto const &[name, us] : message->timings)
+			line << " " << name << " " << us << "us";
+	}
+	else
+		line << " " << message->encoding << " " << message->width << "x" << message->height << " "
+			 << message->data.size() << " bytes";
+	std::cerr << line.str() << std::endl;
+}
+
 // The main event loop for the application.
 
-static void event_loop(LibcameraApp &app)
+static void event_loop(LibcameraPublisherApp &app)
 {
-	Options const *options = app.GetOptions();
+	PublisherOptions const *options = app.GetOptions();
 
 	app.OpenCamera();
 	app.ConfigureViewfinder();
@@ -38,45 +373,57 @@ static void event_loop(LibcameraApp &app)
 	Stream *stream = app.GetMainStream();
 	if (!stream || stream->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("Error: only YUV420 format supported");
-		
+
 	unsigned int w, h, stride;
-	Mat src;
 	app.StreamDimensions(stream, &w, &h, &stride);
 
+	// Local subscribers (such as libcamera-shm-subscriber) can read the frames from here.
+	std::unique_ptr<ShmFramePublisher> shm_publisher;
+	if (!options->shm.empty())
+		shm_publisher = std::make_unique<ShmFramePublisher>(options->shm, options->shm_slots, w, h, stride,
+															stream->configuration().pixelFormat.fourcc(),
+															stride * h * 3 / 2);
+
+	LoopbackTransport transport;
+	if (options->loopback_stats)
+	{
+		for (char const *topic : { "/image_raw", "/image_raw/compressed", "/timing" })
+			transport.Subscribe(options->topic + topic, report_message);
+	}
+	FramePublisher publisher(options, transport, w, h, stride);
+
 	for (unsigned int count = 0; ; count++)
 	{
 		LibcameraApp::Msg msg = app.Wait();
 		if (msg.type == LibcameraApp::MsgType::Quit)
-			return;
+			break;
 		else if (msg.type != LibcameraApp::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
 
 		if (options->verbose)
 			std::cerr << "Viewfinder frame " << count << std::endl;
 		auto now = std::chrono::high_resolution_clock::now();
-		if (options->timeout && now - start_time > std::chrono::milliseconds(options->timeout)) {
-			std::cout << "w = " << w << std::endl;
-			std::cout << "h = " << h << std::endl;
-			std::cout << "stride = " << stride << std::endl;			
-			imwrite("/home/pi/opencv.jpg", src);
-			return;
-		}
+		if (options->timeout && now - start_time > std::chrono::milliseconds(options->timeout))
+			break;
+
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		
 		libcamera::Span<uint8_t> buffer = app.Mmap(completed_request->buffers[stream])[0];
-		uint8_t *ptr = (uint8_t *)buffer.data();
-		src = Mat(h, w, CV_8U, ptr, stride);
+		if (shm_publisher)
+			shm_publisher->Publish(buffer, completed_request->sequence, completed_request->metadata);
+		publisher.Submit(completed_request, buffer);
 
 		app.ShowPreview(completed_request, app.ViewfinderStream());
 	}
+
+	std::cerr << "Frames skipped by the publishing workers: " << publisher.Dropped() << std::endl;
 }
 
 int main(int argc, char *argv[])
 {
 	try
 	{
-		LibcameraApp app;
-		Options *options = app.GetOptions();
+		LibcameraPublisherApp app;
+		PublisherOptions *options = app.GetOptions();
 		if (options->Parse(argc, argv))
 		{
 			if (options->verbose)
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * libcamera_shm_subscriber.cpp - read frames published to shared memory by another process.
+ */
+
+// Example: libcamera-ros-publisher --shm /libcamera-frames -t 0 &
+//          libcamera-shm-subscriber /libcamera-frames 100 frame.yuv
+
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#include "core/shm_frames.hpp"
+
+// A trivial consumer: it reports each frame it sees, along with the average of its Y plane
+// computed in place in the shared memory, and can save the last good frame to a file.
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		std::string name = argc > 1 ? argv[1] : "/libcamera-frames";
+		unsigned int num_frames = argc > 2 ? std::stoul(argv[2]) : 100;
+		std::string output = argc > 3 ? argv[3] : "";
+
+		ShmFrameSubscriber subscriber(name);
+		ShmFramesHeader const &info = subscriber.Info();
+		std::cerr << "Subscribed to " << name << ": " << info.width << "x" << info.height << " stride " << info.stride
+				  << ", " << info.num_slots << " slots" << std::endl;
+
+		std::vector<uint8_t> saved;
+		unsigned int received = 0, invalid = 0;
+		while (received < num_frames)
+		{
+			ShmFrameSubscriber::Frame frame;
+			if (!subscriber.Next(frame, std::chrono::milliseconds(2000)))
+				throw std::runtime_error("timed out waiting for a frame");
+
+			uint64_t total = 0;
+			for (unsigned int y = 0; y < info.height; y++)
+			{
+				uint8_t const *row = frame.data + y * info.stride;
+				for (unsigned int x = 0; x < info.width; x++)
+					total += row[x];
+			}
+			unsigned int sequence = frame.slot->sequence;
+			int64_t timestamp_ns = frame.slot->timestamp_ns;
+			float exposure_time = frame.slot->exposure_time, analogue_gain = frame.slot->analogue_gain;
+			if (!output.empty())
+				saved.assign(frame.data, frame.data + frame.slot->size);
+
+			if (!subscriber.Valid(frame))
+			{
+				invalid++;
+				continue;
+			}
+			received++;
+			std::cout << "frame " << sequence << " timestamp " << timestamp_ns / 1000 << "us exposure "
+					  << exposure_time << "us gain " << analogue_gain << " mean Y "
+					  << (double)total / (info.width * info.height) << std::endl;
+
+			if (!output.empty())
+			{
+				FILE *fp = fopen(output.c_str(), "wb");
+				if (!fp || fwrite(saved.data(), saved.size(), 1, fp) != 1)
+					throw std::runtime_error("failed to write " + output);
+				fclose(fp);
+			}
+		}
+
+		std::cerr << "Received " << received << " frames, missed " << subscriber.Dropped() << ", overwritten while reading "
+				  << invalid << std::endl;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
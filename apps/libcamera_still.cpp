@@ -8,12 +8,14 @@
 #include <poll.h>
 #include <signal.h>
 #include <sys/signalfd.h>
-#include <sys/stat.h>
 
 #include <chrono>
 
 #include "core/libcamera_app.hpp"
+#include "core/raw_burst.hpp"
 #include "core/still_options.hpp"
+#include "core/zsl_ring.hpp"
+#include "image/save_queue.hpp"
 
 using namespace std::placeholders;
 using libcamera::Stream;
@@ -26,28 +28,6 @@ public:
 	StillOptions *GetOptions() const { return static_cast<StillOptions *>(options_.get()); }
 };
 
-// In jpeg.cpp:
-void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
-			   libcamera::PixelFormat const &pixel_format, libcamera::ControlList const &metadata,
-			   std::string const &filename, std::string const &cam_name, StillOptions const *options);
-
-// In yuv.cpp:
-void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
-			  libcamera::PixelFormat const &pixel_format, std::string const &filename, StillOptions const *options);
-
-// In dng.cpp:
-void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
-			  libcamera::PixelFormat const &pixel_format, libcamera::ControlList const &metadata,
-			  std::string const &filename, std::string const &cam_name, StillOptions const *options);
-
-// In png.cpp:
-void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
-			  libcamera::PixelFormat const &pixel_format, std::string const &filename, StillOptions const *options);
-
-// In bmp.cpp:
-void bmp_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
-			  libcamera::PixelFormat const &pixel_format, std::string const &filename, StillOptions const *options);
-
 static std::string generate_filename(StillOptions const *options)
 {
 	char filename[128];
@@ -68,66 +48,74 @@ static std::string generate_filename(StillOptions const *options)
 	return std::string(filename);
 }
 
-static void update_latest_link(std::string const &filename, StillOptions const *options)
+static void save_images(LibcameraStillApp &app, CompletedRequestPtr &payload, SaveQueue &save_queue)
 {
-	// Create a fixed-name link to the most recent output file, if requested.
-	if (!options->latest.empty())
+	StillOptions *options = app.GetOptions();
+	std::string filename = generate_filename(options);
+	save_queue.Save(payload, app.StillStream(), filename, true);
+	if (options->raw)
 	{
-		struct stat buf;
-		if (stat(options->latest.c_str(), &buf) == 0 && unlink(options->latest.c_str()))
-			std::cerr << "WARNING: could not delete latest link " << options->latest << std::endl;
-		else
-		{
-			if (symlink(filename.c_str(), options->latest.c_str()))
-				std::cerr << "WARNING: failed to create latest link " << options->latest << std::endl;
-			else if (options->verbose)
-				std::cerr << "Link " << options->latest << " created" << std::endl;
-		}
+		filename = filename.substr(0, filename.rfind('.')) + ".dng";
+		save_queue.Save(payload, app.RawStream(), filename, false);
 	}
+	options->framestart++;
 }
 
-static void save_image(LibcameraStillApp &app, CompletedRequestPtr &payload, Stream *stream,
-					   std::string const &filename)
+// For a burst, make sure the ring has room before the camera starts, so that nothing gets
+// allocated while the frames are arriving.
+
+static void prepare_burst(LibcameraStillApp &app, RawBurst &burst)
 {
 	StillOptions const *options = app.GetOptions();
+	if (!options->burst)
+		return;
 	unsigned int w, h, stride;
-	app.StreamDimensions(stream, &w, &h, &stride);
-	libcamera::PixelFormat const &pixel_format = stream->configuration().pixelFormat;
-	const std::vector<libcamera::Span<uint8_t>> mem = app.Mmap(payload->buffers[stream]);
-	if (stream == app.RawStream())
-		dng_save(mem, w, h, stride, pixel_format, payload->metadata, filename, app.CameraId(), options);
-	else if (options->encoding == "jpg")
-		jpeg_save(mem, w, h, stride, pixel_format, payload->metadata, filename, app.CameraId(), options);
-	else if (options->encoding == "png")
-		png_save(mem, w, h, stride, pixel_format, filename, options);
-	else if (options->encoding == "bmp")
-		bmp_save(mem, w, h, stride, pixel_format, filename, options);
-	else
-		yuv_save(mem, w, h, stride, pixel_format, filename, options);
-	if (options->verbose)
-		std::cerr << "Saved image " << w << " x " << h << " to file " << filename << std::endl;
+	app.StreamDimensions(app.RawStream(), &w, &h, &stride);
+	burst.Allocate(options->burst, stride * h);
 }
 
-static void save_images(LibcameraStillApp &app, CompletedRequestPtr &payload)
+// Once the burst is over, the DNGs are written one after another; dng_save already spreads
+// each one across its own threads. Each frame is saved with its own metadata.
+
+static void save_burst(LibcameraStillApp &app, RawBurst const &burst)
 {
 	StillOptions *options = app.GetOptions();
-	std::string filename = generate_filename(options);
-	save_image(app, payload, app.StillStream(), filename);
-	update_latest_link(filename, options);
-	if (options->raw)
+	unsigned int w, h, stride;
+	app.StreamDimensions(app.RawStream(), &w, &h, &stride);
+	libcamera::PixelFormat const &pixel_format = app.RawStream()->configuration().pixelFormat;
+
+	std::vector<std::string> filenames;
+	for (unsigned int i = 0; i < burst.Size(); i++)
 	{
-		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
+		std::string filename = generate_filename(options);
+		filename = filename.substr(0, filename.rfind('.'));
+		// Date and time based names may well not change during a burst.
+		if (std::find(filenames.begin(), filenames.end(), filename + ".dng") != filenames.end())
+			filename += "_" + std::to_string(i);
+		filenames.push_back(filename + ".dng");
+		options->framestart++;
 	}
-	options->framestart++;
+
+	for (unsigned int i = 0; i < burst.Size(); i++)
+	{
+		RawBurst::Frame const &frame = burst[i];
+		std::vector<libcamera::Span<uint8_t>> mem = { libcamera::Span<uint8_t>((uint8_t *)frame.data.data(), frame.size) };
+		dng_save(mem, w, h, stride, pixel_format, frame.metadata.ToControlList(), filenames[i], app.CameraId(),
+				 options);
+		if (options->verbose)
+			std::cerr << "Saved burst frame " << i << " to file " << filenames[i] << std::endl;
+	}
+	update_latest_link(filenames.back(), options);
 }
 
 // Some keypress/signal handling.
 
 static int signal_received;
+static int64_t signal_timestamp; // when it arrived, for zero shutter lag captures
 static void default_signal_handler(int signal_number)
 {
 	signal_received = signal_number;
+	signal_timestamp = ZslRing::Now();
 	std::cerr << "Received signal " << signal_number << std::endl;
 }
 static int get_key_or_signal(StillOptions const *options, pollfd p[1])
@@ -156,7 +144,7 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 
 // The main even loop for the application.
 
-static void event_loop(LibcameraStillApp &app)
+static void event_loop(LibcameraStillApp &app, SaveQueue &save_queue)
 {
 	StillOptions const *options = app.GetOptions();
 	bool output = !options->output.empty() || options->datetime || options->timestamp; // output requested?
@@ -168,10 +156,23 @@ static void event_loop(LibcameraStillApp &app)
 		still_flags |= LibcameraApp::FLAG_STILL_RGB;
 	if (options->raw)
 		still_flags |= LibcameraApp::FLAG_STILL_RAW;
+	// A burst needs a few buffers in flight to keep up with the sensor.
+	if (options->burst)
+		still_flags |= LibcameraApp::FLAG_STILL_TRIPLE_BUFFER;
+	RawBurst burst;
+	ZslRing zsl_ring;
 
 	app.OpenCamera();
-	if (options->immediate)
+	if (options->zsl)
+	{
+		app.ConfigureZsl(still_flags, options->zsl);
+		zsl_ring.SetSize(options->zsl);
+	}
+	else if (options->immediate)
+	{
 		app.ConfigureStill(still_flags);
+		prepare_burst(app, burst);
+	}
 	else
 		app.ConfigureViewfinder();
 	app.StartCamera();
@@ -182,6 +183,7 @@ static void event_loop(LibcameraStillApp &app)
 	signal(SIGUSR1, default_signal_handler);
 	signal(SIGUSR2, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
+	int64_t zsl_trigger = -1; // sensor time of the frame we want, once a capture is triggered
 
 	for (unsigned int count = 0; ; count++)
 	{
@@ -196,9 +198,43 @@ static void event_loop(LibcameraStillApp &app)
 		if (key == 'x' || key == 'X')
 			return;
 
+		// In zero shutter lag mode the still and viewfinder streams run together. On a
+		// trigger, save the held frame nearest to it (less any lag we were asked to allow
+		// for), with no need to restart the camera.
+		if (options->zsl)
+		{
+			CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+			zsl_ring.Push(completed_request);
+
+			bool timed_out = options->timeout && now - start_time > std::chrono::milliseconds(options->timeout);
+			bool keypressed = key == '\n';
+			bool timelapse_timed_out = options->timelapse &&
+									   now - timelapse_time > std::chrono::milliseconds(options->timelapse);
+
+			if ((timed_out || keypressed || timelapse_timed_out) && zsl_trigger < 0)
+			{
+				if (!output || (timed_out && options->timelapse) || (!keypressed && keypress))
+					return;
+				// A key is only noticed when a frame arrives, but a signal knows when it came.
+				zsl_trigger = keypressed && options->signal ? signal_timestamp : ZslRing::Now();
+				zsl_trigger -= options->zsl_lag * 1000000LL;
+				timelapse_time = std::chrono::high_resolution_clock::now();
+			}
+			if (zsl_trigger >= 0 && zsl_ring.Reached(zsl_trigger))
+			{
+				CompletedRequestPtr frame = zsl_ring.Closest(zsl_trigger);
+				zsl_trigger = -1;
+				if (options->verbose)
+					std::cerr << "Zero shutter lag capture of frame " << frame->sequence << std::endl;
+				save_images(app, frame, save_queue);
+				if (!options->timelapse && !keypress)
+					return;
+			}
+			app.ShowPreview(completed_request, app.ViewfinderStream());
+		}
 		// In viewfinder mode, simply run until the timeout. When that happens, switch to
 		// capture mode if an output was requested.
-		if (app.ViewfinderStream())
+		else if (app.ViewfinderStream())
 		{
 			if (options->verbose)
 				std::cerr << "Viewfinder frame " << count << std::endl;
@@ -221,6 +257,7 @@ static void event_loop(LibcameraStillApp &app)
 					app.StopCamera();
 					app.Teardown();
 					app.ConfigureStill(still_flags);
+					prepare_burst(app, burst);
 					app.StartCamera();
 				}
 			}
@@ -234,9 +271,24 @@ static void event_loop(LibcameraStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream())
 		{
-			app.StopCamera();
-			std::cerr << "Still capture image received" << std::endl;
-			save_images(app, std::get<CompletedRequestPtr>(msg.payload));
+			CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+			if (options->burst)
+			{
+				// Just stash the raw frame until we have them all.
+				burst.Push(app.Mmap(completed_request->buffers[app.RawStream()])[0], completed_request->metadata);
+				if (!burst.Full())
+					continue;
+				app.StopCamera();
+				std::cerr << "Burst of " << burst.Size() << " raw frames received" << std::endl;
+				save_burst(app, burst);
+				burst.Clear();
+			}
+			else
+			{
+				app.StopCamera();
+				std::cerr << "Still capture image received" << std::endl;
+				save_images(app, completed_request, save_queue);
+			}
 			if (options->timelapse)
 			{
 				app.Teardown();
@@ -260,7 +312,9 @@ int main(int argc, char *argv[])
 			if (options->verbose)
 				options->Print();
 
-			event_loop(app);
+			SaveQueue save_queue(app, app.GetOptions());
+			event_loop(app, save_queue);
+			save_queue.Flush();
 		}
 	}
 	catch (std::exception const &e)
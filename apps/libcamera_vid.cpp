@@ -13,6 +13,7 @@
 
 #include "core/libcamera_encoder.hpp"
 #include "output/output.hpp"
+#include "output/rate_controller.hpp"
 
 using namespace std::placeholders;
 
@@ -49,6 +50,30 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 	return key;
 }
 
+// Options for the encoder of the low resolution stream. Anything not given explicitly for
+// the low resolution stream follows the main one.
+
+static std::unique_ptr<VideoOptions> make_lores_options(VideoOptions const *options)
+{
+	std::unique_ptr<VideoOptions> lores_options = std::make_unique<VideoOptions>();
+	char const *argv[] = { "libcamera-vid" };
+	lores_options->Parse(1, (char **)argv);
+	lores_options->verbose = options->verbose;
+	lores_options->width = options->lores_width;
+	lores_options->height = options->lores_height;
+	lores_options->framerate = options->framerate;
+	lores_options->output = options->lores_output;
+	lores_options->codec = options->lores_codec;
+	lores_options->bitrate = options->lores_bitrate;
+	lores_options->quality = options->quality;
+	lores_options->intra = options->intra;
+	lores_options->inline_headers = options->inline_headers;
+	lores_options->listen = options->listen;
+	lores_options->pause = options->pause;
+	lores_options->roi_downsample = 0; // regions are in the main stream's coordinates
+	return lores_options;
+}
+
 // The main even loop for the application.
 
 static void event_loop(LibcameraEncoder &app)
@@ -56,12 +81,24 @@ static void event_loop(LibcameraEncoder &app)
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
 	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	std::unique_ptr<Output> lores_output;
+	unsigned int lores_encoder = 0;
+	if (!options->lores_output.empty())
+	{
+		std::unique_ptr<VideoOptions> lores_options = make_lores_options(options);
+		lores_output = std::unique_ptr<Output>(Output::Create(lores_options.get()));
+		lores_encoder = app.AddEncoder(std::move(lores_options),
+									   std::bind(&Output::OutputReady, lores_output.get(), _1, _2, _3, _4));
+	}
 	app.StartEncoder();
 
 	app.OpenCamera();
 	app.ConfigureVideo();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
+	std::unique_ptr<RateController> rate_controller;
+	if (options->rate_control)
+		rate_controller = std::make_unique<RateController>(options, app.GetEncoder(), output.get());
 
 	// Monitoring for keypresses and signals.
 	signal(SIGUSR1, default_signal_handler);
@@ -77,7 +114,11 @@ static void event_loop(LibcameraEncoder &app)
 			throw std::runtime_error("unrecognised message!");
 		int key = get_key_or_signal(options, p);
 		if (key == '\n')
+		{
 			output->Signal();
+			if (lores_output)
+				lores_output->Signal();
+		}
 
 		if (options->verbose)
 			std::cerr << "Viewfinder frame " << count << std::endl;
@@ -92,6 +133,10 @@ static void event_loop(LibcameraEncoder &app)
 
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
 		app.EncodeBuffer(completed_request, app.VideoStream());
+		if (lores_output)
+			app.EncodeBuffer(lores_encoder, completed_request, app.LoresStream());
+		if (rate_controller)
+			rate_controller->Update();
 		app.ShowPreview(completed_request, app.VideoStream());
 	}
 }
@@ -4,9 +4,15 @@
  *
  * frame_info.hpp - Frame info class for libcamera apps
  */
+#pragma once
+
+#include <algorithm>
 #include <array>
-#include <iomanip>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
 #include <string>
+#include <vector>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/controls.h>
@@ -38,43 +44,8 @@ struct FrameInfo
 			aelock = ctrls.get(libcamera::controls::AeLocked);
 	}
 
-	std::string ToString(std::string &info_string) const
-	{
-		std::string parsed(info_string);
-
-		for (auto const &t : tokens)
-		{
-			std::size_t pos = parsed.find(t);
-			if (pos != std::string::npos)
-			{
-				std::stringstream value;
-				value << std::fixed << std::setprecision(2);
-
-				if (t == "%frame")
-					value << sequence;
-				else if (t == "%fps")
-					value << fps;
-				else if (t == "%exp")
-					value << exposure_time;
-				else if (t == "%ag")
-					value << analogue_gain;
-				else if (t == "%dg")
-					value << digital_gain;
-				else if (t == "%rg")
-					value << colour_gains[0];
-				else if (t == "%bg")
-					value << colour_gains[1];
-				else if (t == "%focus")
-					value << focus;
-				else if (t == "%aelock")
-					value << aelock;
-
-				parsed.replace(pos, t.length(), value.str());
-			}
-		}
-
-		return parsed;
-	}
+	// For a one-off conversion. Anything doing this every frame should keep an InfoTextTemplate.
+	std::string ToString(std::string const &info_string) const;
 
 	unsigned int sequence;
 	float exposure_time;
@@ -84,9 +55,139 @@ struct FrameInfo
 	float focus;
 	float fps;
 	bool aelock;
+};
+
+// Info text is parsed just once into a list of literal strings and fields, so that producing
+// the text for each frame only has to format the numbers, and can re-use the same buffer.
+
+class InfoTextTemplate
+{
+public:
+	InfoTextTemplate() {}
+	InfoTextTemplate(std::string const &text) { Compile(text); }
+
+	void Compile(std::string const &text)
+	{
+		text_ = text;
+		segments_.clear();
+		std::string literal;
+		for (size_t pos = 0; pos < text.size();)
+		{
+			Field field = NONE;
+			if (text[pos] == '%')
+				field = match(text, pos);
+			if (field == NONE)
+				literal += text[pos++];
+			else
+			{
+				if (!literal.empty())
+					segments_.push_back({ NONE, std::move(literal) });
+				literal.clear();
+				segments_.push_back({ field, {} });
+			}
+		}
+		if (!literal.empty())
+			segments_.push_back({ NONE, std::move(literal) });
+	}
+
+	std::string const &Text() const { return text_; }
+
+	std::string const &Render(FrameInfo const &info)
+	{
+		output_.clear();
+		for (auto const &segment : segments_)
+		{
+			switch (segment.field)
+			{
+			case NONE:
+				output_ += segment.literal;
+				break;
+			case FRAME:
+				append(info.sequence);
+				break;
+			case FPS:
+				append(info.fps);
+				break;
+			case EXP:
+				append(info.exposure_time);
+				break;
+			case AG:
+				append(info.analogue_gain);
+				break;
+			case DG:
+				append(info.digital_gain);
+				break;
+			case RG:
+				append(info.colour_gains[0]);
+				break;
+			case BG:
+				append(info.colour_gains[1]);
+				break;
+			case FOCUS:
+				append(info.focus);
+				break;
+			case AELOCK:
+				append((unsigned int)info.aelock);
+				break;
+			}
+		}
+		return output_;
+	}
 
 private:
-	// Info text tokens.
-	inline static const std::string tokens[] = { "%frame", "%fps", "%exp",	 "%ag",	   "%dg",
-												 "%rg",	   "%bg",  "%focus", "%aelock" };
+	enum Field { NONE, FRAME, FPS, EXP, AG, DG, RG, BG, FOCUS, AELOCK };
+	struct Segment
+	{
+		Field field;
+		std::string literal;
+	};
+
+	static Field match(std::string const &text, size_t &pos)
+	{
+		static const std::pair<char const *, Field> tokens[] = {
+			{ "%frame", FRAME }, { "%fps", FPS }, { "%exp", EXP },	   { "%ag", AG },		  { "%dg", DG },
+			{ "%rg", RG },		 { "%bg", BG },	  { "%focus", FOCUS }, { "%aelock", AELOCK }
+		};
+		for (auto const &[token, field] : tokens)
+		{
+			size_t len = strlen(token);
+			if (text.compare(pos, len, token) == 0)
+			{
+				pos += len;
+				return field;
+			}
+		}
+		return NONE;
+	}
+
+	void append(unsigned int value)
+	{
+		char buf[16];
+		char *end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+		output_.append(buf, end);
+	}
+	void append(float value)
+	{
+		// Floating point to_chars isn't available in older toolchains.
+		char buf[64];
+#if defined(__cpp_lib_to_chars)
+		auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, 2);
+		if (ec == std::errc())
+		{
+			output_.append(buf, end);
+			return;
+		}
+#endif
+		int n = snprintf(buf, sizeof(buf), "%.2f", value);
+		output_.append(buf, std::min<size_t>(std::max(n, 0), sizeof(buf) - 1));
+	}
+
+	std::string text_;
+	std::vector<Segment> segments_;
+	std::string output_;
 };
+
+inline std::string FrameInfo::ToString(std::string const &info_string) const
+{
+	return InfoTextTemplate(info_string).Render(*this);
+}
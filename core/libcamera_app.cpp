@@ -5,6 +5,9 @@
  * libcamera_app.cpp - base class for libcamera apps.
  */
 
+#include <future>
+#include <sstream>
+
 #include "preview/preview.hpp"
 
 #include "core/frame_info.hpp"
@@ -43,21 +46,39 @@ std::string const &LibcameraApp::CameraId() const
 
 void LibcameraApp::OpenCamera()
 {
-	// Make a preview window.
-	preview_ = std::unique_ptr<Preview>(make_preview(options_.get()));
-	preview_->SetDoneCallback(std::bind(&LibcameraApp::previewDoneCallback, this, std::placeholders::_1));
+	startup_time_ = std::chrono::steady_clock::now();
+	startup_pending_ = true;
+
+	// Making the preview window and reading the post-processing stages (which may mean loading
+	// large models) don't depend on the camera at all, so do them while the camera starts up.
+	auto preview_future = std::async(std::launch::async, [this]() {
+		auto start = std::chrono::steady_clock::now();
+		// If opening the camera fails, the future still owns this and will clean it up.
+		std::unique_ptr<Preview> preview(make_preview(options_.get()));
+		recordStartupPhase("preview", start);
+		return preview;
+	});
+	auto post_process_future = std::async(std::launch::async, [this]() {
+		auto start = std::chrono::steady_clock::now();
+		if (!options_->post_process_file.empty())
+			post_processor_.Read(options_->post_process_file);
+		recordStartupPhase("post-processing", start);
+	});
 
 	if (options_->verbose)
 		std::cerr << "Opening camera..." << std::endl;
 
+	auto start = std::chrono::steady_clock::now();
 	camera_manager_ = std::make_unique<CameraManager>();
 	int ret = camera_manager_->start();
 	if (ret)
 		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+	recordStartupPhase("camera manager", start);
 
 	if (camera_manager_->cameras().size() == 0)
 		throw std::runtime_error("no cameras available");
 
+	start = std::chrono::steady_clock::now();
 	std::string const &cam_id = camera_manager_->cameras()[0]->id();
 	camera_ = camera_manager_->get(cam_id);
 	if (!camera_)
@@ -66,12 +87,15 @@ void LibcameraApp::OpenCamera()
 	if (camera_->acquire())
 		throw std::runtime_error("failed to acquire camera " + cam_id);
 	camera_acquired_ = true;
+	recordStartupPhase("acquire camera", start);
 
 	if (options_->verbose)
 		std::cerr << "Acquired camera " << cam_id << std::endl;
 
-	if (!options_->post_process_file.empty())
-		post_processor_.Read(options_->post_process_file);
+	preview_ = preview_future.get();
+	preview_->SetDoneCallback(std::bind(&LibcameraApp::previewDoneCallback, this, std::placeholders::_1));
+
+	post_process_future.get();
 	// The queue takes over ownership from the post-processor.
 	post_processor_.SetCallback(
 		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
@@ -81,6 +105,10 @@ void LibcameraApp::CloseCamera()
 {
 	preview_.reset();
 
+	// Requests and buffers belong to the camera, so must go before it does.
+	spare_requests_.clear();
+	clearBufferCache();
+
 	if (camera_acquired_)
 		camera_->release();
 	camera_acquired_ = false;
@@ -221,6 +249,77 @@ void LibcameraApp::ConfigureStill(unsigned int flags)
 		std::cerr << "Still capture setup complete" << std::endl;
 }
 
+void LibcameraApp::ConfigureZsl(unsigned int still_flags, unsigned int held_buffers)
+{
+	if (options_->verbose)
+		std::cerr << "Configuring zero shutter lag capture..." << std::endl;
+
+	// A full resolution still stream runs continuously alongside a smaller one for the
+	// preview, so that a capture needs no mode switch. If a low resolution image was
+	// requested, the second stream provides that too, as there's no room for a third.
+	bool have_raw_stream = still_flags & FLAG_STILL_RAW;
+	bool have_lores_stream = options_->lores_width && options_->lores_height;
+	StreamRoles stream_roles = { StreamRole::StillCapture, StreamRole::Viewfinder };
+	if (have_raw_stream)
+		stream_roles.push_back(StreamRole::Raw);
+	configuration_ = camera_->generateConfiguration(stream_roles);
+	if (!configuration_)
+		throw std::runtime_error("failed to generate zero shutter lag configuration");
+
+	if (still_flags & FLAG_STILL_BGR)
+		configuration_->at(0).pixelFormat = libcamera::formats::BGR888;
+	else if (still_flags & FLAG_STILL_RGB)
+		configuration_->at(0).pixelFormat = libcamera::formats::RGB888;
+	else
+		configuration_->at(0).pixelFormat = libcamera::formats::YUV420;
+	if (options_->width)
+		configuration_->at(0).size.width = options_->width;
+	if (options_->height)
+		configuration_->at(0).size.height = options_->height;
+
+	Size still_size = configuration_->at(0).size;
+	Size size = still_size / 4;
+	if (have_lores_stream)
+		size = Size(options_->lores_width, options_->lores_height);
+	else if (options_->viewfinder_width && options_->viewfinder_height)
+		size = Size(options_->viewfinder_width, options_->viewfinder_height);
+	Size max_size;
+	preview_->MaxImageSize(max_size.width, max_size.height);
+	if (!have_lores_stream && max_size.width && max_size.height)
+		size.boundTo(max_size.boundedToAspectRatio(size));
+	size.alignDownTo(2, 2);
+	if (size.width > still_size.width || size.height > still_size.height)
+		throw std::runtime_error("Preview image larger than still image");
+	configuration_->at(1).pixelFormat = libcamera::formats::YUV420;
+	configuration_->at(1).size = size;
+
+	// Every buffer the application holds on to is one the camera can't use, so it needs that
+	// many on top of the few that keep it running. Full resolution buffers are big, though.
+	for (unsigned int i = 0; i < configuration_->size(); i++)
+		configuration_->at(i).bufferCount = held_buffers + 3;
+	if (have_raw_stream && !options_->rawfull)
+		configuration_->at(2).size = still_size;
+	configuration_->transform = options_->transform;
+
+	post_processor_.AdjustConfig("still", &configuration_->at(0));
+
+	// The high quality colour denoise is too slow to run on every frame.
+	configureDenoise(options_->denoise == "auto" ? "cdn_fast" : options_->denoise);
+	setupCapture();
+
+	streams_["still"] = configuration_->at(0).stream();
+	streams_["viewfinder"] = configuration_->at(1).stream();
+	if (have_lores_stream)
+		streams_["lores"] = configuration_->at(1).stream();
+	if (have_raw_stream)
+		streams_["raw"] = configuration_->at(2).stream();
+
+	post_processor_.Configure();
+
+	if (options_->verbose)
+		std::cerr << "Zero shutter lag setup complete" << std::endl;
+}
+
 void LibcameraApp::ConfigureVideo(unsigned int flags)
 {
 	if (options_->verbose)
@@ -296,27 +395,36 @@ void LibcameraApp::Teardown()
 	if (options_->verbose && !options_->help)
 		std::cerr << "Tearing down requests, buffers and configuration" << std::endl;
 
-	for (auto &iter : mapped_buffers_)
-	{
-		// assert(iter.first->planes().size() == iter.second.size());
-		// for (unsigned i = 0; i < iter.first->planes().size(); i++)
-		for (auto &span : iter.second)
-			munmap(span.data(), span.size());
-	}
+	// Unless told otherwise, hang on to the buffers (and their mappings) so that they
+	// don't need to be allocated again if we come back to this same mode.
+	BufferSet buffer_set;
+	buffer_set.allocator = allocator_;
+	buffer_set.mapped_buffers = std::move(mapped_buffers_);
+	buffer_set.frame_buffers = std::move(frame_buffers_);
+	if (options_->mode_cache && mode_cache_supported_ && allocator_ && !buffer_cache_.count(buffer_set_key_))
+		buffer_cache_[buffer_set_key_] = std::move(buffer_set);
+	else
+		freeBuffers(buffer_set);
 	mapped_buffers_.clear();
-
-	delete allocator_;
+	frame_buffers_.clear();
 	allocator_ = nullptr;
+	buffer_set_key_.clear();
 
 	configuration_.reset();
 
-	frame_buffers_.clear();
-
 	streams_.clear();
+
+	// A mode switch is timed from here (plus however long the camera took to stop), so
+	// that whatever the application did in between, such as saving an image, isn't counted.
+	switch_start_time_ = std::chrono::steady_clock::now() - stop_duration_;
+	stop_duration_ = {};
+	switch_pending_.store(true, std::memory_order_release);
 }
 
 void LibcameraApp::StartCamera()
 {
+	auto start = std::chrono::steady_clock::now();
+
 	// This makes all the Request objects that we shall need.
 	makeRequests();
 
@@ -341,7 +449,7 @@ void LibcameraApp::StartCamera()
 	// as long as possible so that we get whatever the exposure profile wants.
 	if (!controls_.contains(controls::FrameDurationLimits))
 	{
-		if (StillStream())
+		if (StillStream() && !ViewfinderStream())
 			controls_.set(controls::FrameDurationLimits, { INT64_C(100), INT64_C(1000000000) });
 		else if (options_->framerate > 0)
 		{
@@ -373,10 +481,32 @@ void LibcameraApp::StartCamera()
 	if (!controls_.contains(controls::Sharpness))
 		controls_.set(controls::Sharpness, options_->sharpness);
 
+	// Let the preview get ready any buffers it might be asked to show, so that it doesn't
+	// have to do so when the first frames arrive.
+	if (preview_)
+	{
+		for (StreamConfiguration &config : *configuration_)
+		{
+			if (config.pixelFormat != libcamera::formats::YUV420)
+				continue;
+			for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(config.stream()))
+				preview_->ImportBuffer(buffer->planes()[0].fd.fd(), Mmap(buffer.get())[0], config.size.width,
+									   config.size.height, config.stride);
+		}
+	}
+
 	post_processor_.Start();
 
 	if (camera_->start(&controls_))
-		throw std::runtime_error("failed to start camera");
+	{
+		// Starting also allocates memory (inside the pipeline handler), which the buffers we're
+		// keeping for other modes might be holding on to.
+		if (buffer_cache_.empty())
+			throw std::runtime_error("failed to start camera");
+		clearBufferCache();
+		if (camera_->start(&controls_))
+			throw std::runtime_error("failed to start camera");
+	}
 	controls_.clear();
 	camera_started_ = true;
 	last_timestamp_ = 0;
@@ -388,6 +518,7 @@ void LibcameraApp::StartCamera()
 		if (camera_->queueRequest(request.get()) < 0)
 			throw std::runtime_error("Failed to queue request");
 	}
+	recordStartupPhase("start camera", start);
 
 	if (options_->verbose)
 		std::cerr << "Camera started!" << std::endl;
@@ -400,8 +531,10 @@ void LibcameraApp::StopCamera()
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
 		if (camera_started_)
 		{
+			auto stop_start = std::chrono::steady_clock::now();
 			if (camera_->stop())
 				throw std::runtime_error("failed to stop camera");
+			stop_duration_ = std::chrono::steady_clock::now() - stop_start;
 
 			post_processor_.Stop();
 
@@ -424,6 +557,12 @@ void LibcameraApp::StopCamera()
 	while (!free_requests_.empty())
 		free_requests_.pop();
 
+	// Request objects aren't tied to any configuration, so keep them for next time.
+	for (std::unique_ptr<Request> &request : requests_)
+	{
+		request->reuse();
+		spare_requests_.push_back(std::move(request));
+	}
 	requests_.clear();
 
 	controls_.clear(); // no need for mutex here
@@ -528,10 +667,13 @@ libcamera::Stream *LibcameraApp::LoresStream(unsigned int *w, unsigned int *h, u
 
 libcamera::Stream *LibcameraApp::GetMainStream() const
 {
-	for (auto &p : streams_)
+	// With zero shutter lag there is a still stream as well as the viewfinder, but it's the
+	// viewfinder that the stages should work on, so that it's what gets shown.
+	for (char const *name : { "viewfinder", "video", "still" })
 	{
-		if (p.first == "viewfinder" || p.first == "still" || p.first == "video")
-			return p.second;
+		auto it = streams_.find(name);
+		if (it != streams_.end())
+			return it->second;
 	}
 
 	return nullptr;
@@ -574,6 +716,8 @@ void LibcameraApp::StreamDimensions(Stream const *stream, unsigned int *w, unsig
 
 void LibcameraApp::setupCapture()
 {
+	auto start = std::chrono::steady_clock::now();
+
 	// First finish setting up the configuration.
 
 	CameraConfiguration::Status validation = configuration_->validate();
@@ -582,11 +726,37 @@ void LibcameraApp::setupCapture()
 	else if (validation == CameraConfiguration::Adjusted)
 		std::cerr << "Stream configuration adjusted" << std::endl;
 
-	if (camera_->configure(configuration_.get()) < 0)
+	int ret = camera_->configure(configuration_.get());
+	if (ret < 0 && !buffer_cache_.empty())
+	{
+		// Some versions of libcamera won't reconfigure the camera while any allocator still
+		// has buffers, so in that case we can't keep them, and stop trying to.
+		if (options_->verbose)
+			std::cerr << "Camera won't reconfigure with buffers cached - disabling the mode cache" << std::endl;
+		clearBufferCache();
+		mode_cache_supported_ = false;
+		ret = camera_->configure(configuration_.get());
+	}
+	if (ret < 0)
 		throw std::runtime_error("failed to configure streams");
 	if (options_->verbose)
 		std::cerr << "Camera streams configured" << std::endl;
 
+	// If we've been in exactly this mode before, we may still have its buffers.
+	buffer_set_key_ = bufferSetKey();
+	auto cached = buffer_cache_.find(buffer_set_key_);
+	if (cached != buffer_cache_.end())
+	{
+		allocator_ = cached->second.allocator;
+		mapped_buffers_ = std::move(cached->second.mapped_buffers);
+		frame_buffers_ = std::move(cached->second.frame_buffers);
+		buffer_cache_.erase(cached);
+		if (options_->verbose)
+			std::cerr << "Reusing buffers from previous configuration" << std::endl;
+		recordStartupPhase("configure", start);
+		return;
+	}
+
 	// Next allocate all the buffers we need, mmap them and store them on a free list.
 
 	allocator_ = new FrameBufferAllocator(camera_);
@@ -595,7 +765,14 @@ void LibcameraApp::setupCapture()
 		Stream *stream = config.stream();
 
 		if (allocator_->allocate(stream) < 0)
-			throw std::runtime_error("failed to allocate capture buffers");
+		{
+			// The buffers we're keeping for other modes may be what's using up the memory.
+			if (buffer_cache_.empty())
+				throw std::runtime_error("failed to allocate capture buffers");
+			clearBufferCache();
+			if (allocator_->allocate(stream) < 0)
+				throw std::runtime_error("failed to allocate capture buffers");
+		}
 
 		for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream))
 		{
@@ -619,6 +796,7 @@ void LibcameraApp::setupCapture()
 	}
 	if (options_->verbose)
 		std::cerr << "Buffers allocated and mapped" << std::endl;
+	recordStartupPhase("configure", start);
 
 	// The requests will be made when StartCamera() is called.
 }
@@ -639,7 +817,14 @@ void LibcameraApp::makeRequests()
 						std::cerr << "Requests created" << std::endl;
 					return;
 				}
-				std::unique_ptr<Request> request = camera_->createRequest();
+				std::unique_ptr<Request> request;
+				if (!spare_requests_.empty())
+				{
+					request = std::move(spare_requests_.back());
+					spare_requests_.pop_back();
+				}
+				else
+					request = camera_->createRequest();
 				if (!request)
 					throw std::runtime_error("failed to make request");
 				requests_.push_back(std::move(request));
@@ -655,6 +840,49 @@ void LibcameraApp::makeRequests()
 	}
 }
 
+// Phases that run in parallel overlap, so the times don't add up to the total. Only the
+// first configuration and start are of interest.
+
+void LibcameraApp::recordStartupPhase(std::string const &name, std::chrono::steady_clock::time_point start)
+{
+	if (startup_reported_)
+		return;
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::lock_guard<std::mutex> lock(startup_mutex_);
+	startup_timings_.emplace_back(name, ms);
+}
+
+// Buffers can only be reused if every stream is configured identically.
+
+std::string LibcameraApp::bufferSetKey() const
+{
+	std::stringstream key;
+	for (StreamConfiguration const &config : *configuration_)
+		key << config.stream() << ":" << config.toString() << "/" << config.stride << "/" << config.bufferCount << " ";
+	return key.str();
+}
+
+void LibcameraApp::freeBuffers(BufferSet &buffer_set)
+{
+	for (auto &iter : buffer_set.mapped_buffers)
+	{
+		for (auto &span : iter.second)
+			munmap(span.data(), span.size());
+	}
+	buffer_set.mapped_buffers.clear();
+	buffer_set.frame_buffers.clear();
+
+	delete buffer_set.allocator;
+	buffer_set.allocator = nullptr;
+}
+
+void LibcameraApp::clearBufferCache()
+{
+	for (auto &iter : buffer_cache_)
+		freeBuffers(iter.second);
+	buffer_cache_.clear();
+}
+
 void LibcameraApp::requestComplete(Request *request)
 {
 	if (request->status() == Request::RequestCancelled)
@@ -669,6 +897,30 @@ void LibcameraApp::requestComplete(Request *request)
 		free_requests_.push(request);
 	}
 
+	if (startup_pending_)
+	{
+		recordStartupPhase("first frame", startup_time_);
+		startup_pending_ = false;
+		startup_reported_ = true;
+		if (options_->verbose)
+		{
+			std::lock_guard<std::mutex> lock(startup_mutex_);
+			std::cerr << "Startup timings:" << std::endl;
+			for (auto const &timing : startup_timings_)
+				std::cerr << "    " << timing.first << ": " << timing.second << "ms" << std::endl;
+		}
+	}
+
+	if (switch_pending_.exchange(false, std::memory_order_acquire))
+	{
+		if (options_->verbose)
+		{
+			auto latency = std::chrono::steady_clock::now() - switch_start_time_;
+			std::cerr << "Mode switch took "
+					  << std::chrono::duration_cast<std::chrono::milliseconds>(latency).count() << "ms" << std::endl;
+		}
+	}
+
 	// We calculate the instantaneous framerate in case anyone wants it.
 	uint64_t timestamp = payload->buffers.begin()->second->metadata().timestamp;
 	if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
@@ -691,6 +943,7 @@ void LibcameraApp::previewDoneCallback(int fd)
 
 void LibcameraApp::previewThread()
 {
+	InfoTextTemplate info_text(options_->info_text);
 	while (true)
 	{
 		PreviewItem item;
@@ -734,8 +987,9 @@ void LibcameraApp::previewThread()
 		preview_->Show(fd, span, w, h, stride);
 		if (!options_->info_text.empty())
 		{
-			std::string s = frame_info.ToString(options_->info_text);
-			preview_->SetInfoText(s);
+			if (info_text.Text() != options_->info_text)
+				info_text.Compile(options_->info_text);
+			preview_->SetInfoText(info_text.Render(frame_info));
 		}
 	}
 }
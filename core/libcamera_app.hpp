@@ -9,6 +9,8 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
 #include <memory>
@@ -58,7 +60,8 @@ public:
 	enum class MsgType
 	{
 		RequestComplete,
-		Quit
+		Quit,
+		Wakeup // posted by the application itself, to make Wait() return
 	};
 	typedef std::variant<CompletedRequestPtr> MsgPayload;
 	struct Msg
@@ -96,6 +99,7 @@ public:
 	void ConfigureViewfinder();
 	void ConfigureStill(unsigned int flags = FLAG_STILL_NONE);
 	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE);
+	void ConfigureZsl(unsigned int still_flags = FLAG_STILL_NONE, unsigned int held_buffers = 0);
 
 	void Teardown();
 	void StartCamera();
@@ -122,6 +126,8 @@ public:
 	void StreamDimensions(Stream const *stream, unsigned int *w, unsigned int *h, unsigned int *stride) const;
 
 protected:
+	void recordStartupPhase(std::string const &name, std::chrono::steady_clock::time_point start);
+
 	std::unique_ptr<Options> options_;
 
 private:
@@ -169,9 +175,19 @@ private:
 		CompletedRequestPtr completed_request;
 		Stream *stream;
 	};
+	// Everything allocated for one camera mode, kept so that going back to that mode is quick.
+	struct BufferSet
+	{
+		FrameBufferAllocator *allocator = nullptr;
+		std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers;
+		std::map<Stream *, std::queue<FrameBuffer *>> frame_buffers;
+	};
 
 	void setupCapture();
 	void makeRequests();
+	std::string bufferSetKey() const;
+	void freeBuffers(BufferSet &buffer_set);
+	void clearBufferCache();
 	void queueRequest(CompletedRequest *completed_request);
 	void requestComplete(Request *request);
 	void previewDoneCallback(int fd);
@@ -189,6 +205,19 @@ private:
 	std::mutex free_requests_mutex_;
 	std::queue<Request *> free_requests_;
 	std::vector<std::unique_ptr<Request>> requests_;
+	std::vector<std::unique_ptr<Request>> spare_requests_;
+	std::map<std::string, BufferSet> buffer_cache_;
+	std::string buffer_set_key_;
+	bool mode_cache_supported_ = true;
+	// Set by the application's thread, and read in libcamera's when the next frame arrives.
+	std::chrono::steady_clock::time_point switch_start_time_;
+	std::chrono::steady_clock::duration stop_duration_ = {};
+	std::atomic<bool> switch_pending_ = false;
+	std::mutex startup_mutex_;
+	std::vector<std::pair<std::string, double>> startup_timings_;
+	std::chrono::steady_clock::time_point startup_time_;
+	std::atomic<bool> startup_pending_ = false;
+	std::atomic<bool> startup_reported_ = false;
 	std::set<CompletedRequest *> known_completed_requests_;
 	bool camera_started_ = false;
 	std::mutex camera_stop_mutex_;
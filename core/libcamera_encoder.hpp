@@ -5,7 +5,10 @@
  * libcamera_encoder.cpp - libcamera video encoding class.
  */
 
+#include <future>
+
 #include "core/libcamera_app.hpp"
+#include "core/roi_background.hpp"
 #include "core/video_options.hpp"
 #include "encoder/encoder.hpp"
 
@@ -18,56 +21,133 @@ public:
 	using FrameBuffer = libcamera::FrameBuffer;
 
 	LibcameraEncoder() : LibcameraApp(std::make_unique<VideoOptions>()) {}
+	LibcameraEncoder(std::unique_ptr<VideoOptions> opts) : LibcameraApp(std::move(opts)) {}
 
+	// Opening and setting up the encoder device can happen while the camera starts; we only
+	// need to wait for it when the first frame is encoded.
 	void StartEncoder()
 	{
-		createEncoder();
-		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
-		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encoder_future_ = std::async(std::launch::async, [this]() {
+			auto start = std::chrono::steady_clock::now();
+			createEncoder();
+			encoder_->SetInputDoneCallback(std::bind(&BufferQueue::Pop, &buffer_queue_, std::placeholders::_1));
+			encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+			for (auto &extra : extra_encoders_)
+			{
+				extra->encoder = std::unique_ptr<Encoder>(Encoder::Create(extra->options.get()));
+				extra->encoder->SetInputDoneCallback(
+					std::bind(&BufferQueue::Pop, &extra->buffer_queue, std::placeholders::_1));
+				extra->encoder->SetOutputReadyCallback(extra->callback);
+			}
+			recordStartupPhase("encoder", start);
+		});
 	}
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
 	void EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
+		if (encoder_future_.valid())
+			encoder_future_.get();
 		assert(encoder_);
-		unsigned int w, h, stride;
-		StreamDimensions(stream, &w, &h, &stride);
-		FrameBuffer *buffer = completed_request->buffers[stream];
-		libcamera::Span span = Mmap(buffer)[0];
-		void *mem = span.data();
-		if (!buffer || !mem)
-			throw std::runtime_error("no buffer to encode");
-		int64_t timestamp_ns = buffer->metadata().timestamp;
+		if (GetOptions()->roi_downsample)
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			std::vector<libcamera::Rectangle> regions;
+			if (get_regions_of_interest(completed_request->post_process_metadata, regions))
+				encoder_->SetRegionsOfInterest(regions);
 		}
-		encoder_->EncodeBuffer(buffer->planes()[0].fd.fd(), span.size(), mem, w, h, stride, timestamp_ns / 1000);
+		encodeBuffer(encoder_.get(), buffer_queue_, completed_request, stream);
+	}
+	// Further encoders may run alongside the main one, each with its own options and output,
+	// typically to encode the low resolution stream as well. Add them before StartEncoder;
+	// the number returned identifies the encoder to the EncodeBuffer below.
+	unsigned int AddEncoder(std::unique_ptr<VideoOptions> options, EncodeOutputReadyCallback callback)
+	{
+		extra_encoders_.push_back(std::make_unique<ExtraEncoder>());
+		extra_encoders_.back()->options = std::move(options);
+		extra_encoders_.back()->callback = callback;
+		return extra_encoders_.size() - 1;
+	}
+	void EncodeBuffer(unsigned int id, CompletedRequestPtr &completed_request, Stream *stream)
+	{
+		if (encoder_future_.valid())
+			encoder_future_.get();
+		ExtraEncoder &extra = *extra_encoders_.at(id);
+		encodeBuffer(extra.encoder.get(), extra.buffer_queue, completed_request, stream);
+	}
+	// For changing the encoding on the fly. Waits for the encoder to be ready.
+	Encoder *GetEncoder()
+	{
+		if (encoder_future_.valid())
+			encoder_future_.get();
+		return encoder_.get();
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
-	void StopEncoder() { encoder_.reset(); }
+	void StopEncoder()
+	{
+		if (encoder_future_.valid())
+			encoder_future_.get();
+		encoder_.reset();
+		for (auto &extra : extra_encoders_)
+			extra->encoder.reset();
+	}
 
 protected:
 	virtual void createEncoder() { encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions())); }
 	std::unique_ptr<Encoder> encoder_;
 
 private:
-	void encodeBufferDone(void *mem)
+	// Each encoder holds a reference to the requests whose buffers it is still using.
+	class BufferQueue
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+	public:
+		void Push(CompletedRequestPtr &completed_request)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			queue_.push(completed_request); // creates a new reference
+		}
+		void Pop(void *mem)
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
+			// If non-NULL, mem would indicate which buffer has been completed, but
+			// currently we're just assuming everything is done in order. (We could
+			// handle this by replacing the queue with a vector of <mem, completed_request>
+			// pairs.)
+			assert(mem == nullptr);
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (queue_.empty())
 				throw std::runtime_error("no buffer available to return");
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			queue_.pop(); // drop shared_ptr reference
 		}
+
+	private:
+		std::queue<CompletedRequestPtr> queue_;
+		std::mutex mutex_;
+	};
+
+	struct ExtraEncoder
+	{
+		std::unique_ptr<VideoOptions> options;
+		std::unique_ptr<Encoder> encoder;
+		EncodeOutputReadyCallback callback;
+		BufferQueue buffer_queue;
+	};
+
+	void encodeBuffer(Encoder *encoder, BufferQueue &buffer_queue, CompletedRequestPtr &completed_request,
+					  Stream *stream)
+	{
+		unsigned int w, h, stride;
+		StreamDimensions(stream, &w, &h, &stride);
+		FrameBuffer *buffer = completed_request->buffers[stream];
+		libcamera::Span span = Mmap(buffer)[0];
+		void *mem = span.data();
+		if (!buffer || !mem)
+			throw std::runtime_error("no buffer to encode");
+		int64_t timestamp_ns = buffer->metadata().timestamp;
+		buffer_queue.Push(completed_request);
+		encoder->EncodeBuffer(buffer->planes()[0].fd.fd(), span.size(), mem, w, h, stride, timestamp_ns / 1000);
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
-	std::mutex encode_buffer_queue_mutex_;
+	std::future<void> encoder_future_;
+	BufferQueue buffer_queue_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
+	std::vector<std::unique_ptr<ExtraEncoder>> extra_encoders_;
 };
@@ -49,6 +49,9 @@ struct Options
 			 "Set the output file name")
 			("post-process-file", value<std::string>(&post_process_file),
 			 "Set the file name for configuring the post-processing")
+			("roi-downsample", value<unsigned int>(&roi_downsample)->default_value(0),
+			 "Coarsen JPEG and MJPEG images by this factor (2, 4, 8 or 16) outside any objects or faces "
+			 "found by post-processing (0 = off)")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
 			 "Force use of full resolution raw frames")
 			("nopreview,n", value<bool>(&nopreview)->default_value(false)->implicit_value(true),
@@ -99,6 +102,8 @@ struct Options
 			 "Width of viewfinder frames from the camera (distinct from the preview window size")
 			("viewfinder-height", value<unsigned int>(&viewfinder_height)->default_value(0),
 			 "Height of viewfinder frames from the camera (distinct from the preview window size)")
+			("mode-cache", value<bool>(&mode_cache)->default_value(false)->implicit_value(true),
+			 "Keep the buffers for each camera mode so that switching back to it is faster (uses more memory)")
 			("tuning-file", value<std::string>(&tuning_file)->default_value("-"),
 			 "Name of camera tuning file to use, omit this option for libcamera default behaviour")
 			("lores-width", value<unsigned int>(&lores_width)->default_value(0),
@@ -117,6 +122,7 @@ struct Options
 	std::string config_file;
 	std::string output;
 	std::string post_process_file;
+	unsigned int roi_downsample;
 	unsigned int width;
 	unsigned int height;
 	bool rawfull;
@@ -150,6 +156,7 @@ struct Options
 	std::string info_text;
 	unsigned int viewfinder_width;
 	unsigned int viewfinder_height;
+	bool mode_cache;
 	std::string tuning_file;
 	bool qt_preview;
 	unsigned int lores_width;
@@ -240,6 +247,10 @@ struct Options
 		if (sscanf(awbgains.c_str(), "%f,%f", &awb_gain_r, &awb_gain_b) != 2)
 			throw std::runtime_error("Invalid AWB gains");
 
+		if (roi_downsample && roi_downsample != 2 && roi_downsample != 4 && roi_downsample != 8 &&
+			roi_downsample != 16)
+			throw std::runtime_error("roi-downsample must be 0, 2, 4, 8 or 16");
+
 		brightness = std::clamp(brightness, -1.0f, 1.0f);
 		contrast = std::clamp(contrast, 0.0f, 15.99f); // limits are arbitrary..
 		saturation = std::clamp(saturation, 0.0f, 15.99f); // limits are arbitrary..
@@ -264,6 +275,7 @@ struct Options
 		std::cerr << "    height: " << height << std::endl;
 		std::cerr << "    output: " << output << std::endl;
 		std::cerr << "    post_process_file: " << post_process_file << std::endl;
+		std::cerr << "    roi-downsample: " << roi_downsample << std::endl;
 		std::cerr << "    rawfull: " << rawfull << std::endl;
 		if (nopreview)
 			std::cerr << "    preview: none" << std::endl;
@@ -300,6 +312,7 @@ struct Options
 		std::cerr << "    denoise: " << denoise << std::endl;
 		std::cerr << "    viewfinder-width: " << viewfinder_width << std::endl;
 		std::cerr << "    viewfinder-height: " << viewfinder_height << std::endl;
+		std::cerr << "    mode-cache: " << mode_cache << std::endl;
 		std::cerr << "    tuning-file: " << (tuning_file == "-" ? "(libcamera)" : tuning_file) << std::endl;
 		std::cerr << "    lores-width: " << lores_width << std::endl;
 		std::cerr << "    lores-height: " << lores_height << std::endl;
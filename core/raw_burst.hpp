@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * raw_burst.hpp - a ring of raw frames held in memory for burst capture.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/control_ids.h>
+#include <libcamera/controls.h>
+
+// During a burst, raw frames arrive at the sensor's full rate, which is too fast for
+// converting and writing each one as a DNG. Instead we copy the packed frames into a ring
+// of buffers allocated (and touched) in advance, along with the metadata the DNG needs
+// for each frame, and convert them once the burst is over. When the ring is full, pushing
+// another frame overwrites the oldest one.
+
+class RawBurst
+{
+public:
+	// Just the metadata that dng_save uses. Copying a whole ControlList would allocate, so
+	// these are kept in fixed storage and only turned back into a ControlList afterwards.
+	struct Metadata
+	{
+		bool has_black_levels = false, has_exposure_time = false, has_analogue_gain = false;
+		bool has_colour_gains = false, has_ccm = false;
+		std::array<int32_t, 4> black_levels;
+		int32_t exposure_time;
+		float analogue_gain;
+		std::array<float, 2> colour_gains;
+		std::array<float, 9> ccm;
+
+		void Read(libcamera::ControlList const &metadata)
+		{
+			using namespace libcamera;
+			if ((has_black_levels = metadata.contains(controls::SensorBlackLevels)))
+				copySpan(metadata.get(controls::SensorBlackLevels), black_levels);
+			if ((has_exposure_time = metadata.contains(controls::ExposureTime)))
+				exposure_time = metadata.get(controls::ExposureTime);
+			if ((has_analogue_gain = metadata.contains(controls::AnalogueGain)))
+				analogue_gain = metadata.get(controls::AnalogueGain);
+			if ((has_colour_gains = metadata.contains(controls::ColourGains)))
+				copySpan(metadata.get(controls::ColourGains), colour_gains);
+			if ((has_ccm = metadata.contains(controls::ColourCorrectionMatrix)))
+				copySpan(metadata.get(controls::ColourCorrectionMatrix), ccm);
+		}
+
+		libcamera::ControlList ToControlList() const
+		{
+			using namespace libcamera;
+			ControlList metadata(controls::controls);
+			if (has_black_levels)
+				metadata.set(controls::SensorBlackLevels, Span<const int32_t>(black_levels.data(), black_levels.size()));
+			if (has_exposure_time)
+				metadata.set(controls::ExposureTime, exposure_time);
+			if (has_analogue_gain)
+				metadata.set(controls::AnalogueGain, analogue_gain);
+			if (has_colour_gains)
+				metadata.set(controls::ColourGains, Span<const float>(colour_gains.data(), colour_gains.size()));
+			if (has_ccm)
+				metadata.set(controls::ColourCorrectionMatrix, Span<const float>(ccm.data(), ccm.size()));
+			return metadata;
+		}
+
+	private:
+		template <typename T, size_t N>
+		static void copySpan(libcamera::Span<const T> const &src, std::array<T, N> &dest)
+		{
+			dest.fill(0);
+			std::copy_n(src.begin(), std::min(src.size(), N), dest.begin());
+		}
+	};
+
+	struct Frame
+	{
+		std::vector<uint8_t> data;
+		size_t size = 0;
+		Metadata metadata;
+	};
+
+	// Make room for num_frames frames of up to frame_size bytes. Buffers are only
+	// reallocated if they aren't already suitable. Any frames held are discarded.
+	void Allocate(unsigned int num_frames, size_t frame_size)
+	{
+		if (frames_.size() != num_frames || frame_size_ < frame_size)
+		{
+			frames_.clear();
+			frames_.resize(num_frames);
+			for (auto &frame : frames_)
+				frame.data.resize(frame_size);
+			frame_size_ = frame_size;
+		}
+		Clear();
+	}
+
+	void Clear()
+	{
+		next_ = 0;
+		count_ = 0;
+	}
+
+	unsigned int Capacity() const { return frames_.size(); }
+	unsigned int Size() const { return count_; }
+	bool Full() const { return count_ == frames_.size(); }
+
+	void Push(libcamera::Span<uint8_t> const &mem, libcamera::ControlList const &metadata)
+	{
+		if (frames_.empty())
+			throw std::runtime_error("RawBurst: no frames allocated");
+		Frame &frame = frames_[next_];
+		frame.size = std::min(mem.size(), frame.data.size());
+		memcpy(frame.data.data(), mem.data(), frame.size);
+		frame.metadata.Read(metadata);
+		next_ = (next_ + 1) % frames_.size();
+		count_ = std::min<unsigned int>(count_ + 1, frames_.size());
+	}
+
+	// Frames in the order they were captured, oldest first (0 <= i < Size()).
+	Frame const &operator[](unsigned int i) const
+	{
+		return frames_[(next_ + frames_.size() - count_ + i) % frames_.size()];
+	}
+
+private:
+	std::vector<Frame> frames_;
+	size_t frame_size_ = 0;
+	unsigned int next_ = 0;
+	unsigned int count_ = 0;
+};
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * roi_background.hpp - coarsen the parts of an image outside its regions of interest.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+#include "core/metadata.hpp"
+#include "post_processing_stages/object_detect.hpp"
+
+// libjpeg can only use one set of quantisation tables for the whole image, so instead of
+// quantising the background more coarsely we take the detail out of it before encoding.
+// Every pixel in a factor x factor cell outside the regions of interest is replaced by the
+// cell's average. A cell that is flat all the way through an 8x8 block leaves only the
+// block's DC coefficient, which costs almost nothing to encode, while the regions of
+// interest stay at full quality. Work is done in whole 16x16 macroblocks so that luma
+// and chroma agree.
+
+// Collect the object and face detections left by the post-processing stages. Returns false
+// if there were none to look at, which is different from there being nothing detected.
+inline bool get_regions_of_interest(Metadata const &post_process_metadata, std::vector<libcamera::Rectangle> &regions)
+{
+	bool found = false;
+	std::vector<Detection> detections;
+	if (post_process_metadata.Get("object_detect.results", detections) == 0)
+	{
+		for (auto const &d : detections)
+			regions.push_back(d.box);
+		found = true;
+	}
+	std::vector<libcamera::Rectangle> faces;
+	if (post_process_metadata.Get("detected_faces", faces) == 0)
+	{
+		regions.insert(regions.end(), faces.begin(), faces.end());
+		found = true;
+	}
+	return found;
+}
+
+// Average the factor x factor cells of one plane within the rectangle (x0,y0) to (x1,y1),
+// which must be a whole number of cells.
+inline void roi_average_cells(uint8_t *plane, unsigned int stride, unsigned int x0, unsigned int y0,
+							  unsigned int x1, unsigned int y1, unsigned int factor)
+{
+	unsigned int shift = __builtin_ctz(factor) * 2;
+	for (unsigned int y = y0; y < y1; y += factor)
+	{
+		for (unsigned int x = x0; x < x1; x += factor)
+		{
+			unsigned int sum = 0;
+			for (unsigned int j = 0; j < factor; j++)
+			{
+				uint8_t const *row = plane + (y + j) * stride + x;
+				for (unsigned int i = 0; i < factor; i++)
+					sum += row[i];
+			}
+			uint8_t average = (sum + (1 << shift >> 1)) >> shift;
+			for (unsigned int j = 0; j < factor; j++)
+				memset(plane + (y + j) * stride + x, average, factor);
+		}
+	}
+}
+
+// Coarsen the background of a YUV420 image in place. Only whole macroblocks are touched, so
+// any ragged edge at the right or bottom keeps its detail.
+inline void roi_coarsen_background(uint8_t *mem, unsigned int width, unsigned int height, unsigned int stride,
+								   std::vector<libcamera::Rectangle> const &regions, unsigned int factor)
+{
+	if (factor < 2)
+		return;
+	unsigned int mb_cols = width / 16, mb_rows = height / 16;
+
+	// Mark the macroblocks that any region touches.
+	std::vector<uint8_t> keep(mb_cols * mb_rows, 0);
+	for (auto const &r : regions)
+	{
+		int x0 = std::max(r.x, 0) / 16, y0 = std::max(r.y, 0) / 16;
+		int x1 = std::min<int>((r.x + (int)r.width + 15) / 16, mb_cols);
+		int y1 = std::min<int>((r.y + (int)r.height + 15) / 16, mb_rows);
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				keep[y * mb_cols + x] = 1;
+	}
+
+	unsigned int stride2 = stride / 2;
+	uint8_t *Y = mem;
+	uint8_t *U = Y + stride * height;
+	uint8_t *V = U + stride2 * (height / 2);
+	for (unsigned int mb_y = 0; mb_y < mb_rows; mb_y++)
+	{
+		for (unsigned int mb_x = 0; mb_x < mb_cols; mb_x++)
+		{
+			if (keep[mb_y * mb_cols + mb_x])
+				continue;
+			unsigned int x = mb_x * 16, y = mb_y * 16;
+			roi_average_cells(Y, stride, x, y, x + 16, y + 16, factor);
+			if (factor > 2)
+			{
+				roi_average_cells(U, stride2, x / 2, y / 2, x / 2 + 8, y / 2 + 8, factor / 2);
+				roi_average_cells(V, stride2, x / 2, y / 2, x / 2 + 8, y / 2 + 8, factor / 2);
+			}
+		}
+	}
+}
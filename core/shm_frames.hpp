@@ -0,0 +1,250 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_frames.hpp - publish camera frames to other processes through shared memory.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <libcamera/base/span.h>
+#include <libcamera/control_ids.h>
+#include <libcamera/controls.h>
+
+// The publisher creates a POSIX shared memory segment holding a header and a ring of frame
+// slots. Each slot is protected by a sequence lock: its count is odd while the publisher
+// is writing it, so a reader that sees the same even count before and after looking at a
+// frame knows it wasn't overwritten in the meantime. The publisher never waits for anyone;
+// slow readers simply miss frames, or find that the frame they were using has gone.
+//
+// Readers use the frames directly in the shared memory, without copying them.
+
+static constexpr uint32_t SHM_FRAMES_MAGIC = 0x4d484653; // "SFHM"
+static constexpr uint32_t SHM_FRAMES_VERSION = 1;
+
+// Everything here must work between processes, so must not rely on a lock.
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared memory frames need lock-free atomics");
+
+struct ShmFramesHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t slot_offset; // of the first slot, from the start of the segment
+	uint32_t slot_stride; // bytes from one slot to the next
+	uint32_t data_offset; // of the image, from the start of each slot
+	uint32_t frame_size;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixel_format; // fourcc
+	std::atomic<uint32_t> published; // number of frames published so far
+};
+
+struct ShmFrameSlot
+{
+	std::atomic<uint32_t> lock; // odd while being written
+	uint32_t sequence;
+	int64_t timestamp_ns;
+	uint32_t size;
+	float exposure_time;
+	float analogue_gain;
+	float digital_gain;
+	float colour_gains[2];
+};
+
+class ShmFramePublisher
+{
+public:
+	ShmFramePublisher(std::string const &name, unsigned int num_slots, unsigned int width, unsigned int height,
+					  unsigned int stride, uint32_t pixel_format, size_t frame_size)
+		: name_(name)
+	{
+		if (num_slots < 2)
+			throw std::runtime_error("ShmFramePublisher: at least 2 slots required");
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t slot_offset = align(sizeof(ShmFramesHeader), page);
+		size_t data_offset = align(sizeof(ShmFrameSlot), 64);
+		size_t slot_stride = align(data_offset + frame_size, page);
+		size_ = slot_offset + num_slots * slot_stride;
+
+		shm_unlink(name_.c_str());
+		int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (fd < 0)
+			throw std::runtime_error("ShmFramePublisher: failed to create " + name_);
+		if (ftruncate(fd, size_) < 0)
+		{
+			close(fd);
+			shm_unlink(name_.c_str());
+			throw std::runtime_error("ShmFramePublisher: failed to size " + name_);
+		}
+		mem_ = (uint8_t *)mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem_ == MAP_FAILED)
+		{
+			shm_unlink(name_.c_str());
+			throw std::runtime_error("ShmFramePublisher: failed to map " + name_);
+		}
+
+		// Readers may attach any time, so they check the magic number is there last.
+		header_ = new (mem_) ShmFramesHeader;
+		header_->version = SHM_FRAMES_VERSION;
+		header_->num_slots = num_slots;
+		header_->slot_offset = slot_offset;
+		header_->slot_stride = slot_stride;
+		header_->data_offset = data_offset;
+		header_->frame_size = frame_size;
+		header_->width = width;
+		header_->height = height;
+		header_->stride = stride;
+		header_->pixel_format = pixel_format;
+		header_->published.store(0, std::memory_order_relaxed);
+		for (unsigned int i = 0; i < num_slots; i++)
+			new (mem_ + slot_offset + i * slot_stride) ShmFrameSlot{};
+		std::atomic_thread_fence(std::memory_order_release);
+		header_->magic = SHM_FRAMES_MAGIC;
+	}
+	~ShmFramePublisher()
+	{
+		munmap(mem_, size_);
+		shm_unlink(name_.c_str());
+	}
+
+	void Publish(libcamera::Span<uint8_t> const &frame, unsigned int sequence, libcamera::ControlList const &metadata)
+	{
+		uint32_t n = header_->published.load(std::memory_order_relaxed);
+		uint8_t *base = mem_ + header_->slot_offset + (n % header_->num_slots) * header_->slot_stride;
+		ShmFrameSlot *slot = reinterpret_cast<ShmFrameSlot *>(base);
+
+		uint32_t lock = slot->lock.load(std::memory_order_relaxed);
+		slot->lock.store(lock + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		slot->sequence = sequence;
+		slot->timestamp_ns = metadata.contains(libcamera::controls::SensorTimestamp)
+								 ? metadata.get(libcamera::controls::SensorTimestamp)
+								 : 0;
+		slot->exposure_time = metadata.contains(libcamera::controls::ExposureTime)
+								  ? metadata.get(libcamera::controls::ExposureTime)
+								  : 0;
+		slot->analogue_gain = metadata.contains(libcamera::controls::AnalogueGain)
+								  ? metadata.get(libcamera::controls::AnalogueGain)
+								  : 0;
+		slot->digital_gain = metadata.contains(libcamera::controls::DigitalGain)
+								 ? metadata.get(libcamera::controls::DigitalGain)
+								 : 0;
+		slot->colour_gains[0] = slot->colour_gains[1] = 0;
+		if (metadata.contains(libcamera::controls::ColourGains))
+		{
+			libcamera::Span<const float> gains = metadata.get(libcamera::controls::ColourGains);
+			slot->colour_gains[0] = gains[0], slot->colour_gains[1] = gains[1];
+		}
+		slot->size = std::min<size_t>(frame.size(), header_->frame_size);
+		memcpy(base + header_->data_offset, frame.data(), slot->size);
+
+		slot->lock.store(lock + 2, std::memory_order_release);
+		header_->published.store(n + 1, std::memory_order_release);
+	}
+
+private:
+	static size_t align(size_t n, size_t alignment) { return (n + alignment - 1) / alignment * alignment; }
+
+	std::string name_;
+	uint8_t *mem_;
+	size_t size_;
+	ShmFramesHeader *header_;
+};
+
+class ShmFrameSubscriber
+{
+public:
+	struct Frame
+	{
+		ShmFrameSlot const *slot = nullptr;
+		uint8_t const *data = nullptr;
+		uint32_t lock = 0;
+	};
+
+	ShmFrameSubscriber(std::string const &name)
+	{
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd < 0)
+			throw std::runtime_error("ShmFrameSubscriber: failed to open " + name);
+		off_t size = lseek(fd, 0, SEEK_END);
+		mem_ = size > 0 ? (uint8_t *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : (uint8_t *)MAP_FAILED;
+		close(fd);
+		if (mem_ == MAP_FAILED)
+			throw std::runtime_error("ShmFrameSubscriber: failed to map " + name);
+		size_ = size;
+		header_ = reinterpret_cast<ShmFramesHeader const *>(mem_);
+		if (header_->magic != SHM_FRAMES_MAGIC || header_->version != SHM_FRAMES_VERSION)
+		{
+			munmap((void *)mem_, size_);
+			throw std::runtime_error("ShmFrameSubscriber: " + name + " is not a frame segment");
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		last_ = header_->published.load(std::memory_order_acquire);
+	}
+	~ShmFrameSubscriber() { munmap((void *)mem_, size_); }
+
+	ShmFramesHeader const &Info() const { return *header_; }
+
+	// Wait for a frame newer than the last one returned, giving the most recent one. Returns
+	// false if none arrived within the timeout.
+	bool Next(Frame &frame, std::chrono::milliseconds timeout)
+	{
+		auto end = std::chrono::steady_clock::now() + timeout;
+		while (true)
+		{
+			uint32_t published = header_->published.load(std::memory_order_acquire);
+			if (published != last_)
+			{
+				ShmFrameSlot const *slot = reinterpret_cast<ShmFrameSlot const *>(
+					mem_ + header_->slot_offset + ((published - 1) % header_->num_slots) * header_->slot_stride);
+				uint32_t lock = slot->lock.load(std::memory_order_acquire);
+				if (!(lock & 1))
+				{
+					dropped_ += last_ ? published - last_ - 1 : 0;
+					last_ = published;
+					frame.slot = slot;
+					frame.data = reinterpret_cast<uint8_t const *>(slot) + header_->data_offset;
+					frame.lock = lock;
+					return true;
+				}
+			}
+			if (std::chrono::steady_clock::now() > end)
+				return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	// Call this once finished with a frame: false means the publisher overwrote it while we
+	// were looking, so whatever we made of it should be discarded.
+	bool Valid(Frame const &frame) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return frame.slot->lock.load(std::memory_order_relaxed) == frame.lock;
+	}
+
+	uint32_t Dropped() const { return dropped_; }
+
+private:
+	uint8_t const *mem_;
+	size_t size_;
+	ShmFramesHeader const *header_;
+	uint32_t last_ = 0;
+	uint32_t dropped_ = 0;
+};
@@ -41,6 +41,12 @@ struct StillOptions : public Options
 			 "Set the desired output encoding, either jpg, png, rgb, bmp or yuv420")
 			("raw,r", value<bool>(&raw)->default_value(false)->implicit_value(true),
 			 "Also save raw file in DNG format")
+			("burst", value<unsigned int>(&burst)->default_value(0),
+			 "Capture this many raw frames at the full frame rate, saving them as DNG files afterwards")
+			("zsl", value<unsigned int>(&zsl)->default_value(0),
+			 "Zero shutter lag: keep this many recent full resolution frames and save the one nearest the trigger")
+			("zsl-lag", value<unsigned int>(&zsl_lag)->default_value(0),
+			 "With zero shutter lag, save the frame from this many milliseconds before the trigger")
 			("latest", value<std::string>(&latest),
 			 "Create a symbolic link with this name to most recent saved file")
 			("immediate", value<bool>(&immediate)->default_value(false)->implicit_value(true),
@@ -61,6 +67,9 @@ struct StillOptions : public Options
 	unsigned int thumb_width, thumb_height, thumb_quality;
 	std::string encoding;
 	bool raw;
+	unsigned int burst;
+	unsigned int zsl;
+	unsigned int zsl_lag;
 	std::string latest;
 	bool immediate;
 
@@ -84,6 +93,10 @@ struct StillOptions : public Options
 			encoding = "bmp";
 		else
 			throw std::runtime_error("invalid encoding format " + encoding);
+		if (burst)
+			raw = true;
+		if (burst && zsl)
+			throw std::runtime_error("burst and zsl options are mutually exclusive");
 		return true;
 	}
 	virtual void Print() const override
@@ -92,6 +105,9 @@ struct StillOptions : public Options
 		std::cerr << "    encoding: " << encoding << std::endl;
 		std::cerr << "    quality: " << quality << std::endl;
 		std::cerr << "    raw: " << raw << std::endl;
+		std::cerr << "    burst: " << burst << std::endl;
+		std::cerr << "    zsl: " << zsl << std::endl;
+		std::cerr << "    zsl-lag: " << zsl_lag << std::endl;
 		std::cerr << "    restart: " << restart << std::endl;
 		std::cerr << "    timelapse: " << timelapse << std::endl;
 		std::cerr << "    framestart: " << framestart << std::endl;
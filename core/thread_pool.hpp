@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * thread_pool.hpp - a small pool of worker threads for data-parallel jobs.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that can be handed a "parallel for" loop. Jobs are
+// numbered 0 to num_jobs - 1 and are handed out to whichever thread is free, the
+// calling thread included. This saves creating and destroying threads every time
+// we want to split some image processing into bands. Each job is also told the index
+// (0 to Size() - 1) of the thread running it, so that scratch memory can be kept per
+// thread.
+
+class ThreadPool
+{
+public:
+	// A num_threads of zero means "one per core". The calling thread counts as one of them.
+	ThreadPool(unsigned int num_threads = 0)
+	{
+		if (!num_threads)
+			num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned int i = 1; i < num_threads; i++)
+			threads_.emplace_back(&ThreadPool::workerThread, this, i);
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+			work_cond_.notify_all();
+		}
+		for (auto &t : threads_)
+			t.join();
+	}
+
+	unsigned int Size() const { return threads_.size() + 1; }
+
+	using JobFunc = std::function<void(unsigned int job, unsigned int thread)>;
+
+	// Run fn(job, thread) for every job, returning only when they have all finished. If
+	// any of them threw, the first exception is re-thrown here.
+	void ParallelFor(unsigned int num_jobs, JobFunc const &fn)
+	{
+		std::lock_guard<std::mutex> run_lock(run_mutex_);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			fn_ = &fn;
+			num_jobs_ = num_jobs;
+			next_job_ = 0;
+			jobs_done_ = 0;
+			exception_ = nullptr;
+			generation_++;
+			work_cond_.notify_all();
+		}
+
+		runJobs(0);
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_cond_.wait(lock, [this] { return jobs_done_ == num_jobs_; });
+		fn_ = nullptr;
+		if (exception_)
+			std::rethrow_exception(exception_);
+	}
+
+private:
+	void runJobs(unsigned int thread)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (fn_ && next_job_ < num_jobs_)
+		{
+			unsigned int job = next_job_++;
+			JobFunc const &fn = *fn_;
+			lock.unlock();
+			try
+			{
+				fn(job, thread);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> exception_lock(exception_mutex_);
+				if (!exception_)
+					exception_ = std::current_exception();
+			}
+			lock.lock();
+			if (++jobs_done_ == num_jobs_)
+				done_cond_.notify_all();
+		}
+	}
+
+	void workerThread(unsigned int thread)
+	{
+		unsigned int generation = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				work_cond_.wait(lock, [&] { return abort_ || generation_ != generation; });
+				if (abort_)
+					return;
+				generation = generation_;
+			}
+			runJobs(thread);
+		}
+	}
+
+	std::vector<std::thread> threads_;
+	std::mutex run_mutex_; // only one ParallelFor at a time
+	std::mutex mutex_;
+	std::condition_variable work_cond_;
+	std::condition_variable done_cond_;
+	JobFunc const *fn_ = nullptr;
+	unsigned int num_jobs_ = 0;
+	unsigned int next_job_ = 0;
+	unsigned int jobs_done_ = 0;
+	unsigned int generation_ = 0;
+	bool abort_ = false;
+	std::mutex exception_mutex_;
+	std::exception_ptr exception_;
+};
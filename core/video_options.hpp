@@ -9,6 +9,7 @@
 
 #include <cstdio>
 
+#include <algorithm>
 #include <string>
 
 #include "options.hpp"
@@ -32,7 +33,7 @@ struct VideoOptions : public Options
 			("inline", value<bool>(&inline_headers)->default_value(false)->implicit_value(true),
 			 "Force PPS/SPS header with every I frame (h264 only)")
 			("codec", value<std::string>(&codec)->default_value("h264"),
-			 "Set the codec to use, either h264, mjpeg or yuv420")
+			 "Set the codec to use, either h264, libx264, mjpeg or yuv420")
 			("save-pts", value<std::string>(&save_pts),
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
@@ -51,6 +52,14 @@ struct VideoOptions : public Options
 			 "Break the recording into files of approximately this many milliseconds")
 			("circular", value<bool>(&circular)->default_value(false)->implicit_value(true),
 			 "Write output to a circular buffer which is saved on exit")
+			("lores-output", value<std::string>(&lores_output),
+			 "Also encode the low resolution stream (see lores-width/height), to this output")
+			("lores-codec", value<std::string>(&lores_codec)->default_value("mjpeg"),
+			 "Set the codec for the low resolution stream, either h264, libx264, mjpeg or yuv420")
+			("lores-bitrate", value<uint32_t>(&lores_bitrate)->default_value(0),
+			 "Set the bitrate for encoding the low resolution stream, in bits/second (h264 only)")
+			("rate-control", value<bool>(&rate_control)->default_value(false)->implicit_value(true),
+			 "Lower the bitrate (or MJPEG quality) when the output can't keep up, and raise it again when it can")
 			;
 	}
 
@@ -70,6 +79,10 @@ struct VideoOptions : public Options
 	bool split;
 	uint32_t segment;
 	bool circular;
+	bool rate_control;
+	std::string lores_output;
+	std::string lores_codec;
+	uint32_t lores_bitrate;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -82,6 +95,8 @@ struct VideoOptions : public Options
 			height = 480;
 		if (strcasecmp(codec.c_str(), "h264") == 0)
 			codec = "h264";
+		else if (strcasecmp(codec.c_str(), "libx264") == 0)
+			codec = "libx264";
 		else if (strcasecmp(codec.c_str(), "yuv420") == 0)
 			codec = "yuv420";
 		else if (strcasecmp(codec.c_str(), "mjpeg") == 0)
@@ -98,6 +113,18 @@ struct VideoOptions : public Options
 			std::cerr << "WARNING: consider inline headers with 'pause'/split/segment/circular" << std::endl;
 		if ((split || segment) && output.find('%') == std::string::npos)
 			std::cerr << "WARNING: expected % directive in output filename" << std::endl;
+		if (!lores_output.empty())
+		{
+			if (!lores_width || !lores_height)
+				throw std::runtime_error("lores-output requires lores-width and lores-height");
+			if (strcasecmp(lores_codec.c_str(), "h264") == 0 || strcasecmp(lores_codec.c_str(), "libx264") == 0 ||
+				strcasecmp(lores_codec.c_str(), "mjpeg") == 0 || strcasecmp(lores_codec.c_str(), "yuv420") == 0)
+				std::transform(lores_codec.begin(), lores_codec.end(), lores_codec.begin(), ::tolower);
+			else
+				throw std::runtime_error("unrecognised lores codec " + lores_codec);
+		}
+		if (rate_control && !bitrate && (codec == "h264" || codec == "libx264"))
+			throw std::runtime_error("rate control requires a bitrate");
 
 		return true;
 	}
@@ -118,5 +145,12 @@ struct VideoOptions : public Options
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		std::cerr << "    rate-control: " << rate_control << std::endl;
+		if (!lores_output.empty())
+		{
+			std::cerr << "    lores-output: " << lores_output << std::endl;
+			std::cerr << "    lores-codec: " << lores_codec << std::endl;
+			std::cerr << "    lores-bitrate: " << lores_bitrate << std::endl;
+		}
 	}
 };
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * zsl_ring.hpp - a ring of recent full resolution requests for zero shutter lag capture.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+
+#include <libcamera/control_ids.h>
+
+#include "core/completed_request.hpp"
+
+// In zero shutter lag mode the camera streams full resolution frames continuously. We hang
+// on to the last few completed requests (which keeps their buffers out of the camera's
+// hands) so that when a capture is triggered we can pick the frame nearest to the moment
+// of the trigger, rather than waiting for a new one. Frames reach us some time after their
+// exposure starts, so a trigger may also have to wait for the frame that covers it.
+
+class ZslRing
+{
+public:
+	// The camera must have been configured with this many buffers more than it needs to
+	// keep running.
+	void SetSize(unsigned int size)
+	{
+		size_ = size;
+		while (requests_.size() > size_)
+			requests_.pop_front();
+	}
+
+	unsigned int Size() const { return requests_.size(); }
+
+	void Push(CompletedRequestPtr const &request)
+	{
+		if (!size_)
+			return;
+		if (requests_.size() == size_)
+			requests_.pop_front();
+		requests_.push_back(request);
+	}
+
+	void Clear() { requests_.clear(); }
+
+	// Sensor timestamps are on the CLOCK_MONOTONIC timebase, which is what steady_clock uses.
+	static int64_t Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::steady_clock::now().time_since_epoch())
+			.count();
+	}
+
+	// Whether a frame taken at or after the given time (in ns) has arrived yet, after which
+	// waiting for more frames can't get us any closer to it. Requests without timestamps
+	// count as having arrived.
+	bool Reached(int64_t timestamp) const
+	{
+		for (auto it = requests_.rbegin(); it != requests_.rend(); it++)
+		{
+			if ((*it)->metadata.contains(libcamera::controls::SensorTimestamp))
+				return (*it)->metadata.get(libcamera::controls::SensorTimestamp) >= timestamp;
+		}
+		return !requests_.empty();
+	}
+
+	// Return the request whose sensor timestamp is closest to the given one (in ns), or
+	// the most recent one if no timestamps are available. Returns null if the ring is empty.
+	CompletedRequestPtr Closest(int64_t timestamp) const
+	{
+		CompletedRequestPtr best;
+		int64_t best_diff = std::numeric_limits<int64_t>::max();
+		for (auto const &request : requests_)
+		{
+			if (!request->metadata.contains(libcamera::controls::SensorTimestamp))
+				continue;
+			int64_t ts = request->metadata.get(libcamera::controls::SensorTimestamp);
+			int64_t diff = ts > timestamp ? ts - timestamp : timestamp - ts;
+			if (diff < best_diff)
+				best = request, best_diff = diff;
+		}
+		if (!best && !requests_.empty())
+			best = requests_.back();
+		return best;
+	}
+
+private:
+	unsigned int size_ = 0;
+	std::deque<CompletedRequestPtr> requests_;
+};
@@ -5,10 +5,18 @@
  * encoder.cpp - Video encoder class.
  */
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <cstring>
+#include <iostream>
+#include <iterator>
 
 #include "encoder.hpp"
 #include "h264_encoder.hpp"
+#if LIBX264_PRESENT
+#include "libx264_encoder.hpp"
+#endif
 #include "mjpeg_encoder.hpp"
 #include "null_encoder.hpp"
 
@@ -17,8 +25,54 @@ Encoder *Encoder::Create(VideoOptions const *options)
 	if (strcasecmp(options->codec.c_str(), "yuv420") == 0)
 		return new NullEncoder(options);
 	else if (strcasecmp(options->codec.c_str(), "h264") == 0)
+	{
+#if LIBX264_PRESENT
+		// Without the hardware codec, fall back to encoding on the CPU.
+		if (access("/dev/video11", R_OK | W_OK) != 0)
+		{
+			if (options->verbose)
+				std::cerr << "No V4L2 H264 encoder, using libx264" << std::endl;
+			return new LibX264Encoder(options);
+		}
+#endif
 		return new H264Encoder(options);
+	}
+	else if (strcasecmp(options->codec.c_str(), "libx264") == 0)
+	{
+#if LIBX264_PRESENT
+		return new LibX264Encoder(options);
+#else
+		throw std::runtime_error("libx264 codec not available in this build");
+#endif
+	}
 	else if (strcasecmp(options->codec.c_str(), "mjpeg") == 0)
 		return new MjpegEncoder(options);
 	throw std::runtime_error("Unrecognised codec " + options->codec);
 }
+
+Encoder::~Encoder()
+{
+	if (options_->verbose && frames_encoded_)
+		std::cerr << "Encoder latency: average " << total_latency_.count() * 1000 / frames_encoded_ << "ms, max "
+				  << max_latency_.count() * 1000 << "ms over " << frames_encoded_ << " frames" << std::endl;
+}
+
+void Encoder::frameQueued(int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(latency_mutex_);
+	frames_in_flight_[timestamp_us] = std::chrono::steady_clock::now();
+}
+
+void Encoder::frameEncoded(int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(latency_mutex_);
+	auto it = frames_in_flight_.find(timestamp_us);
+	if (it == frames_in_flight_.end())
+		return;
+	std::chrono::duration<double> latency = std::chrono::steady_clock::now() - it->second;
+	// Anything older can't be coming back now (an encoder might drop frames).
+	frames_in_flight_.erase(frames_in_flight_.begin(), std::next(it));
+	total_latency_ += latency;
+	max_latency_ = std::max(max_latency_, latency);
+	frames_encoded_++;
+}
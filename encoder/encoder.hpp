@@ -7,7 +7,13 @@
 
 #pragma once
 
+#include <chrono>
 #include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <libcamera/geometry.h>
 
 #include "core/video_options.hpp"
 
@@ -20,7 +26,7 @@ public:
 	static Encoder *Create(VideoOptions const *options);
 
 	Encoder(VideoOptions const *options) : options_(options) {}
-	virtual ~Encoder() {}
+	virtual ~Encoder();
 	// This is where the application sets the callback it gets whenever the encoder
 	// has finished with an input buffer, so the application can re-use it.
 	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
@@ -32,9 +38,30 @@ public:
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height,
 							  unsigned int stride, int64_t timestamp_us) = 0;
+	// These change the encoding while it runs, and may be called from any thread. Each
+	// encoder ignores whatever doesn't apply to it (such as a bitrate for MJPEG).
+	virtual void SetBitrate(uint32_t bitrate) {}
+	virtual void SetQuality(int quality) {}
+	// Make the next frame a keyframe, for example when a new output starts.
+	virtual void RequestKeyframe() {}
+	// Where the interesting parts of the picture are, for the frames that follow. Encoders
+	// that can may spend fewer bits elsewhere.
+	virtual void SetRegionsOfInterest(std::vector<libcamera::Rectangle> const &regions) {}
 
 protected:
+	// Derived classes call these when a frame goes into the encoder and when its encoded
+	// output emerges, so that we can report how long frames spend in the encoder.
+	void frameQueued(int64_t timestamp_us);
+	void frameEncoded(int64_t timestamp_us);
+
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
 	VideoOptions const *options_;
+
+private:
+	std::mutex latency_mutex_;
+	std::map<int64_t, std::chrono::steady_clock::time_point> frames_in_flight_;
+	std::chrono::duration<double> total_latency_ { 0 };
+	std::chrono::duration<double> max_latency_ { 0 };
+	unsigned int frames_encoded_ = 0;
 };
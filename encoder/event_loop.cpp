@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * event_loop.cpp - a single thread waiting on file descriptors and posted tasks.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+
+#include "event_loop.hpp"
+
+EventLoop::EventLoop() : abort_(false)
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		throw std::runtime_error("EventLoop: failed to create epoll fd");
+	event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (event_fd_ < 0)
+	{
+		close(epoll_fd_);
+		throw std::runtime_error("EventLoop: failed to create eventfd");
+	}
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = event_fd_;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev) < 0)
+	{
+		close(event_fd_);
+		close(epoll_fd_);
+		throw std::runtime_error("EventLoop: failed to add eventfd");
+	}
+}
+
+EventLoop::~EventLoop()
+{
+	Stop();
+	close(event_fd_);
+	close(epoll_fd_);
+}
+
+void EventLoop::Add(int fd, uint32_t events, Handler handler)
+{
+	epoll_event ev = {};
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+		throw std::runtime_error("EventLoop: failed to add fd " + std::to_string(fd));
+	handlers_[fd] = handler;
+}
+
+void EventLoop::Start()
+{
+	thread_ = std::thread(&EventLoop::run, this);
+}
+
+void EventLoop::Post(Task task)
+{
+	{
+		std::lock_guard<std::mutex> lock(tasks_mutex_);
+		tasks_.push(std::move(task));
+	}
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+}
+
+void EventLoop::Stop()
+{
+	if (!thread_.joinable())
+		return;
+	abort_ = true;
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+	thread_.join();
+
+	while (true)
+	{
+		Task task;
+		{
+			std::lock_guard<std::mutex> lock(tasks_mutex_);
+			if (tasks_.empty())
+				break;
+			task = std::move(tasks_.front());
+			tasks_.pop();
+		}
+		task();
+	}
+}
+
+void EventLoop::run()
+{
+	constexpr int MAX_EVENTS = 8;
+	epoll_event events[MAX_EVENTS];
+	while (!abort_)
+	{
+		int num = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+		if (num < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from epoll_wait");
+		}
+		for (int i = 0; i < num && !abort_; i++)
+		{
+			if (events[i].data.fd != event_fd_)
+			{
+				handlers_[events[i].data.fd](events[i].events);
+				continue;
+			}
+
+			uint64_t count;
+			[[maybe_unused]] ssize_t ret = read(event_fd_, &count, sizeof(count));
+			while (!abort_)
+			{
+				Task task;
+				{
+					std::lock_guard<std::mutex> lock(tasks_mutex_);
+					if (tasks_.empty())
+						break;
+					task = std::move(tasks_.front());
+					tasks_.pop();
+				}
+				task();
+			}
+		}
+	}
+}
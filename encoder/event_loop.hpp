@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * event_loop.hpp - a single thread waiting on file descriptors and posted tasks.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+// The encoders use this instead of threads that poll with timeouts. Everything the thread
+// does is triggered by an epoll wakeup: either a registered fd becoming ready, or an eventfd
+// written when a task is posted or the loop is stopped. So nothing waits for a timeout,
+// and stopping is immediate.
+
+class EventLoop
+{
+public:
+	using Handler = std::function<void(uint32_t events)>;
+	using Task = std::function<void()>;
+
+	EventLoop();
+	~EventLoop();
+	// Watch fd for the given epoll events. Call this before Start().
+	void Add(int fd, uint32_t events, Handler handler);
+	void Start();
+	// Tasks run in the loop's thread, in the order they were posted.
+	void Post(Task task);
+	// Return once the loop's thread has finished. Tasks not yet run are run here first, so
+	// that nothing posted (or anything it owns) gets lost.
+	void Stop();
+
+private:
+	void run();
+
+	int epoll_fd_;
+	int event_fd_;
+	std::map<int, Handler> handlers_;
+	std::mutex tasks_mutex_;
+	std::queue<Task> tasks_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
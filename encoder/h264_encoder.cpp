@@ -6,13 +6,13 @@
  */
 
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
 #include <linux/videodev2.h>
 
-#include <chrono>
+#include <cstring>
 #include <iostream>
 
 #include "h264_encoder.hpp"
@@ -27,7 +27,7 @@ static int xioctl(int fd, unsigned long ctl, void *arg)
 	return ret;
 }
 
-H264Encoder::H264Encoder(VideoOptions const *options) : Encoder(options), abort_(false)
+H264Encoder::H264Encoder(VideoOptions const *options) : Encoder(options)
 {
 	// First open the encoder device. Maybe we should double-check its "caps".
 
@@ -179,15 +179,15 @@ H264Encoder::H264Encoder(VideoOptions const *options) : Encoder(options), abort_
 	if (options->verbose)
 		std::cerr << "Codec streaming started" << std::endl;
 
-	output_thread_ = std::thread(&H264Encoder::outputThread, this);
-	poll_thread_ = std::thread(&H264Encoder::pollThread, this);
+	output_loop_.Start();
+	event_loop_.Add(fd_, EPOLLIN, [this](uint32_t) { serviceDevice(); });
+	event_loop_.Start();
 }
 
 H264Encoder::~H264Encoder()
 {
-	abort_ = true;
-	output_thread_.join();
-	poll_thread_.join();
+	event_loop_.Stop();
+	output_loop_.Stop();
 	if (options_->verbose)
 		std::cerr << "H264Encoder closed" << std::endl;
 	// Other stuff will mostly get hoovered up with the process quits.
@@ -219,105 +219,82 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, unsigned int widt
 	buf.m.planes[0].m.fd = fd;
 	buf.m.planes[0].bytesused = size;
 	buf.m.planes[0].length = size;
+	frameQueued(timestamp_us);
 	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
 		throw std::runtime_error("failed to queue input to codec");
 }
 
-void H264Encoder::pollThread()
+// The codec lets us change these controls while it's streaming.
+void H264Encoder::SetBitrate(uint32_t bitrate)
 {
-	while (true)
-	{
-		pollfd p = { fd_, POLLIN, 0 };
-		int ret = poll(&p, 1, 200);
-		if (abort_)
-			break;
-		if (ret == -1)
-		{
-			if (errno == EINTR)
-				continue;
-			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
-		}
-		if (p.revents & POLLIN)
-		{
-			v4l2_buffer buf = {};
-			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-			buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-			buf.memory = V4L2_MEMORY_DMABUF;
-			buf.length = 1;
-			buf.m.planes = planes;
-			int ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
-			if (ret == 0)
-			{
-				// Return this to the caller, first noting that this buffer, identified
-				// by its index, is available for queueing up another frame.
-				{
-					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-					input_buffers_available_.push(buf.index);
-				}
-				input_done_callback_(nullptr);
-			}
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bitrate;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		throw std::runtime_error("failed to set bitrate");
+}
 
-			buf = {};
-			memset(planes, 0, sizeof(planes));
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-			buf.memory = V4L2_MEMORY_MMAP;
-			buf.length = 1;
-			buf.m.planes = planes;
-			ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
-			if (ret == 0)
-			{
-				// We push this encoded buffer to another thread so that our
-				// application can take its time with the data without blocking the
-				// encode process.
-				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
-				OutputItem item = { buffers_[buf.index].mem,
-									buf.m.planes[0].bytesused,
-									buf.m.planes[0].length,
-									buf.index,
-									!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
-									timestamp_us };
-				std::lock_guard<std::mutex> lock(output_mutex_);
-				output_queue_.push(item);
-				output_cond_var_.notify_one();
-			}
-		}
-	}
+void H264Encoder::RequestKeyframe()
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	ctrl.value = 1;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		throw std::runtime_error("failed to request keyframe");
 }
 
-void H264Encoder::outputThread()
+void H264Encoder::serviceDevice()
 {
-	OutputItem item;
-	while (true)
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	buf.memory = V4L2_MEMORY_DMABUF;
+	buf.length = 1;
+	buf.m.planes = planes;
+	int ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+	if (ret == 0)
 	{
+		// Return this to the caller, first noting that this buffer, identified
+		// by its index, is available for queueing up another frame.
 		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else
-					output_cond_var_.wait_for(lock, 200ms);
-				if (abort_)
-					return;
-			}
+			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+			input_buffers_available_.push(buf.index);
 		}
+		input_done_callback_(nullptr);
+	}
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
-		v4l2_buffer buf = {};
-		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = item.index;
-		buf.length = 1;
-		buf.m.planes = planes;
-		buf.m.planes[0].bytesused = 0;
-		buf.m.planes[0].length = item.length;
-		if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
-			throw std::runtime_error("failed to re-queue encoded buffer");
+	buf = {};
+	memset(planes, 0, sizeof(planes));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.length = 1;
+	buf.m.planes = planes;
+	ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+	if (ret == 0)
+	{
+		int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+		frameEncoded(timestamp_us);
+		unsigned int index = buf.index;
+		size_t bytes_used = buf.m.planes[0].bytesused, length = buf.m.planes[0].length;
+		bool keyframe = !!(buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+		output_loop_.Post([=]() { outputBuffer(index, bytes_used, length, timestamp_us, keyframe); });
 	}
 }
+
+void H264Encoder::outputBuffer(unsigned int index, size_t bytes_used, size_t length, int64_t timestamp_us,
+							   bool keyframe)
+{
+	output_ready_callback_(buffers_[index].mem, bytes_used, timestamp_us, keyframe);
+
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.length = 1;
+	buf.m.planes = planes;
+	buf.index = index;
+	buf.m.planes[0].bytesused = 0;
+	buf.m.planes[0].length = length;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to re-queue encoded buffer");
+}
@@ -7,12 +7,11 @@
 
 #pragma once
 
-#include <condition_variable>
 #include <mutex>
 #include <queue>
-#include <thread>
 
 #include "encoder.hpp"
+#include "event_loop.hpp"
 
 class H264Encoder : public Encoder
 {
@@ -22,6 +21,8 @@ public:
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height, unsigned int stride,
 					  int64_t timestamp_us) override;
+	void SetBitrate(uint32_t bitrate) override;
+	void RequestKeyframe() override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
@@ -31,17 +32,16 @@ private:
 	static constexpr int NUM_OUTPUT_BUFFERS = 6;
 	static constexpr int NUM_CAPTURE_BUFFERS = 12;
 
-	// This thread just sits waiting for the encoder to finish stuff. It will either:
-	// * receive "output" buffers (codec inputs), which we must return to the caller
-	// * receive encoded buffers, which we pass to the application.
-	void pollThread();
+	// The event loop calls this when the encoder has finished something. It will either:
+	// * return "output" buffers (codec inputs), which we must return to the caller
+	// * return encoded buffers, which go to the output loop. We have plenty of capture
+	//   buffers, so the encoder can carry on while the application deals with the bitstream.
+	void serviceDevice();
+	// The output loop passes encoded buffers to the application and then gives them back to
+	// the encoder. This is a separate thread so that a slow output (a network connection, or
+	// a busy SD card) can't stop codec inputs going back to the camera.
+	void outputBuffer(unsigned int index, size_t bytes_used, size_t length, int64_t timestamp_us, bool keyframe);
 
-	// Handle the output buffers in another thread so as not to block the encoder. The
-	// application can take its time, after which we return this buffer to the encoder for
-	// re-use.
-	void outputThread();
-
-	bool abort_;
 	int fd_;
 	struct BufferDescription
 	{
@@ -49,20 +49,8 @@ private:
 		size_t size;
 	};
 	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
-	std::thread poll_thread_;
 	std::mutex input_buffers_available_mutex_;
 	std::queue<int> input_buffers_available_;
-	struct OutputItem
-	{
-		void *mem;
-		size_t bytes_used;
-		size_t length;
-		unsigned int index;
-		bool keyframe;
-		int64_t timestamp_us;
-	};
-	std::queue<OutputItem> output_queue_;
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
-	std::thread output_thread_;
+	EventLoop event_loop_;
+	EventLoop output_loop_;
 };
@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * libx264_encoder.cpp - h264 video encoder running on the CPU, using libx264.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "libx264_encoder.hpp"
+
+LibX264Encoder::LibX264Encoder(VideoOptions const *options) : Encoder(options), keyframe_requested_(false)
+{
+	// "ultrafast" with "zerolatency" gives us no lookahead, no B frames and sliced threads, so
+	// every frame comes out of the encoder as soon as it goes in, and all the cores work on it.
+	x264_param_t param;
+	if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0)
+		throw std::runtime_error("LibX264Encoder: failed to set preset");
+
+	param.i_width = options->width;
+	param.i_height = options->height;
+	param.i_csp = X264_CSP_I420;
+	param.i_threads = std::max(1u, std::thread::hardware_concurrency());
+	param.b_sliced_threads = 1;
+	param.i_log_level = options->verbose ? X264_LOG_WARNING : X264_LOG_ERROR;
+
+	// Timestamps are passed through in microseconds.
+	param.b_vfr_input = 1;
+	param.i_timebase_num = 1;
+	param.i_timebase_den = 1000000;
+	param.i_fps_num = options->framerate > 0 ? options->framerate * 1000 : 30000;
+	param.i_fps_den = 1000;
+
+	if (options->bitrate)
+	{
+		param.rc.i_rc_method = X264_RC_ABR;
+		param.rc.i_bitrate = options->bitrate / 1000;
+		param.rc.i_vbv_max_bitrate = param.rc.i_bitrate;
+		param.rc.i_vbv_buffer_size = param.rc.i_bitrate;
+	}
+	if (!options->level.empty())
+		param.i_level_idc = std::stof(options->level) * 10 + 0.5;
+	if (options->intra)
+		param.i_keyint_max = options->intra;
+	param.b_repeat_headers = options->inline_headers;
+	param.b_annexb = 1;
+
+	if (!options->profile.empty())
+	{
+		if (options->profile != "baseline" && options->profile != "main" && options->profile != "high")
+			throw std::runtime_error("no such profile " + options->profile);
+		if (x264_param_apply_profile(&param, options->profile.c_str()) < 0)
+			throw std::runtime_error("LibX264Encoder: failed to set profile");
+	}
+
+	encoder_ = x264_encoder_open(&param);
+	if (!encoder_)
+		throw std::runtime_error("LibX264Encoder: failed to open encoder");
+
+	if (!options->inline_headers)
+	{
+		x264_nal_t *nals;
+		int num_nals;
+		if (x264_encoder_headers(encoder_, &nals, &num_nals) < 0)
+			throw std::runtime_error("LibX264Encoder: failed to get headers");
+		for (int i = 0; i < num_nals; i++)
+			headers_.insert(headers_.end(), nals[i].p_payload, nals[i].p_payload + nals[i].i_payload);
+	}
+
+	if (options->verbose)
+		std::cerr << "Opened LibX264Encoder with " << param.i_threads << " threads" << std::endl;
+	event_loop_.Start();
+}
+
+LibX264Encoder::~LibX264Encoder()
+{
+	event_loop_.Stop();
+
+	// With zerolatency there shouldn't be anything left, but collect it anyway.
+	x264_nal_t *nals;
+	int num_nals;
+	x264_picture_t pic_out;
+	while (x264_encoder_delayed_frames(encoder_) > 0)
+	{
+		int size = x264_encoder_encode(encoder_, &nals, &num_nals, nullptr, &pic_out);
+		if (size <= 0)
+			break;
+		outputNals(nals, num_nals, size, pic_out);
+	}
+	x264_encoder_close(encoder_);
+
+	if (options_->verbose)
+		std::cerr << "LibX264Encoder closed" << std::endl;
+}
+
+void LibX264Encoder::EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height,
+								  unsigned int stride, int64_t timestamp_us)
+{
+	frameQueued(timestamp_us);
+	event_loop_.Post([this, mem, stride, timestamp_us]() { encode(mem, stride, timestamp_us); });
+}
+
+// The encoder may only be reconfigured between frames, so do it in the event loop's thread.
+void LibX264Encoder::SetBitrate(uint32_t bitrate)
+{
+	event_loop_.Post([this, bitrate]() {
+		x264_param_t param;
+		x264_encoder_parameters(encoder_, &param);
+		if (param.rc.i_rc_method != X264_RC_ABR)
+			return;
+		param.rc.i_bitrate = bitrate / 1000;
+		param.rc.i_vbv_max_bitrate = param.rc.i_bitrate;
+		param.rc.i_vbv_buffer_size = param.rc.i_bitrate;
+		if (x264_encoder_reconfig(encoder_, &param) < 0)
+			throw std::runtime_error("LibX264Encoder: failed to set bitrate");
+	});
+}
+
+void LibX264Encoder::encode(void *mem, unsigned int stride, int64_t timestamp_us)
+{
+	// The encoder reads the planes straight out of the camera buffer.
+	x264_picture_t pic_in;
+	x264_picture_init(&pic_in);
+	pic_in.img.i_csp = X264_CSP_I420;
+	pic_in.img.i_plane = 3;
+	uint8_t *Y = (uint8_t *)mem;
+	uint8_t *U = Y + stride * options_->height;
+	uint8_t *V = U + (stride / 2) * (options_->height / 2);
+	pic_in.img.plane[0] = Y, pic_in.img.plane[1] = U, pic_in.img.plane[2] = V;
+	pic_in.img.i_stride[0] = stride;
+	pic_in.img.i_stride[1] = pic_in.img.i_stride[2] = stride / 2;
+	pic_in.i_pts = timestamp_us;
+	if (keyframe_requested_.exchange(false))
+		pic_in.i_type = X264_TYPE_IDR;
+
+	x264_nal_t *nals;
+	int num_nals;
+	x264_picture_t pic_out;
+	int size = x264_encoder_encode(encoder_, &nals, &num_nals, &pic_in, &pic_out);
+	// libx264 has copied the frame by now, so the camera can have its buffer back.
+	input_done_callback_(nullptr);
+	if (size < 0)
+		throw std::runtime_error("LibX264Encoder: failed to encode frame");
+	if (size > 0)
+		outputNals(nals, num_nals, size, pic_out);
+}
+
+void LibX264Encoder::outputNals(x264_nal_t *nals, int num_nals, int size, x264_picture_t const &pic_out)
+{
+	// The NAL payloads of a frame are contiguous, so normally no copy is needed.
+	uint8_t *data = nals[0].p_payload;
+	if (!headers_.empty())
+	{
+		output_buffer_ = std::move(headers_);
+		headers_.clear();
+		output_buffer_.insert(output_buffer_.end(), data, data + size);
+		data = output_buffer_.data();
+		size = output_buffer_.size();
+	}
+	frameEncoded(pic_out.i_pts);
+	output_ready_callback_(data, size, pic_out.i_pts, pic_out.b_keyframe);
+}
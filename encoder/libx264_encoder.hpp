@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * libx264_encoder.hpp - h264 video encoder running on the CPU, using libx264.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+extern "C"
+{
+#include <x264.h>
+}
+
+#include "encoder.hpp"
+#include "event_loop.hpp"
+
+class LibX264Encoder : public Encoder
+{
+public:
+	LibX264Encoder(VideoOptions const *options);
+	~LibX264Encoder();
+	// Encode the given buffer. Only the mmapped pointer is used.
+	void EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height, unsigned int stride,
+					  int64_t timestamp_us) override;
+	void SetBitrate(uint32_t bitrate) override;
+	void RequestKeyframe() override { keyframe_requested_ = true; }
+
+private:
+	// Runs in the event loop's thread, so frames are encoded one at a time and in order.
+	void encode(void *mem, unsigned int stride, int64_t timestamp_us);
+	void outputNals(x264_nal_t *nals, int num_nals, int size, x264_picture_t const &pic_out);
+
+	x264_t *encoder_;
+	std::atomic<bool> keyframe_requested_;
+	// Without inline headers, the SPS/PPS still go out once, in front of the first frame.
+	std::vector<uint8_t> headers_;
+	std::vector<uint8_t> output_buffer_;
+	EventLoop event_loop_;
+};
@@ -6,10 +6,13 @@
  */
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
 
 #include <jpeglib.h>
 
+#include "core/roi_background.hpp"
+
 #include "mjpeg_encoder.hpp"
 
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
@@ -19,9 +22,9 @@ typedef unsigned long jpeg_mem_len_t;
 #endif
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abort_(false), index_(0)
+	: Encoder(options), abort_(false), quality_(options->quality), index_(0), have_regions_(false), output_index_(0)
 {
-	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
+	event_loop_.Start();
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
 		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
 	if (options_->verbose)
@@ -30,10 +33,17 @@ MjpegEncoder::MjpegEncoder(VideoOptions const *options)
 
 MjpegEncoder::~MjpegEncoder()
 {
-	abort_ = true;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abort_ = true;
+		encode_cond_var_.notify_all();
+	}
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
 		encode_thread_[i].join();
-	output_thread_.join();
+	event_loop_.Stop();
+	// Anything still waiting to be output will never be.
+	for (auto &item : output_pending_)
+		free(item.second.mem);
 	if (options_->verbose)
 		std::cerr << "MjpegEncoder closed" << std::endl;
 }
@@ -41,12 +51,20 @@ MjpegEncoder::~MjpegEncoder()
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height,
 								unsigned int stride, int64_t timestamp_us)
 {
+	frameQueued(timestamp_us);
 	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, width, height, stride, timestamp_us, index_++ };
+	EncodeItem item = { mem, width, height, stride, timestamp_us, index_++, have_regions_, regions_ };
 	encode_queue_.push(item);
 	encode_cond_var_.notify_all();
 }
 
+void MjpegEncoder::SetRegionsOfInterest(std::vector<libcamera::Rectangle> const &regions)
+{
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	have_regions_ = options_->roi_downsample > 0;
+	regions_ = regions;
+}
+
 void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
 							  size_t &buffer_len)
 {
@@ -59,7 +77,7 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
+	jpeg_set_quality(&cinfo, quality_, TRUE);
 	encoded_buffer = nullptr;
 	buffer_len = 0;
 	jpeg_mem_len_t jpeg_mem_len;
@@ -101,6 +119,7 @@ void MjpegEncoder::encodeThread(int num)
 	jpeg_create_compress(&cinfo);
 	std::chrono::duration<double> encode_time(0);
 	uint32_t frames = 0;
+	std::vector<uint8_t> coarsened;
 
 	EncodeItem encode_item;
 	while (true)
@@ -109,7 +128,6 @@ void MjpegEncoder::encodeThread(int num)
 			std::unique_lock<std::mutex> lock(encode_mutex_);
 			while (true)
 			{
-				using namespace std::chrono_literals;
 				if (abort_)
 				{
 					if (frames && options_->verbose)
@@ -125,7 +143,7 @@ void MjpegEncoder::encodeThread(int num)
 					break;
 				}
 				else
-					encode_cond_var_.wait_for(lock, 200ms);
+					encode_cond_var_.wait(lock);
 			}
 		}
 
@@ -133,54 +151,39 @@ void MjpegEncoder::encodeThread(int num)
 		uint8_t *encoded_buffer = nullptr;
 		size_t buffer_len = 0;
 		auto start_time = std::chrono::high_resolution_clock::now();
+		if (encode_item.coarsen)
+		{
+			// Work on a copy, as the application may still be displaying the original.
+			size_t size = encode_item.stride * encode_item.height * 3 / 2;
+			coarsened.resize(size);
+			memcpy(coarsened.data(), encode_item.mem, size);
+			roi_coarsen_background(coarsened.data(), encode_item.width, encode_item.height, encode_item.stride,
+								   encode_item.regions, options_->roi_downsample);
+			encode_item.mem = coarsened.data();
+		}
 		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
-		// Don't return buffers until the output thread as that's where they're
+		// Don't return buffers until the event loop has them as that's where they're
 		// in order again.
-
-		// We push this encoded buffer to another thread so that our
-		// application can take its time with the data without blocking the
-		// encode process.
 		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+		event_loop_.Post([this, output_item]() { outputItem(output_item); });
 	}
 }
 
-void MjpegEncoder::outputThread()
+void MjpegEncoder::outputItem(OutputItem const &item)
 {
-	OutputItem item;
-	uint64_t index = 0;
-	while (true)
+	// Hold on to frames that come back early until the ones before them are done.
+	output_pending_[item.index] = item;
+	for (auto it = output_pending_.begin(); it != output_pending_.end() && it->first == output_index_;
+		 it = output_pending_.erase(it))
 	{
-		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (abort_)
-					return;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				for (auto &q : output_queue_)
-				{
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				output_cond_var_.wait_for(lock, 200ms);
-			}
-		}
-	got_item:
+		OutputItem const &next = it->second;
+		frameEncoded(next.timestamp_us);
 		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
+		output_ready_callback_(next.mem, next.bytes_used, next.timestamp_us, true);
+		free(next.mem);
+		output_index_++;
 	}
 }
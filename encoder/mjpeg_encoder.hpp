@@ -7,12 +7,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <map>
 #include <mutex>
 #include <queue>
 #include <thread>
 
 #include "encoder.hpp"
+#include "event_loop.hpp"
 
 struct jpeg_compress_struct;
 
@@ -24,6 +27,10 @@ public:
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height, unsigned int stride,
 					  int64_t timestamp_us) override;
+	// Every frame is a keyframe anyway, so only the quality can change.
+	void SetQuality(int quality) override { quality_ = quality; }
+	// Used when the roi-downsample option is set.
+	void SetRegionsOfInterest(std::vector<libcamera::Rectangle> const &regions) override;
 
 private:
 	// How many threads to use. Whichever thread is idle will pick up the next frame.
@@ -32,12 +39,14 @@ private:
 	// These threads do the actual encoding.
 	void encodeThread(int num);
 
-	// Handle the output buffers in another thread so as not to block the encoders. The
-	// application can take its time, after which we return this buffer to the encoder for
-	// re-use.
-	void outputThread();
+	// Encoded buffers are handed to the event loop's thread so as not to block the
+	// encoders. There we put them back in order and pass them to the application, which can
+	// take its time.
+	struct OutputItem;
+	void outputItem(OutputItem const &item);
 
 	bool abort_;
+	std::atomic<int> quality_;
 	uint64_t index_;
 
 	struct EncodeItem
@@ -48,8 +57,13 @@ private:
 		unsigned int stride;
 		int64_t timestamp_us;
 		uint64_t index;
+		bool coarsen;
+		std::vector<libcamera::Rectangle> regions;
 	};
 	std::queue<EncodeItem> encode_queue_;
+	// Nothing is coarsened until we've been told where the regions of interest are.
+	bool have_regions_;
+	std::vector<libcamera::Rectangle> regions_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
 	std::thread encode_thread_[NUM_ENC_THREADS];
@@ -62,8 +76,8 @@ private:
 		int64_t timestamp_us;
 		uint64_t index;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
-	std::thread output_thread_;
+	// Only touched by the event loop's thread.
+	std::map<uint64_t, OutputItem> output_pending_;
+	uint64_t output_index_;
+	EventLoop event_loop_;
 };
@@ -5,62 +5,33 @@
  * null_encoder.cpp - dummy "do nothing" video encoder.
  */
 
-#include <chrono>
 #include <iostream>
 #include <stdexcept>
 
 #include "null_encoder.hpp"
 
-NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_(false)
+NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options)
 {
 	if (options->verbose)
 		std::cerr << "Opened NullEncoder" << std::endl;
-	output_thread_ = std::thread(&NullEncoder::outputThread, this);
+	event_loop_.Start();
 }
 
 NullEncoder::~NullEncoder()
 {
-	abort_ = true;
-	output_thread_.join();
+	event_loop_.Stop();
 	if (options_.verbose)
 		std::cerr << "NullEncoder closed" << std::endl;
 }
 
-// Push the buffer onto the output queue to be "encoded" and returned.
+// Hand the buffer straight back as "encoded" output, from the event loop's thread.
 void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, unsigned int width, unsigned int height,
 							   unsigned int stride, int64_t timestamp_us)
 {
-	std::lock_guard<std::mutex> lock(output_mutex_);
-	OutputItem item = { mem, size, timestamp_us };
-	output_queue_.push(item);
-	output_cond_var_.notify_one();
-}
-
-// Realistically we would probably want more of a queue as the caller's number
-// of buffers limits the amount of queueing possible here...
-void NullEncoder::outputThread()
-{
-	OutputItem item;
-	while (true)
-	{
-		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else
-					output_cond_var_.wait_for(lock, 200ms);
-				if (abort_)
-					return;
-			}
-		}
-		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
+	frameQueued(timestamp_us);
+	event_loop_.Post([this, mem, size, timestamp_us]() {
+		frameEncoded(timestamp_us);
+		output_ready_callback_(mem, size, timestamp_us, true);
 		input_done_callback_(nullptr);
-	}
+	});
 }
@@ -7,13 +7,9 @@
 
 #pragma once
 
-#include <condition_variable>
-#include <mutex>
-#include <queue>
-#include <thread>
-
 #include "core/video_options.hpp"
 #include "encoder.hpp"
+#include "event_loop.hpp"
 
 class NullEncoder : public Encoder
 {
@@ -24,18 +20,6 @@ public:
 					  int64_t timestamp_us) override;
 
 private:
-	void outputThread();
-
-	bool abort_;
 	VideoOptions options_;
-	struct OutputItem
-	{
-		void *mem;
-		size_t length;
-		int64_t timestamp_us;
-	};
-	std::queue<OutputItem> output_queue_;
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
-	std::thread output_thread_;
+	EventLoop event_loop_;
 };
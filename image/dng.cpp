@@ -13,7 +13,14 @@
 
 #include <tiffio.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 #include "core/still_options.hpp"
+#include "core/thread_pool.hpp"
 
 using namespace libcamera;
 
@@ -41,39 +48,161 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::SGBRG12_CSI2P, { "GBRG-12", 12, TIFF_GBRG } },
 };
 
-static void unpack_10bit(uint8_t *src, unsigned int w, unsigned int h, unsigned int stride, uint16_t *dest)
+// CSI-2 packed raw stores the top 8 bits of each pixel in a byte of its own, followed by
+// a byte holding the low bits of the previous 4 (10-bit) or 2 (12-bit) pixels. The vector
+// versions shuffle each pixel's two bytes into a 16-bit lane (high bits in the top byte)
+// and then shift the right low bits into place, doing 16 pixels per iteration. They load
+// 16 bytes at a time, so they stop short of the end of the row and leave the rest to the
+// plain loop.
+
+#if defined(__ARM_NEON)
+static inline uint8x16_t table_lookup(uint8x16_t table, uint8x16_t idx)
 {
-	unsigned int w_align = w & ~3;
-	for (unsigned int y = 0; y < h; y++, src += stride)
+#if defined(__aarch64__)
+	return vqtbl1q_u8(table, idx);
+#else
+	uint8x8x2_t t = { { vget_low_u8(table), vget_high_u8(table) } };
+	return vcombine_u8(vtbl2_u8(t, vget_low_u8(idx)), vtbl2_u8(t, vget_high_u8(idx)));
+#endif
+}
+#endif
+
+static void unpack_10bit_row(uint8_t const *src, unsigned int w, unsigned int row_bytes, uint16_t *dest)
+{
+	unsigned int x = 0;
+	uint8_t const *ptr = src;
+#if defined(__ARM_NEON)
+	static const uint8_t shuffle_bytes[16] = { 4, 0, 4, 1, 4, 2, 4, 3, 9, 5, 9, 6, 9, 7, 9, 8 };
+	static const int16_t shift_values[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+	uint8x16_t shuffle = vld1q_u8(shuffle_bytes);
+	int16x8_t shifts = vld1q_s16(shift_values);
+	uint16x8_t hi_mask = vdupq_n_u16(0x3fc), lo_mask = vdupq_n_u16(3);
+	for (; x + 16 <= w && (ptr - src) + 26 <= row_bytes; x += 16, ptr += 20)
 	{
-		uint8_t *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 4, ptr += 5)
+		for (int half = 0; half < 2; half++)
 		{
-			*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
-			*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
-			*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
-			*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+			uint16x8_t v = vreinterpretq_u16_u8(table_lookup(vld1q_u8(ptr + 10 * half), shuffle));
+			uint16x8_t hi = vandq_u16(vshrq_n_u16(v, 6), hi_mask);
+			uint16x8_t lo = vandq_u16(vshlq_u16(v, shifts), lo_mask);
+			vst1q_u16(dest + x + 8 * half, vorrq_u16(hi, lo));
 		}
-		for (; x < w; x++)
-			*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
 	}
+#elif defined(__SSSE3__)
+	const __m128i shuffle = _mm_setr_epi8(4, 0, 4, 1, 4, 2, 4, 3, 9, 5, 9, 6, 9, 7, 9, 8);
+	// Multiplying moves each pixel's low bits up to bits 6 and 7 of its lane.
+	const __m128i mult = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+	const __m128i hi_mask = _mm_set1_epi16(0x3fc), lo_mask = _mm_set1_epi16(3), byte_mask = _mm_set1_epi16(0xff);
+	for (; x + 16 <= w && (ptr - src) + 26 <= row_bytes; x += 16, ptr += 20)
+	{
+		for (int half = 0; half < 2; half++)
+		{
+			__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(ptr + 10 * half)), shuffle);
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 6), hi_mask);
+			__m128i lo = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(v, byte_mask), mult), 6), lo_mask);
+			_mm_storeu_si128((__m128i *)(dest + x + 8 * half), _mm_or_si128(hi, lo));
+		}
+	}
+#endif
+	unsigned int w_align = w & ~3;
+	for (; x < w_align; x += 4, ptr += 5)
+	{
+		dest[x] = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
+		dest[x + 1] = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
+		dest[x + 2] = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
+		dest[x + 3] = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+	}
+	for (; x < w; x++)
+		dest[x] = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
 }
 
-static void unpack_12bit(uint8_t *src, unsigned int w, unsigned int h, unsigned int stride, uint16_t *dest)
+static void unpack_12bit_row(uint8_t const *src, unsigned int w, unsigned int row_bytes, uint16_t *dest)
 {
-	unsigned int w_align = w & ~1;
-	for (unsigned int y = 0; y < h; y++, src += stride)
+	unsigned int x = 0;
+	uint8_t const *ptr = src;
+#if defined(__ARM_NEON)
+	static const uint8_t shuffle_bytes[16] = { 2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10 };
+	static const int16_t shift_values[8] = { 0, -4, 0, -4, 0, -4, 0, -4 };
+	uint8x16_t shuffle = vld1q_u8(shuffle_bytes);
+	int16x8_t shifts = vld1q_s16(shift_values);
+	uint16x8_t hi_mask = vdupq_n_u16(0xff0), lo_mask = vdupq_n_u16(15);
+	for (; x + 16 <= w && (ptr - src) + 28 <= row_bytes; x += 16, ptr += 24)
+	{
+		for (int half = 0; half < 2; half++)
+		{
+			uint16x8_t v = vreinterpretq_u16_u8(table_lookup(vld1q_u8(ptr + 12 * half), shuffle));
+			uint16x8_t hi = vandq_u16(vshrq_n_u16(v, 4), hi_mask);
+			uint16x8_t lo = vandq_u16(vshlq_u16(v, shifts), lo_mask);
+			vst1q_u16(dest + x + 8 * half, vorrq_u16(hi, lo));
+		}
+	}
+#elif defined(__SSSE3__)
+	const __m128i shuffle = _mm_setr_epi8(2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10);
+	// Multiplying moves each pixel's low bits up to bits 4 to 7 of its lane.
+	const __m128i mult = _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1);
+	const __m128i hi_mask = _mm_set1_epi16(0xff0), lo_mask = _mm_set1_epi16(15), byte_mask = _mm_set1_epi16(0xff);
+	for (; x + 16 <= w && (ptr - src) + 28 <= row_bytes; x += 16, ptr += 24)
 	{
-		uint8_t *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
+		for (int half = 0; half < 2; half++)
 		{
-			*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+			__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(ptr + 12 * half)), shuffle);
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), hi_mask);
+			__m128i lo = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(v, byte_mask), mult), 4), lo_mask);
+			_mm_storeu_si128((__m128i *)(dest + x + 8 * half), _mm_or_si128(hi, lo));
 		}
-		if (x < w)
-			*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+	}
+#endif
+	unsigned int w_align = w & ~1;
+	for (; x < w_align; x += 2, ptr += 3)
+	{
+		dest[x] = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		dest[x + 1] = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+	}
+	if (x < w)
+		dest[x] = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+}
+
+// All the heavy lifting is shared out across a pool of threads that we keep around
+// between captures.
+
+static ThreadPool &dng_pool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+// Unpack a band of rows into dest, whose rows are dest_stride pixels apart.
+
+static void unpack(uint8_t const *src, unsigned int w, unsigned int h, unsigned int stride, int bits, uint16_t *dest,
+				   unsigned int dest_stride)
+{
+	ThreadPool &pool = dng_pool();
+	auto unpack_row = bits == 10 ? unpack_10bit_row : unpack_12bit_row;
+	unsigned int num_jobs = pool.Size();
+	pool.ParallelFor(num_jobs, [&](unsigned int job, unsigned int) {
+		for (unsigned int y = job * h / num_jobs; y < (job + 1) * h / num_jobs; y++)
+			unpack_row(src + y * stride, w, stride, dest + y * dest_stride);
+	});
+}
+
+// The main image is written a band of rows at a time, so we never need the whole frame
+// unpacked at once. The band is kept from one capture to the next (e.g. for timelapse),
+// and each saving thread gets its own.
+
+static constexpr unsigned int DNG_BAND_ROWS = 256;
+
+static void write_strips(TIFF *tif, uint8_t const *src, unsigned int w, unsigned int h, unsigned int stride, int bits)
+{
+	static thread_local std::vector<uint16_t> band;
+	band.resize(w * DNG_BAND_ROWS);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, DNG_BAND_ROWS);
+
+	for (unsigned int y = 0; y < h; y += DNG_BAND_ROWS)
+	{
+		unsigned int rows = std::min(DNG_BAND_ROWS, h - y);
+		unpack(src + y * stride, w, rows, stride, bits, &band[0], w);
+		if (TIFFWriteEncodedStrip(tif, y / DNG_BAND_ROWS, &band[0], rows * w * sizeof(uint16_t)) < 0)
+			throw std::runtime_error("error writing DNG image data");
 	}
 }
 
@@ -138,13 +267,9 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w,
 	BayerFormat const &bayer_format = it->second;
 	std::cerr << "Bayer format is " << bayer_format.name << "\n";
 
-	std::vector<uint16_t> buf(w * h);
-	if (bayer_format.bits == 10)
-		unpack_10bit((uint8_t *)mem[0].data(), w, h, stride, &buf[0]);
-	else if (bayer_format.bits == 12)
-		unpack_12bit((uint8_t *)mem[0].data(), w, h, stride, &buf[0]);
-	else
+	if (bayer_format.bits != 10 && bayer_format.bits != 12)
 		throw std::runtime_error("unsupported bit depth " + std::to_string(bayer_format.bits));
+	uint8_t const *src = (uint8_t const *)mem[0].data();
 
 	// We need to fish out some metadata values for the DNG.
 
@@ -253,15 +378,21 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w,
 		TIFFSetField(tif, TIFFTAG_SUBIFD, 1, &offset_subifd);
 		TIFFSetField(tif, TIFFTAG_EXIFIFD, offset_exififd);
 
-		// Make a small greyscale thumbnail, just to give some clue what's in here.
+		// Make a small greyscale thumbnail, just to give some clue what's in here. We only
+		// need to unpack the two rows at the top of each block of 16.
 		std::vector<uint8_t> thumb_buf((w >> 4) * 3);
+		std::vector<uint16_t> thumb_rows(2 * w);
+		auto unpack_row = bayer_format.bits == 10 ? unpack_10bit_row : unpack_12bit_row;
 
 		for (unsigned int y = 0; y < (h >> 4); y++)
 		{
+			// Far too little work to be worth handing to the pool.
+			unpack_row(src + (y << 4) * stride, w, stride, &thumb_rows[0]);
+			unpack_row(src + ((y << 4) + 1) * stride, w, stride, &thumb_rows[w]);
 			for (unsigned int x = 0; x < (w >> 4); x++)
 			{
-				unsigned int off = (y * w + x) << 4;
-				int grey = buf[off] + buf[off + 1] + buf[off + w] + buf[off + w + 1];
+				unsigned int off = x << 4;
+				int grey = thumb_rows[off] + thumb_rows[off + 1] + thumb_rows[off + w] + thumb_rows[off + w + 1];
 				grey = white * sqrt(grey / (double)white); // fake "gamma"
 				thumb_buf[3 * x] = thumb_buf[3 * x + 1] = thumb_buf[3 * x + 2] = grey >> (bayer_format.bits - 6);
 			}
@@ -290,11 +421,7 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w,
 		TIFFSetField(tif, TIFFTAG_BLACKLEVELREPEATDIM, &black_level_repeat_dim);
 		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 4, &black_levels);
 
-		for (unsigned int y = 0; y < h; y++)
-		{
-			if (TIFFWriteScanline(tif, &buf[w * y], y, 0) != 1)
-				throw std::runtime_error("error writing DNG image data");
-		}
+		write_strips(tif, src, w, h, stride, bayer_format.bits);
 
 		// We have to checkpoint before the directory offset is valid.
 		TIFFCheckpointDirectory(tif);
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * save_queue.cpp - save still images on worker threads.
+ */
+
+#include <libcamera/formats.h>
+
+#include "core/roi_background.hpp"
+
+#include "save_queue.hpp"
+
+SaveQueue::SaveQueue(LibcameraApp &app, StillOptions const *options, unsigned int num_threads, unsigned int max_jobs)
+	: app_(app), options_(options), max_jobs_(max_jobs)
+{
+	for (unsigned int i = 0; i < num_threads; i++)
+		threads_.emplace_back(&SaveQueue::workerThread, this);
+}
+
+SaveQueue::~SaveQueue()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		job_cond_.notify_all();
+	}
+	for (auto &t : threads_)
+		t.join();
+}
+
+void SaveQueue::Save(CompletedRequestPtr &payload, libcamera::Stream *stream, std::string const &filename,
+					 bool update_latest)
+{
+	Job job;
+	app_.StreamDimensions(stream, &job.w, &job.h, &job.stride);
+	job.pixel_format = stream->configuration().pixelFormat;
+	for (auto const &span : app_.Mmap(payload->buffers[stream]))
+		job.planes.emplace_back(span.begin(), span.end());
+	job.metadata = payload->metadata;
+	job.raw = stream == app_.RawStream();
+	job.filename = filename;
+	job.update_latest = update_latest;
+	job.coarsen = false;
+	// The detections were made on the main stream, which isn't the stream we're saving in ZSL mode.
+	libcamera::Stream *main_stream = app_.GetMainStream();
+	if (options_->roi_downsample && !job.raw && job.pixel_format == libcamera::formats::YUV420 && main_stream)
+	{
+		app_.StreamDimensions(main_stream, &job.regions_w, &job.regions_h, nullptr);
+		job.coarsen = job.regions_w && job.regions_h &&
+					  get_regions_of_interest(payload->post_process_metadata, job.regions);
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	space_cond_.wait(lock, [this] { return jobs_.size() < max_jobs_ || exception_; });
+	rethrowError();
+	job.sequence = next_sequence_++;
+	jobs_.push_back(std::move(job));
+	job_cond_.notify_one();
+}
+
+void SaveQueue::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	space_cond_.wait(lock, [this] { return (jobs_.empty() && !busy_) || exception_; });
+	rethrowError();
+}
+
+void SaveQueue::rethrowError()
+{
+	if (exception_)
+	{
+		std::exception_ptr e = exception_;
+		exception_ = nullptr;
+		std::rethrow_exception(e);
+	}
+}
+
+void SaveQueue::saveImage(Job &job)
+{
+	StillOptions const *options = options_;
+	if (job.coarsen && options->encoding == "jpg")
+	{
+		if (job.regions_w != job.w || job.regions_h != job.h)
+		{
+			for (auto &r : job.regions)
+			{
+				// Round outwards, so that nothing in a region gets coarsened.
+				int64_t x1 = ((int64_t)(r.x + r.width) * job.w + job.regions_w - 1) / job.regions_w;
+				int64_t y1 = ((int64_t)(r.y + r.height) * job.h + job.regions_h - 1) / job.regions_h;
+				r.x = (int64_t)r.x * job.w / job.regions_w;
+				r.y = (int64_t)r.y * job.h / job.regions_h;
+				r.width = x1 - r.x;
+				r.height = y1 - r.y;
+			}
+		}
+		roi_coarsen_background(job.planes[0].data(), job.w, job.h, job.stride, job.regions,
+							   options->roi_downsample);
+	}
+	std::vector<libcamera::Span<uint8_t>> mem;
+	for (auto const &plane : job.planes)
+		mem.emplace_back((uint8_t *)plane.data(), plane.size());
+	if (job.raw)
+		dng_save(mem, job.w, job.h, job.stride, job.pixel_format, job.metadata, job.filename, app_.CameraId(),
+				 options);
+	else if (options->encoding == "jpg")
+		jpeg_save(mem, job.w, job.h, job.stride, job.pixel_format, job.metadata, job.filename, app_.CameraId(),
+				  options);
+	else if (options->encoding == "png")
+		png_save(mem, job.w, job.h, job.stride, job.pixel_format, job.filename, options);
+	else if (options->encoding == "bmp")
+		bmp_save(mem, job.w, job.h, job.stride, job.pixel_format, job.filename, options);
+	else
+		yuv_save(mem, job.w, job.h, job.stride, job.pixel_format, job.filename, options);
+	if (options->verbose)
+		std::cerr << "Saved image " << job.w << " x " << job.h << " to file " << job.filename << std::endl;
+}
+
+void SaveQueue::workerThread()
+{
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			job_cond_.wait(lock, [this] { return abort_ || !jobs_.empty(); });
+			if (jobs_.empty())
+				return; // only once we've been told to stop and there's nothing left
+			job = std::move(jobs_.front());
+			jobs_.pop_front();
+			busy_++;
+			space_cond_.notify_all();
+		}
+
+		try
+		{
+			saveImage(job);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!exception_)
+				exception_ = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		// Images may finish out of order, so don't let --latest go backwards.
+		if (job.update_latest && !exception_ && (!latest_valid_ || job.sequence > latest_sequence_))
+		{
+			update_latest_link(job.filename, options_);
+			latest_sequence_ = job.sequence;
+			latest_valid_ = true;
+		}
+		busy_--;
+		space_cond_.notify_all();
+	}
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * save_queue.hpp - save still images on worker threads.
+ */
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "core/libcamera_app.hpp"
+#include "core/still_options.hpp"
+
+// In jpeg.cpp:
+void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
+			   libcamera::PixelFormat const &pixel_format, libcamera::ControlList const &metadata,
+			   std::string const &filename, std::string const &cam_name, StillOptions const *options);
+
+// In yuv.cpp:
+void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
+			  libcamera::PixelFormat const &pixel_format, std::string const &filename, StillOptions const *options);
+
+// In dng.cpp:
+void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
+			  libcamera::PixelFormat const &pixel_format, libcamera::ControlList const &metadata,
+			  std::string const &filename, std::string const &cam_name, StillOptions const *options);
+
+// In png.cpp:
+void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
+			  libcamera::PixelFormat const &pixel_format, std::string const &filename, StillOptions const *options);
+
+// In bmp.cpp:
+void bmp_save(std::vector<libcamera::Span<uint8_t>> const &mem, unsigned int w, unsigned int h, unsigned int stride,
+			  libcamera::PixelFormat const &pixel_format, std::string const &filename, StillOptions const *options);
+
+inline void update_latest_link(std::string const &filename, StillOptions const *options)
+{
+	// Create a fixed-name link to the most recent output file, if requested.
+	if (!options->latest.empty())
+	{
+		struct stat buf;
+		if (stat(options->latest.c_str(), &buf) == 0 && unlink(options->latest.c_str()))
+			std::cerr << "WARNING: could not delete latest link " << options->latest << std::endl;
+		else
+		{
+			if (symlink(filename.c_str(), options->latest.c_str()))
+				std::cerr << "WARNING: failed to create latest link " << options->latest << std::endl;
+			else if (options->verbose)
+				std::cerr << "Link " << options->latest << " created" << std::endl;
+		}
+	}
+}
+
+// Captured images are saved on a couple of worker threads, so that the camera can go back
+// to the viewfinder (or on to the next timelapse capture) without waiting for the JPEG,
+// EXIF and DNG to be written, and so that the JPEG and DNG get written at the same time.
+// The buffers have to be copied first, because the camera will reuse them. If too many
+// images are waiting, Save() blocks until there is room.
+
+class SaveQueue
+{
+public:
+	SaveQueue(LibcameraApp &app, StillOptions const *options, unsigned int num_threads = 2, unsigned int max_jobs = 4);
+	~SaveQueue();
+
+	void Save(CompletedRequestPtr &payload, libcamera::Stream *stream, std::string const &filename, bool update_latest);
+
+	// Wait until everything queued so far has been saved, re-throwing the first error.
+	void Flush();
+
+private:
+	struct Job
+	{
+		std::vector<std::vector<uint8_t>> planes;
+		unsigned int w, h, stride;
+		libcamera::PixelFormat pixel_format;
+		libcamera::ControlList metadata;
+		bool raw;
+		std::string filename;
+		bool update_latest;
+		// Only for JPEGs: take the detail out of everything outside these regions, which are
+		// in the coordinates of an image of regions_w x regions_h (the main stream's size).
+		bool coarsen;
+		std::vector<libcamera::Rectangle> regions;
+		unsigned int regions_w, regions_h;
+		unsigned int sequence;
+	};
+
+	void rethrowError();
+	void saveImage(Job &job);
+	void workerThread();
+
+	LibcameraApp &app_;
+	StillOptions const *options_;
+	unsigned int max_jobs_;
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable job_cond_;
+	std::condition_variable space_cond_;
+	std::deque<Job> jobs_;
+	unsigned int busy_ = 0;
+	unsigned int next_sequence_ = 0;
+	unsigned int latest_sequence_ = 0;
+	bool latest_valid_ = false;
+	bool abort_ = false;
+	std::exception_ptr exception_;
+};
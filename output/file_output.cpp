@@ -5,16 +5,39 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
 #include "file_output.hpp"
 
+// How often (in microseconds of stream time) to hand what's been written to the sync thread.
+static constexpr int64_t SYNC_INTERVAL_US = 250000;
+
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0), last_sync_us_(0), synced_bytes_(0),
+	  disk_load_(0), sync_pending_(false), sync_abort_(false)
 {
+	if (options_->rate_control)
+		sync_thread_ = std::thread(&FileOutput::syncThread, this);
 }
 
 FileOutput::~FileOutput()
 {
 	closeFile();
+	if (sync_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(sync_mutex_);
+			sync_abort_ = true;
+		}
+		sync_cond_.notify_one();
+		sync_thread_.join();
+	}
+	if (sync_pending_)
+		close(sync_job_.fd);
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -40,6 +63,69 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 		if (options_->flush)
 			fflush(fp_);
 	}
+	if (fp_ && fp_ != stdout && options_->rate_control)
+		syncFile(timestamp_us);
+}
+
+float FileOutput::Congestion() const
+{
+	return std::max(Output::Congestion(), disk_load_.load());
+}
+
+void FileOutput::syncFile(int64_t timestamp_us)
+{
+	// A buffered write normally just lands in the page cache, so timing it says nothing about
+	// the disk. Instead, every so often the sync thread waits for everything written since last
+	// time to reach the disk, and counts the fraction of the interval that took. Should it still
+	// be waiting on the last lot, we try again next frame, by which time the disk is behind.
+	if (timestamp_us - last_sync_us_ < SYNC_INTERVAL_US)
+		return;
+
+	fflush(fp_);
+	off_t end = ftello(fp_);
+	{
+		std::lock_guard<std::mutex> lock(sync_mutex_);
+		if (sync_pending_)
+			return;
+		if (end > synced_bytes_)
+		{
+			int fd = dup(fileno(fp_));
+			if (fd < 0)
+				return;
+			sync_job_ = { fd, synced_bytes_, end - synced_bytes_, timestamp_us - last_sync_us_ };
+			sync_pending_ = true;
+		}
+	}
+	sync_cond_.notify_one();
+	synced_bytes_ = end;
+	last_sync_us_ = timestamp_us;
+}
+
+void FileOutput::syncThread()
+{
+	while (true)
+	{
+		SyncJob job;
+		{
+			std::unique_lock<std::mutex> lock(sync_mutex_);
+			sync_cond_.wait(lock, [this] { return sync_pending_ || sync_abort_; });
+			if (sync_abort_)
+				return;
+			job = sync_job_;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		sync_file_range(job.fd, job.offset, job.length,
+						SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		std::chrono::duration<double, std::micro> sync_time = std::chrono::steady_clock::now() - start;
+		close(job.fd);
+
+		float load = sync_time.count() / job.interval_us;
+		disk_load_ = 0.5 * disk_load_ + 0.5 * load;
+
+		std::lock_guard<std::mutex> lock(sync_mutex_);
+		sync_pending_ = false;
+	}
 }
 
 void FileOutput::openFile(int64_t timestamp_us)
@@ -64,6 +150,8 @@ void FileOutput::openFile(int64_t timestamp_us)
 			std::cerr << "FileOutput: opened output file " << filename << std::endl;
 
 		file_start_time_ms_ = timestamp_us / 1000;
+		last_sync_us_ = timestamp_us;
+		synced_bytes_ = 0;
 	}
 }
 
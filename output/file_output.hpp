@@ -7,6 +7,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "output.hpp"
 
 class FileOutput : public Output
@@ -14,6 +19,7 @@ class FileOutput : public Output
 public:
 	FileOutput(VideoOptions const *options);
 	~FileOutput();
+	float Congestion() const override;
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
@@ -21,7 +27,27 @@ protected:
 private:
 	void openFile(int64_t timestamp_us);
 	void closeFile();
+	void syncFile(int64_t timestamp_us);
+	void syncThread();
 	FILE *fp_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+	int64_t last_sync_us_;
+	off_t synced_bytes_;
+	std::atomic<float> disk_load_;
+	// A range of the file for the sync thread to wait on. It gets its own fd, as the file
+	// may be closed before it's done.
+	struct SyncJob
+	{
+		int fd;
+		off_t offset;
+		off_t length;
+		int64_t interval_us;
+	};
+	SyncJob sync_job_;
+	bool sync_pending_;
+	bool sync_abort_;
+	std::mutex sync_mutex_;
+	std::condition_variable sync_cond_;
+	std::thread sync_thread_;
 };
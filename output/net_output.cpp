@@ -6,8 +6,11 @@
  */
 
 #include <arpa/inet.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 
+#include <linux/sockios.h>
+
 #include "net_output.hpp"
 
 NetOutput::NetOutput(VideoOptions const *options) : Output(options)
@@ -88,6 +91,10 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->output);
+
+	socklen_t len = sizeof(send_buffer_size_);
+	if (getsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &send_buffer_size_, &len) < 0)
+		send_buffer_size_ = 0;
 }
 
 NetOutput::~NetOutput()
@@ -95,6 +102,14 @@ NetOutput::~NetOutput()
 	close(fd_);
 }
 
+float NetOutput::Congestion() const
+{
+	int queued;
+	if (send_buffer_size_ <= 0 || ioctl(fd_, SIOCOUTQ, &queued) < 0)
+		return Output::Congestion();
+	return std::max(Output::Congestion(), (float)queued / send_buffer_size_);
+}
+
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
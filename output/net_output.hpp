@@ -16,6 +16,9 @@ class NetOutput : public Output
 public:
 	NetOutput(VideoOptions const *options);
 	~NetOutput();
+	// Data waiting in the socket's send queue means the network isn't keeping up, even
+	// if sending hasn't (yet) started to block.
+	float Congestion() const override;
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
@@ -25,4 +28,5 @@ private:
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	int send_buffer_size_;
 };
@@ -5,6 +5,7 @@
  * output.cpp - video stream output base class
  */
 
+#include <chrono>
 #include <cinttypes>
 #include <stdexcept>
 
@@ -14,7 +15,8 @@
 #include "output.hpp"
 
 Output::Output(VideoOptions const *options)
-	: options_(options), state_(WAITING_KEYFRAME), fp_timestamps_(nullptr), time_offset_(0), last_timestamp_(0)
+	: options_(options), state_(WAITING_KEYFRAME), fp_timestamps_(nullptr), time_offset_(0), last_timestamp_(0),
+	  last_output_us_(0), congestion_(0)
 {
 	if (!options->save_pts.empty())
 	{
@@ -56,7 +58,17 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
 
+	auto start = std::chrono::steady_clock::now();
 	outputBuffer(mem, size, last_timestamp_, flags);
+	std::chrono::duration<double, std::micro> write_time = std::chrono::steady_clock::now() - start;
+
+	// Smooth this over the last few frames, so that a single slow write doesn't count for much.
+	if (!(flags & FLAG_RESTART) && timestamp_us > last_output_us_)
+	{
+		float load = write_time.count() / (timestamp_us - last_output_us_);
+		congestion_ = 0.9 * congestion_ + 0.1 * load;
+	}
+	last_output_us_ = timestamp_us;
 
 	// Save timestamps to a file, if that was requested.
 	if (fp_timestamps_)
@@ -22,6 +22,10 @@ public:
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	// How hard the output is working to keep up, as (roughly) the fraction of each frame
+	// interval spent writing. Values approaching 1 mean it is about to fall behind. This
+	// may be called from any thread.
+	virtual float Congestion() const { return congestion_; }
 
 protected:
 	enum Flag
@@ -45,4 +49,6 @@ private:
 	FILE *fp_timestamps_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
+	int64_t last_output_us_;
+	std::atomic<float> congestion_;
 };
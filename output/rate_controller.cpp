@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rate_controller.cpp - adapt the encoder's bitrate to what the output can manage.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include "rate_controller.hpp"
+
+RateController::RateController(VideoOptions const *options, Encoder *encoder, Output *output)
+	: options_(options), encoder_(encoder), output_(output), max_bitrate_(options->bitrate),
+	  min_bitrate_(options->bitrate / 10), bitrate_(options->bitrate), quality_(options->quality),
+	  last_update_(std::chrono::steady_clock::now())
+{
+}
+
+void RateController::Update()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (now - last_update_ < INTERVAL)
+		return;
+	last_update_ = now;
+
+	float congestion = output_->Congestion();
+	uint32_t bitrate = bitrate_;
+	int quality = quality_;
+	if (congestion > HIGH_CONGESTION)
+	{
+		bitrate = std::max(min_bitrate_, bitrate_ / 4 * 3);
+		quality = std::max(std::min(MIN_QUALITY, options_->quality), quality_ - 10);
+	}
+	else if (congestion < LOW_CONGESTION)
+	{
+		bitrate = std::min<uint64_t>(max_bitrate_, bitrate_ + std::max(bitrate_ / 20, 1u));
+		quality = std::min(options_->quality, quality_ + 2);
+	}
+
+	if (bitrate != bitrate_ && max_bitrate_)
+	{
+		bitrate_ = bitrate;
+		encoder_->SetBitrate(bitrate_);
+		if (options_->verbose)
+			std::cerr << "RateController: congestion " << congestion << ", bitrate now " << bitrate_ << std::endl;
+	}
+	if (quality != quality_ && options_->codec == "mjpeg")
+	{
+		quality_ = quality;
+		encoder_->SetQuality(quality_);
+		if (options_->verbose)
+			std::cerr << "RateController: congestion " << congestion << ", quality now " << quality_ << std::endl;
+	}
+}
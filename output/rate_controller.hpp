@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * rate_controller.hpp - adapt the encoder's bitrate to what the output can manage.
+ */
+
+#pragma once
+
+#include <chrono>
+
+#include "core/video_options.hpp"
+#include "encoder/encoder.hpp"
+#include "output.hpp"
+
+// When the output starts to struggle (a congested network, or a slow disk) we cut the
+// bitrate quickly, and when it copes comfortably we creep back up towards the bitrate the
+// user asked for, which is never exceeded. For MJPEG the quality moves in the same way.
+
+class RateController
+{
+public:
+	RateController(VideoOptions const *options, Encoder *encoder, Output *output);
+	// Call this once per frame; it only does anything every so often.
+	void Update();
+
+private:
+	static constexpr float HIGH_CONGESTION = 0.7;
+	static constexpr float LOW_CONGESTION = 0.3;
+	static constexpr std::chrono::milliseconds INTERVAL { 250 };
+	static constexpr int MIN_QUALITY = 20;
+
+	VideoOptions const *options_;
+	Encoder *encoder_;
+	Output *output_;
+	uint32_t max_bitrate_;
+	uint32_t min_bitrate_;
+	uint32_t bitrate_;
+	int quality_;
+	std::chrono::steady_clock::time_point last_update_;
+};
@@ -6,6 +6,19 @@
  */
 
 // The text string can include the % directives supported by FrameInfo.
+//
+// Rather than have OpenCV draw the whole string on every frame, we render each character
+// once into a little bitmap, and assemble these into a mask for the whole line. Usually
+// only the end of the line (frame number, fps and so on) changes between frames, so only
+// those characters need replacing in the mask. The mask and the background box are then
+// blended into the image with simple loops that the compiler can vectorise.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
 
 #include <libcamera/stream.h>
 
@@ -45,8 +58,32 @@ private:
 	double alpha_;
 	double adjusted_scale_;
 	int adjusted_thickness_;
+
+	struct Glyph
+	{
+		double advance;
+		unsigned int width;
+		std::vector<uint8_t> mask; // height_ rows of width bytes
+	};
+	Glyph const &getGlyph(char c);
+	void updateLine(std::string const &text);
+	void blend(uint8_t *ptr);
+
+	std::mutex mutex_;
+	InfoTextTemplate text_template_;
+	int text_height_, baseline_, pad_;
+	unsigned int glyph_height_;
+	std::map<char, Glyph> glyphs_;
+	// The text currently in the line mask, with the position of each character within it.
+	std::string line_text_;
+	std::vector<unsigned int> line_offsets_;
+	double line_advance_;
+	std::vector<uint8_t> line_;
+	unsigned int line_stride_;
 };
 
+static constexpr int FONT = FONT_HERSHEY_SIMPLEX;
+
 #define NAME "annotate_cv"
 
 char const *AnnotateCvStage::Name() const
@@ -76,6 +113,127 @@ void AnnotateCvStage::Configure()
 	// rather harshly quantised, not much we can do about that.
 	adjusted_scale_ = scale_ * width_ / 1200;
 	adjusted_thickness_ = std::max(thickness_ * width_ / 700, 1u);
+
+	// For the Hershey fonts the height and baseline don't depend on the text. Leave some
+	// room either side of each character for the thickness of the strokes.
+	Size size = getTextSize("0", FONT, adjusted_scale_, adjusted_thickness_, &baseline_);
+	text_height_ = size.height;
+	pad_ = adjusted_thickness_ + 2;
+	glyph_height_ = text_height_ + baseline_ + pad_;
+
+	glyphs_.clear();
+	line_text_.clear();
+	line_offsets_.clear();
+	line_advance_ = 0;
+	line_.clear();
+	line_stride_ = 0;
+}
+
+AnnotateCvStage::Glyph const &AnnotateCvStage::getGlyph(char c)
+{
+	auto it = glyphs_.find(c);
+	if (it != glyphs_.end())
+		return it->second;
+
+	// Characters advance by fractional amounts, but getTextSize rounds, so measure a few.
+	Glyph &glyph = glyphs_[c];
+	Size size = getTextSize(std::string(16, c), FONT, adjusted_scale_, adjusted_thickness_, nullptr);
+	glyph.advance = (size.width - adjusted_thickness_) / 16.0;
+	glyph.width = std::ceil(glyph.advance) + 2 * pad_;
+
+	// Row r of the glyph is row r of the image, and column pad_ is where the character starts.
+	Mat canvas(glyph_height_, glyph.width, CV_8U, Scalar(0));
+	putText(canvas, std::string(1, c), Point(pad_, text_height_), FONT, adjusted_scale_, Scalar(255),
+			adjusted_thickness_, 0);
+	glyph.mask.resize(glyph_height_ * glyph.width);
+	for (unsigned int y = 0; y < glyph_height_; y++)
+		memcpy(&glyph.mask[y * glyph.width], canvas.ptr(y), glyph.width);
+	return glyph;
+}
+
+void AnnotateCvStage::updateLine(std::string const &text)
+{
+	if (text == line_text_ && !line_.empty())
+		return;
+
+	// Characters before the first difference stay where they are.
+	unsigned int first = 0;
+	while (first < text.size() && first < line_text_.size() && text[first] == line_text_[first])
+		first++;
+
+	std::vector<double> positions(text.size() + 1, 0);
+	for (unsigned int i = 0; i < text.size(); i++)
+		positions[i + 1] = positions[i] + getGlyph(text[i]).advance;
+	unsigned int width = std::lround(positions.back()) + 2 * pad_ + 1;
+
+	unsigned int start = 0;
+	if (width > line_stride_)
+	{
+		line_stride_ = width + width / 2;
+		line_.assign(glyph_height_ * line_stride_, 0);
+		first = 0;
+	}
+	else
+	{
+		// Clear everything from the first changed character onwards, and redraw any earlier
+		// characters whose strokes reach into that area.
+		unsigned int clear_from = std::lround(positions[first]);
+		for (unsigned int y = 0; y < glyph_height_; y++)
+			memset(&line_[y * line_stride_ + clear_from], 0, line_stride_ - clear_from);
+		start = first;
+		for (unsigned int i = 0; i < first; i++)
+		{
+			if (line_offsets_[i] + glyphs_[text[i]].width > clear_from)
+			{
+				start = i;
+				break;
+			}
+		}
+	}
+
+	line_offsets_.resize(text.size());
+	for (unsigned int i = start; i < text.size(); i++)
+	{
+		Glyph const &glyph = getGlyph(text[i]);
+		unsigned int offset = line_offsets_[i] = std::lround(positions[i]);
+		for (unsigned int y = 0; y < glyph_height_; y++)
+		{
+			uint8_t *dest = &line_[y * line_stride_ + offset];
+			uint8_t const *src = &glyph.mask[y * glyph.width];
+			for (unsigned int x = 0; x < glyph.width; x++)
+				dest[x] |= src[x];
+		}
+	}
+	line_text_ = text;
+	line_advance_ = positions.back();
+}
+
+void AnnotateCvStage::blend(uint8_t *ptr)
+{
+	// The background box is where the original putText version put it, and blended in 8.8
+	// fixed point.
+	unsigned int box_width = std::min<unsigned int>(std::lround(line_advance_ + adjusted_thickness_), width_);
+	unsigned int box_height = std::min<unsigned int>(text_height_ + baseline_, height_);
+	unsigned int a = std::clamp<int>(std::lround(alpha_ * 256), 0, 256);
+	unsigned int bg = std::clamp(bg_, 0, 255) * a;
+	uint8_t *row = ptr;
+	for (unsigned int y = 0; y < box_height; y++, row += stride_)
+	{
+		for (unsigned int x = 0; x < box_width; x++)
+			row[x] = (bg + (256 - a) * row[x]) >> 8;
+	}
+
+	// Column pad_ of the line mask is the left edge of the image.
+	unsigned int mask_width = std::min<unsigned int>(line_stride_ - pad_, width_);
+	unsigned int mask_height = std::min(glyph_height_, height_);
+	uint8_t fg = std::clamp(fg_, 0, 255);
+	row = ptr;
+	for (unsigned int y = 0; y < mask_height; y++, row += stride_)
+	{
+		uint8_t const *mask = &line_[y * line_stride_ + pad_];
+		for (unsigned int x = 0; x < mask_width; x++)
+			row[x] = mask[x] ? fg : row[x];
+	}
 }
 
 bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
@@ -83,25 +241,17 @@ bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
 	FrameInfo info(completed_request->metadata);
 	info.sequence = completed_request->sequence;
+	info.fps = completed_request->framerate;
+
+	// Requests may be processed in parallel, but they all share the cached text.
+	std::lock_guard<std::mutex> lock(mutex_);
 
 	// Other post-processing stages can supply metadata to update the text.
 	completed_request->post_process_metadata.Get("annotate.text", text_);
-	std::string text = info.ToString(text_);
-
-	uint8_t *ptr = (uint8_t *)buffer.data();
-	Mat im(height_, width_, CV_8U, ptr, stride_);
-	int font = FONT_HERSHEY_SIMPLEX;
-
-	int baseline = 0;
-	Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
-
-	// Can't find a handy "draw rectangle with alpha" function...
-	for (int y = 0; y < size.height + baseline; y++, ptr += stride_)
-	{
-		for (int x = 0; x < size.width; x++)
-			ptr[x] = bg_ * alpha_ + (1 - alpha_) * ptr[x];
-	}
-	putText(im, text, Point(0, size.height), font, adjusted_scale_, fg_, adjusted_thickness_, 0);
+	if (text_template_.Text() != text_)
+		text_template_.Compile(text_);
+	updateLine(text_template_.Render(info));
+	blend((uint8_t *)buffer.data());
 
 	return false;
 }
@@ -54,6 +54,8 @@ private:
 	std::mutex future_ptr_mutex_;
 	Mat image_;
 	std::vector<cv::Rect> faces_;
+	// Counts the times detection has run, so that other stages can tell new results from old.
+	unsigned int generation_ = 0;
 	CascadeClassifier cascade_;
 	std::string cascadeName_;
 	double scaling_factor_;
@@ -90,7 +92,7 @@ void FaceDetectCvStage::Configure()
 	stream_ = nullptr;
 	full_stream_ = nullptr;
 
-	if (app_->StillStream()) // for stills capture, do nothing
+	if (app_->StillStream() && !app_->ViewfinderStream()) // for stills capture, do nothing
 		return;
 
 	// Otherwise we expect there to be a lo res stream that we will use.
@@ -136,6 +138,7 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 	std::transform(faces_.begin(), faces_.end(), std::back_inserter(temprect),
 				   [](Rect &r) { return libcamera::Rectangle(r.x, r.y, r.width, r.height); });
 	completed_request->post_process_metadata.Set("detected_faces", temprect);
+	completed_request->post_process_metadata.Set("face_detect.generation", generation_);
 
 	if (draw_features_)
 	{
@@ -168,6 +171,7 @@ void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 	}
 	std::unique_lock<std::mutex> lock(face_mutex_);
 	faces_ = std::move(temp_faces);
+	generation_++;
 }
 
 void FaceDetectCvStage::drawFeatures(Mat &img)
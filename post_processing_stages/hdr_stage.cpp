@@ -25,6 +25,7 @@
 #include <libcamera/stream.h>
 
 #include "core/libcamera_app.hpp"
+#include "core/thread_pool.hpp"
 
 #include "post_processing_stages/histogram.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -36,6 +37,7 @@ struct LpFilterConfig
 {
 	double strength; // smaller value actually smoothes more
 	Pwl threshold; // defines the level of pixel differences that will be smoothed over
+	unsigned int halo; // rows of overlap each band gets to "warm up" the IIR filter
 };
 
 // A TonemapPoint gives a target value within the full dynamic range where we would like
@@ -75,204 +77,206 @@ struct LocalTonemapConfig
 struct HdrConfig
 {
 	unsigned int num_frames; // number of frames to accumulate
+	unsigned int num_threads; // threads to use for the filtering and tonemapping (0 for all cores)
+	unsigned int band_height; // rows filtered and tonemapped in one go, bounding the scratch memory
 	LpFilterConfig lp_filter; // low pass filter settings
 	GlobalTonemapConfig global_tonemap; // global tonemap settings
 	LocalTonemapConfig local_tonemap; // settings for adding back local contrast
 };
 
+// All the processing works on images scaled to this range, whether we started with one
+// frame or several, so that the filter and tonemap parameters mean the same thing.
+
+static constexpr int DYNAMIC_RANGE = 4096;
+
+// The accumulator for multi-frame HDR. It holds the sums of the Y, U and V planes over
+// all the frames, with U and V made signed. A single frame (DRC) doesn't need one.
+
 struct HdrImage
 {
-	HdrImage() : width(0), height(0), dynamic_range(0) {}
-	HdrImage(int w, int h, int num_pixels) : width(w), height(h), pixels(num_pixels), dynamic_range(0) {}
+	HdrImage() : width(0), height(0) {}
+	HdrImage(int w, int h, int num_pixels) : width(w), height(h), pixels(num_pixels) {}
 	int width;
 	int height;
 	std::vector<int16_t> pixels;
-	int dynamic_range; // 1 more than the maximum pixel value
 	int16_t &P(unsigned int offset) { return pixels[offset]; }
 	int16_t P(unsigned int offset) const { return pixels[offset]; }
 	void Clear() { std::fill(pixels.begin(), pixels.end(), 0); }
-	void Accumulate(uint8_t const *src, int stride);
-	HdrImage LpFilter(LpFilterConfig const &config) const;
-	Pwl CreateTonemap(GlobalTonemapConfig const &config) const;
-	void Tonemap(HdrImage const &lp, HdrConfig const &config);
-	void Extract(uint8_t *dest, int stride) const;
-	Histogram CalculateHistogram() const;
-	void Scale(double factor);
+	void Accumulate(uint8_t const *src, int stride, ThreadPool &pool);
 };
 
-static void add_Y_pixels(int16_t *dest, uint8_t const *src, int width, int stride, int height)
-{
-	for (int y = 0; y < height; y++, src += stride)
-	{
-		for (int x = 0; x < width; x++)
-			*(dest++) += src[x];
-	}
-}
-
 // Add the new image buffer to this "accumulator" image. We just add them as
-// we don't have the horsepower to do any fancy alignment or anything.
-// Actually, spreading it across a few threads doesn't seem to help much, though
-// compiling with "gcc -mfpu=neon-fp-armv8 -ftree-vectorize" gives a big
-// improvement.
+// we don't have the horsepower to do any fancy alignment or anything. Bands of
+// row pairs are shared out across the threads, and compiling with
+// "gcc -mfpu=neon-fp-armv8 -ftree-vectorize" lets the inner loops use NEON.
 
-void HdrImage::Accumulate(uint8_t const *src, int stride)
+void HdrImage::Accumulate(uint8_t const *src, int stride, ThreadPool &pool)
 {
-	int16_t *dest = &P(0);
-	int width2 = width / 2, stride2 = stride / 2;
-	std::thread thread1(add_Y_pixels, dest, src, width, stride, height);
-
-	dest += width * height;
-	src += stride * height;
-
-	// U and V components
-	for (int y = 0; y < height; y++, src += stride2)
-	{
-		for (int x = 0; x < width2; x++)
-			*(dest++) += src[x] - 128;
-	}
-
-	dynamic_range += 256;
-
-	thread1.join();
+	int width2 = width / 2, height2 = height / 2, stride2 = stride / 2;
+	int16_t *dest_U = &P(width * height), *dest_V = dest_U + width2 * height2;
+	uint8_t const *src_U = src + stride * height, *src_V = src_U + stride2 * height2;
+	unsigned int num_jobs = pool.Size();
+
+	pool.ParallelFor(num_jobs, [&](unsigned int job, unsigned int) {
+		int y2_begin = job * height2 / num_jobs, y2_end = (job + 1) * height2 / num_jobs;
+		for (int y = 2 * y2_begin; y < 2 * y2_end; y++)
+		{
+			int16_t *dest = &P(y * width);
+			uint8_t const *s = src + y * stride;
+			for (int x = 0; x < width; x++)
+				dest[x] += s[x];
+		}
+		for (int y = y2_begin; y < y2_end; y++)
+		{
+			int16_t *dest_u = dest_U + y * width2, *dest_v = dest_V + y * width2;
+			uint8_t const *s_u = src_U + y * stride2, *s_v = src_V + y * stride2;
+			for (int x = 0; x < width2; x++)
+			{
+				dest_u[x] += s_u[x] - 128;
+				dest_v[x] += s_v[x] - 128;
+			}
+		}
+	});
 }
 
-// Forward pass of the IIR low pass filter.
+// The IIR low pass filter works in fixed point. Pixel differences get scaled by a
+// per-level factor (from the threshold Pwl) to index a table of weights, both of which
+// have 12 fractional bits, as does the "strength" of the central pixel.
 
-static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &fwd_weight_sums, HdrImage const &in,
-						 std::vector<double> &weights, std::vector<double> &threshold, int width, int height, int size,
-						 double strength)
+static constexpr int LP_FRAC_BITS = 12;
+static constexpr unsigned int LP_NUM_WEIGHTS = 31;
 
+struct LpFilterTables
 {
-	// (Should probably initialise the top/left elements of fwd_pixels/fwd_weight_sums...)
-	for (int y = size; y < height; y++)
+	LpFilterTables(LpFilterConfig const &config, int dynamic_range)
 	{
-		unsigned int off = y * width + size;
-		for (int x = size; x < width; x++, off++)
+		// Cache threshold values, computing them would be slow.
+		std::vector<double> threshold = config.threshold.GenerateLut<double>();
+		scale.resize(dynamic_range);
+		for (int i = 0; i < dynamic_range; i++)
 		{
-			int pixel = in.P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = fwd_pixels[off - width - 1];
-			p[1] = fwd_pixels[off - width];
-			p[2] = fwd_pixels[off - width + 1];
-			p[3] = fwd_pixels[off - 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			fwd_pixels[off] = pixel_wt_sum / wt_sum;
-			fwd_weight_sums[off] = wt_sum;
+			double t = threshold[std::min<int>(i, threshold.size() - 1)];
+			scale[i] = std::min(10.0 / t * (1 << LP_FRAC_BITS), (double)(1 << 20));
 		}
+
+		// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
+		for (unsigned int d = 0; d < LP_NUM_WEIGHTS; d++)
+			weights[d] = exp(-(double)(d * d) / 100.0) * (1 << LP_FRAC_BITS) + 0.5;
+
+		strength = std::max<int>(config.strength * (1 << LP_FRAC_BITS) + 0.5, 1);
 	}
-}
+	std::vector<uint32_t> scale;
+	uint16_t weights[LP_NUM_WEIGHTS];
+	int strength;
+};
 
-// Low pass IIR filter. We perform a forwards and a reverse pass, finally combining
-// the results to get a smoothed but vaguely edge-preserving version of the
-// accumulator image. You could imagine implementing alternative (more sophisticated)
-// filters.
+// Tonemapping adds the high pass detail (the original pixel minus the low pass one) back
+// onto the tone mapped low pass image. Everything per-pixel comes out of integer LUTs.
+// The local contrast strengths have 12 fractional bits, and we keep a table of
+// 1 / (Y + 1) with 24 fractional bits so that the colour scaling needs no division.
+// The strength tables are compiled and cached by their Pwls, so only the tone curve,
+// which changes with every image, actually gets rebuilt for each capture.
 
-HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
+struct TonemapTables
 {
-	// Cache threshold values, computing them would be slow.
-	std::vector<double> threshold = config.threshold.GenerateLut<double>();
-
-	// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
-	std::vector<double> weights(31);
-	for (int d = 0; d <= 30; d++)
-		weights[d] = exp(-d * d / 100.0);
-
-	int size = 1;
-	double strength = config.strength;
-
-	// Forward pass.
-	std::vector<double> fwd_weight_sums(width * height);
-	std::vector<double> fwd_pixels(width * height);
-
-	HdrImage out(width, height, width * height);
-	out.dynamic_range = dynamic_range;
-
-	// Run the forward pass in other thread, so that the two passes run in parallel.
-	std::thread fwd_pass(forward_pass, std::ref(fwd_pixels), std::ref(fwd_weight_sums), std::ref(*this),
-						 std::ref(weights), std::ref(threshold), width, height, size, strength);
-
-	// Reverse pass, but otherwise the same as the forward pass. There could be a small
-	// saving in omitting it, but it's not huge given that they run in parallel.
-	std::vector<double> rev_weight_sums(width * height);
-	std::vector<double> rev_pixels(width * height);
-	// (Should probably initialise the bottom/right elements of rev_pixels/rev_weight_sums...)
-	for (int y = height - 1 - size; y >= 0; y--)
+	TonemapTables(Pwl const &tonemap, LocalTonemapConfig const &config, int dynamic_range)
+		: tonemap_lut(tonemap.IntLut(dynamic_range)), pos_strength_lut(config.pos_strength.IntLut(dynamic_range, 4096)),
+		  neg_strength_lut(config.neg_strength.IntLut(dynamic_range, 4096)), recip_lut(dynamic_range)
 	{
-		unsigned int off = y * width + width - 1 - size;
-		for (int x = width - 1 - size; x >= 0; x--, off--)
-		{
-			int pixel = P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = rev_pixels[off + width + 1];
-			p[1] = rev_pixels[off + width];
-			p[2] = rev_pixels[off + width - 1];
-			p[3] = rev_pixels[off + 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			rev_pixels[off] = pixel_wt_sum / wt_sum;
-			rev_weight_sums[off] = wt_sum;
-		}
+		for (int i = 0; i < dynamic_range; i++)
+			recip_lut[i] = (INT64_C(1) << 24) / (i + 1);
+		colour_scale = config.colour_scale * 4096 + 0.5;
 	}
+	std::vector<int> tonemap_lut;
+	std::vector<int> const &pos_strength_lut;
+	std::vector<int> const &neg_strength_lut;
+	std::vector<int64_t> recip_lut;
+	int64_t colour_scale;
+};
 
-	fwd_pass.join();
+// Everything downstream of the accumulation runs in bands of rows. Each band is low pass
+// filtered, tonemapped and written straight back to the camera buffer, so there's never
+// a full resolution low pass image. The scratch memory depends only on the band height
+// and the number of threads, and is all allocated when the stage is configured.
 
-	// Combine.
-	unsigned int off = 0;
-	for (int y = 0; y < height; y++)
+struct BandScratch
+{
+	void Allocate(int width, int band_height)
 	{
-		for (int x = 0; x < width; x++, off++)
-			out.P(off) = (fwd_pixels[off] * fwd_weight_sums[off] + rev_pixels[off] * rev_weight_sums[off]) /
-						 (fwd_weight_sums[off] + rev_weight_sums[off]);
+		fwd_pixels.resize(band_height * width);
+		fwd_weight_sums.resize(band_height * width);
+		ring_pixels.resize(2 * width);
+		ring_weight_sums.resize(2 * width);
+		histogram.resize(DYNAMIC_RANGE);
 	}
+	// The forward pass for the rows of the band itself, kept until the reverse pass gets there.
+	std::vector<int16_t> fwd_pixels;
+	std::vector<uint16_t> fwd_weight_sums;
+	// Just the current and previous rows, for the forward pass halo and for the reverse pass.
+	std::vector<int16_t> ring_pixels;
+	std::vector<uint16_t> ring_weight_sums;
+	std::vector<uint32_t> histogram;
+};
+
+// The first row we meet in either pass just copies the input, with zero weight so that it
+// doesn't count when the passes are combined. The "in_lut" scales the input (one frame or
+// the sum of several) to the full dynamic range.
 
-	return out;
+template <typename T>
+static void lp_first_row(T const *in, int16_t const *in_lut, int16_t *pixels, uint16_t *wt_sums, int width)
+{
+	for (int x = 0; x < width; x++)
+	{
+		pixels[x] = in_lut[in[x]];
+		wt_sums[x] = 0;
+	}
 }
 
-Histogram HdrImage::CalculateHistogram() const
+// One row of the IIR filter, where "prev" is the filtered row we did before this one. With
+// dir = 1 we go forwards, taking neighbours from above and to the left; with dir = -1 we go
+// from right to left using neighbours from below and to the right. Again the first pixel
+// we meet just copies the input.
+
+template <typename T>
+static void lp_row(T const *in, int16_t const *in_lut, int16_t const *prev, int16_t *pixels, uint16_t *wt_sums,
+				   LpFilterTables const &tables, int width, int dir)
 {
-	std::vector<uint32_t> bins(dynamic_range);
-	std::fill(bins.begin(), bins.end(), 0);
-	for (int i = 0; i < width * height; i++)
-		bins[P(i)]++;
-	return Histogram(&bins[0], dynamic_range);
+	int x = dir > 0 ? 0 : width - 1;
+	pixels[x] = in_lut[in[x]];
+	wt_sums[x] = 0;
+	x += dir;
+
+	for (int i = 1; i < width; i++, x += dir)
+	{
+		int pixel = in_lut[in[x]];
+		uint32_t scale = tables.scale[pixel];
+		int pixel_wt_sum = pixel * tables.strength, wt_sum = tables.strength;
+
+		int p[4];
+		p[0] = prev[x - dir];
+		p[1] = prev[x];
+		// At the far edge there's nothing beyond "above", so use that again.
+		p[2] = i < width - 1 ? prev[x + dir] : p[1];
+		p[3] = pixels[x - dir];
+		for (int j = 0; j < 4; j++)
+		{
+			uint32_t idx = (std::abs(p[j] - pixel) * scale) >> LP_FRAC_BITS;
+			int wt = idx < LP_NUM_WEIGHTS ? tables.weights[idx] : 0;
+			pixel_wt_sum += wt * p[j];
+			wt_sum += wt;
+		}
+
+		pixels[x] = pixel_wt_sum / wt_sum;
+		wt_sums[x] = wt_sum;
+	}
 }
 
 // This creates the tone curve that we apply to the low pass image using the list of
 // quantiles and targets in the configuration.
 
-Pwl HdrImage::CreateTonemap(GlobalTonemapConfig const &config) const
+static Pwl create_tonemap(Histogram const &histogram, GlobalTonemapConfig const &config)
 {
-	int maxval = dynamic_range - 1;
-	Histogram histogram = CalculateHistogram();
+	int maxval = DYNAMIC_RANGE - 1;
 
 	Pwl tonemap;
 	tonemap.Append(0, 0);
@@ -290,85 +294,6 @@ Pwl HdrImage::CreateTonemap(GlobalTonemapConfig const &config) const
 	return tonemap;
 }
 
-// Tonemap the low pass image according to the global tone curve, and add back the high pass
-// detail (given by the original pixel minus the low pass equivalent).
-
-void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config)
-{
-	Pwl tonemap = CreateTonemap(config.global_tonemap);
-
-	// Make LUTs for the all the Pwls, it'll be much quicker.
-	std::vector<int> tonemap_lut = tonemap.GenerateLut<int>();
-	std::vector<double> pos_strength_lut = config.local_tonemap.pos_strength.GenerateLut<double>();
-	std::vector<double> neg_strength_lut = config.local_tonemap.neg_strength.GenerateLut<double>();
-	double colour_scale = config.local_tonemap.colour_scale;
-
-	int maxval = dynamic_range - 1;
-	for (int y = 0; y < height; y++)
-	{
-		unsigned int off_Y = y * width;
-		unsigned int off_U = y * width / 4 + width * height;
-		unsigned int off_V = off_U + width * height / 4;
-		for (int x = 0; x < width; x++, off_Y++)
-		{
-			int Y_lp_orig = lp.P(off_Y), Y_hp = P(off_Y) - Y_lp_orig;
-			int Y_lp_mapped = tonemap_lut[Y_lp_orig];
-			double strength = (Y_hp > 0 ? pos_strength_lut : neg_strength_lut)[Y_lp_orig];
-			int Y_final = std::clamp(Y_lp_mapped + (int)(strength * Y_hp), 0, maxval);
-			P(off_Y) = Y_final;
-			if (!(x & 1) && !(y & 1))
-			{
-				double f = (Y_final + 1) / (double)(Y_lp_orig + 1);
-				// The values here are non-linear to colours can come out slightly saturated.
-				// The colour_scale allows us to tweak that a little if we want.
-				f = (f - 1) * colour_scale + 1;
-				int U = P(off_U), V = P(off_V);
-				P(off_U) = U * f;
-				P(off_V) = V * f;
-				off_U++, off_V++;
-			}
-		}
-	}
-}
-
-// Write image back out to 8-bit buffer with given stride.
-
-void HdrImage::Extract(uint8_t *dest, int stride) const
-{
-	double ratio = dynamic_range / 256;
-	const int16_t *Y_ptr = &pixels[0];
-	const int16_t *U_ptr = Y_ptr + width * height, *V_ptr = U_ptr + width * height / 4;
-	uint8_t *dest_y = dest;
-	uint8_t *dest_u = dest_y + stride * height, *dest_v = dest_u + stride * height / 4;
-
-	for (int y = 0; y < height; y++, dest_y += stride)
-	{
-		for (int x = 0; x < width; x++)
-			dest_y[x] = *(Y_ptr++) / ratio;
-	}
-
-	int w = width / 2, h = height / 2, s = stride / 2;
-	for (int y = 0; y < h; y++, dest_u += s, dest_v += s)
-	{
-		for (int x = 0; x < w; x++)
-		{
-			int U = *(U_ptr++) / ratio;
-			int V = *(V_ptr++) / ratio;
-			dest_u[x] = std::clamp(U + 128, 0, 255);
-			dest_v[x] = std::clamp(V + 128, 0, 255);
-		}
-	}
-}
-
-// Apply simple scaling to all pixels.
-
-void HdrImage::Scale(double factor)
-{
-	for (unsigned int i = 0; i < pixels.size(); i++)
-		pixels[i] *= factor;
-	dynamic_range *= factor;
-}
-
 class HdrStage : public PostProcessingStage
 {
 public:
@@ -385,12 +310,24 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	template <typename T>
+	void processImage(T const *in, uint8_t *image);
+	template <typename T>
+	void processBand(T const *in, int band, BandScratch &scratch, TonemapTables const &tables, uint8_t *image);
+
 	Stream *stream_;
 	unsigned width_, height_, stride_;
 	HdrConfig config_;
 	unsigned int frame_num_;
 	std::mutex mutex_;
-	HdrImage acc_, lp_;
+	HdrImage acc_; // only for multiple frames
+	std::vector<uint8_t> y_copy_; // only for a single frame
+	std::vector<int16_t> in_lut_;
+	std::unique_ptr<LpFilterTables> lp_tables_;
+	std::vector<BandScratch> scratch_;
+	int band_height_;
+	int num_bands_;
+	std::unique_ptr<ThreadPool> pool_;
 };
 
 #define NAME "hdr"
@@ -403,9 +340,14 @@ char const *HdrStage::Name() const
 void HdrStage::Read(boost::property_tree::ptree const &params)
 {
 	config_.num_frames = params.get<unsigned int>("num_frames");
+	config_.num_threads = params.get<unsigned int>("num_threads", 0);
+	config_.band_height = params.get<unsigned int>("band_height", 256);
+	if (config_.num_frames == 0 || config_.num_frames > 128)
+		throw std::runtime_error("HdrStage: num_frames must be between 1 and 128");
 
 	config_.lp_filter.strength = params.get<double>("lp_filter_strength");
 	config_.lp_filter.threshold.Read(params.get_child("lp_filter_threshold"));
+	config_.lp_filter.halo = params.get<unsigned int>("lp_filter_halo", 64);
 
 	for (auto &p : params.get_child("global_tonemap_points"))
 	{
@@ -442,17 +384,171 @@ void HdrStage::AdjustConfig(std::string const &use_case, StreamConfiguration *co
 
 void HdrStage::Configure()
 {
+	// Let go of anything from a previous configuration first, we don't want to be holding
+	// onto big buffers while in viewfinder mode.
+	acc_ = HdrImage();
+	y_copy_ = std::vector<uint8_t>();
+	scratch_.clear();
+
 	stream_ = app_->StillStream(&width_, &height_, &stride_);
 	if (!stream_)
 		return;
 	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("HdrStage: only supports YUV420");
 
-	// Allocate and initialise the big accumulator image.
+	if (!pool_ || (config_.num_threads && pool_->Size() != config_.num_threads))
+		pool_ = std::make_unique<ThreadPool>(config_.num_threads);
+
+	// Only multi-frame HDR needs the big accumulator image. With a single frame we keep
+	// just a copy of the Y plane, because the bands overwrite rows that the neighbouring
+	// bands' filter halos still want to read. The U and V planes are done in place.
 	frame_num_ = 0;
-	acc_ = HdrImage(width_, height_, width_ * height_ * 3 / 2);
-	acc_.Clear();
-	lp_ = HdrImage(width_, height_, width_ * height_);
+	if (config_.num_frames > 1)
+	{
+		acc_ = HdrImage(width_, height_, width_ * height_ * 3 / 2);
+		acc_.Clear();
+	}
+	else
+		y_copy_.resize(width_ * height_);
+
+	// Input values (a pixel, or a sum of them) are scaled to the full range by a table.
+	int num_values = 256 * config_.num_frames;
+	in_lut_.resize(num_values);
+	for (int i = 0; i < num_values; i++)
+		in_lut_[i] = i * (DYNAMIC_RANGE / 256) / (int)config_.num_frames;
+
+	lp_tables_ = std::make_unique<LpFilterTables>(config_.lp_filter, DYNAMIC_RANGE);
+
+	// Bands must be whole pairs of rows, so that chroma rows aren't split.
+	band_height_ = std::min(std::max(config_.band_height & ~1u, 2u), (height_ + 1) & ~1u);
+	num_bands_ = (height_ + band_height_ - 1) / band_height_;
+	scratch_.resize(pool_->Size());
+	for (auto &s : scratch_)
+		s.Allocate(width_, band_height_);
+}
+
+template <typename T>
+void HdrStage::processBand(T const *in, int band, BandScratch &scratch, TonemapTables const &tables, uint8_t *image)
+{
+	int width = width_, height = height_;
+	int y0 = band * band_height_, y1 = std::min(y0 + band_height_, height);
+	int halo = config_.lp_filter.halo;
+	int fwd_begin = std::max(y0 - halo, 0), rev_end = std::min(y1 + halo, height);
+	int16_t const *in_lut = &in_lut_[0];
+
+	// Rows of the band have their forward pass stored, halo rows only need the ring.
+	auto fwd_pixels = [&](int y) {
+		return y >= y0 ? &scratch.fwd_pixels[(y - y0) * width] : &scratch.ring_pixels[(y & 1) * width];
+	};
+	auto fwd_weight_sums = [&](int y) {
+		return y >= y0 ? &scratch.fwd_weight_sums[(y - y0) * width] : &scratch.ring_weight_sums[(y & 1) * width];
+	};
+	auto rev_pixels = [&](int y) { return &scratch.ring_pixels[(y & 1) * width]; };
+	auto rev_weight_sums = [&](int y) { return &scratch.ring_weight_sums[(y & 1) * width]; };
+
+	lp_first_row(in + fwd_begin * width, in_lut, fwd_pixels(fwd_begin), fwd_weight_sums(fwd_begin), width);
+	for (int y = fwd_begin + 1; y < y1; y++)
+		lp_row(in + y * width, in_lut, fwd_pixels(y - 1), fwd_pixels(y), fwd_weight_sums(y), *lp_tables_, width, 1);
+
+	// Combine the two passes for a finished row, then tonemap it and write it out.
+	int maxval = DYNAMIC_RANGE - 1;
+	int width2 = width / 2, stride2 = stride_ / 2;
+	uint8_t *image_U = image + stride_ * height, *image_V = image_U + stride2 * (height / 2);
+	int16_t const *acc_U = config_.num_frames > 1 ? &acc_.P(width * height) : nullptr;
+	int16_t const *acc_V = acc_U ? acc_U + width2 * (height / 2) : nullptr;
+	int num_frames = config_.num_frames;
+
+	auto output_row = [&](int y) {
+		T const *in_row = in + y * width;
+		int16_t const *fwd_p = fwd_pixels(y), *rev_p = rev_pixels(y);
+		uint16_t const *fwd_w = fwd_weight_sums(y), *rev_w = rev_weight_sums(y);
+		uint8_t *dest_Y = image + y * stride_;
+		uint8_t *dest_U = image_U + (y / 2) * stride2, *dest_V = image_V + (y / 2) * stride2;
+		for (int x = 0; x < width; x++)
+		{
+			int Y_orig = in_lut[in_row[x]];
+			int wt_sum = fwd_w[x] + rev_w[x];
+			int Y_lp = wt_sum ? (fwd_p[x] * fwd_w[x] + rev_p[x] * rev_w[x]) / wt_sum : Y_orig;
+			int Y_lp_orig = std::clamp(Y_lp, 0, maxval), Y_hp = Y_orig - Y_lp_orig;
+			int Y_lp_mapped = tables.tonemap_lut[Y_lp_orig];
+			int strength = (Y_hp > 0 ? tables.pos_strength_lut : tables.neg_strength_lut)[Y_lp_orig];
+			int Y_final = std::clamp(Y_lp_mapped + (strength * Y_hp) / 4096, 0, maxval);
+			dest_Y[x] = Y_final / (DYNAMIC_RANGE / 256);
+			if (!(x & 1) && !(y & 1))
+			{
+				// f = (Y_final + 1) / (Y_lp_orig + 1), with 24 fractional bits.
+				int64_t f = (Y_final + 1) * tables.recip_lut[Y_lp_orig];
+				// The values here are non-linear to colours can come out slightly saturated.
+				// The colour_scale allows us to tweak that a little if we want.
+				f = (f - (1 << 24)) * tables.colour_scale / 4096 + (1 << 24);
+				int x2 = x / 2, U, V;
+				if (acc_U)
+				{
+					int off = (y / 2) * width2 + x2;
+					U = acc_U[off] * (DYNAMIC_RANGE / 256) / num_frames;
+					V = acc_V[off] * (DYNAMIC_RANGE / 256) / num_frames;
+				}
+				else
+				{
+					U = (dest_U[x2] - 128) * (DYNAMIC_RANGE / 256);
+					V = (dest_V[x2] - 128) * (DYNAMIC_RANGE / 256);
+				}
+				U = (U * f) / (1 << 24);
+				V = (V * f) / (1 << 24);
+				dest_U[x2] = std::clamp(U / (DYNAMIC_RANGE / 256) + 128, 0, 255);
+				dest_V[x2] = std::clamp(V / (DYNAMIC_RANGE / 256) + 128, 0, 255);
+			}
+		}
+	};
+
+	// The reverse pass only needs two rows of its own, as each band row gets finished off
+	// as soon as the reverse pass reaches it.
+	lp_first_row(in + (rev_end - 1) * width, in_lut, rev_pixels(rev_end - 1), rev_weight_sums(rev_end - 1), width);
+	if (rev_end == y1)
+		output_row(rev_end - 1);
+	for (int y = rev_end - 2; y >= y0; y--)
+	{
+		lp_row(in + y * width, in_lut, rev_pixels(y + 1), rev_pixels(y), rev_weight_sums(y), *lp_tables_, width, -1);
+		if (y < y1)
+			output_row(y);
+	}
+}
+
+// Low pass IIR filter. We perform a forwards and a reverse pass, finally combining
+// the results to get a smoothed but vaguely edge-preserving version of the
+// image, which we tonemap before adding back the high pass detail. You could imagine
+// implementing alternative (more sophisticated) filters.
+
+// The image is divided into bands of rows which are processed in parallel. Each pass is
+// started "halo" rows before the band so that the recursive filter has settled by the
+// time it gets there. Within a row the filter is inherently serial, so it's the bands
+// that give us our parallelism.
+
+template <typename T>
+void HdrStage::processImage(T const *in, uint8_t *image)
+{
+	// First we need a histogram of the whole image for the global tonemap.
+	int width = width_, height = height_;
+	unsigned int num_jobs = pool_->Size();
+	for (auto &s : scratch_)
+		std::fill(s.histogram.begin(), s.histogram.end(), 0);
+	pool_->ParallelFor(num_jobs, [&](unsigned int job, unsigned int thread) {
+		uint32_t *bins = &scratch_[thread].histogram[0];
+		T const *begin = in + job * height / num_jobs * width, *end = in + (job + 1) * height / num_jobs * width;
+		for (T const *p = begin; p < end; p++)
+			bins[in_lut_[*p]]++;
+	});
+	for (unsigned int i = 1; i < scratch_.size(); i++)
+	{
+		for (int j = 0; j < DYNAMIC_RANGE; j++)
+			scratch_[0].histogram[j] += scratch_[i].histogram[j];
+	}
+	Histogram histogram(&scratch_[0].histogram[0], DYNAMIC_RANGE);
+	TonemapTables tables(create_tonemap(histogram, config_.global_tonemap), config_.local_tonemap, DYNAMIC_RANGE);
+
+	pool_->ParallelFor(num_bands_, [&](unsigned int band, unsigned int thread) {
+		processBand(in, band, scratch_[thread], tables, image);
+	});
 }
 
 bool HdrStage::Process(CompletedRequestPtr &completed_request)
@@ -472,7 +568,13 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 
 	// Accumulate frame.
 	std::cerr << "Accumulating frame " << frame_num_ << std::endl;
-	acc_.Accumulate(image, stride_);
+	if (config_.num_frames > 1)
+		acc_.Accumulate(image, stride_, *pool_);
+	else
+	{
+		for (unsigned int y = 0; y < height_; y++)
+			memcpy(&y_copy_[y * width_], image + y * stride_, width_);
+	}
 
 	// Now we'll drop this frame unless it's the last one that we need, at which point
 	// we do our HDR processing and send that through.
@@ -482,17 +584,16 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 
 	// Do HDR processing.
 	std::cerr << "Doing HDR processing..." << std::endl;
-	acc_.Scale(16.0 / config_.num_frames);
-
-	lp_ = acc_.LpFilter(config_.lp_filter);
-	acc_.Tonemap(lp_, config_);
-
-	acc_.Extract(image, stride_);
+	if (config_.num_frames > 1)
+		processImage(&acc_.P(0), image);
+	else
+		processImage(&y_copy_[0], image);
 	std::cerr << "HDR done!" << std::endl;
 
 	return false;
 }
 
+
 static PostProcessingStage *Create(LibcameraApp *app)
 {
 	return new HdrStage(app);
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * motion_detect.hpp - motion detector per-cell result
+ */
+
+#pragma once
+
+#include <vector>
+
+// The motion detector divides its region of interest into a grid of cells. For
+// each cell it reports the fraction of pixels that changed, the mean absolute
+// difference (the "energy") per pixel and whether the cell on its own counts as
+// "motion". Cells are stored in row-major order.
+
+struct MotionDetectGrid
+{
+	MotionDetectGrid(unsigned int c, unsigned int r)
+		: cols(c), rows(r), changed(c * r), energy(c * r), motion(c * r)
+	{
+	}
+	unsigned int cols;
+	unsigned int rows;
+	std::vector<float> changed;
+	std::vector<float> energy;
+	std::vector<bool> motion;
+};
@@ -10,24 +10,113 @@
 // location in the previous one. If it exceeds a threshold it gets counted as
 // "different". If enough pixels are different, that indicates "motion".
 // A low res image of something like 128x96 is probably more than enough, and you
-// can always subsample with hskip and vksip.
+// can always subsample with hskip and vksip. Without a low res stream, setting use_pyramid
+// makes the stage scale the main image down to pyramid_width pixels across instead.
 
 // Because this gets run in parallel by the post-processing framework, it means
 // the "previous frame" is not totally guaranteed to be the actual previous one,
 // though in practice it is, and it doesn't actually matter even if it wasn't.
 
+// The region of interest can also be divided into a grid of cells (grid_cols x grid_rows)
+// which are all scored in the same single pass over the image, so that several "zones"
+// can be monitored without running several motion detectors.
+
+// Rather than comparing against the previous frame, a background model can be used by
+// setting background_alpha to less than 1. The reference image then becomes a running
+// average, updated by that fraction of the difference on each comparison.
+
 // The stage adds "motion_detect.result" to the metadata. When this claims motion,
 // the application can take that as true immediately. To be sure there's no motion,
-// an application should probably wait for "a few frames" of "no motion".
+// an application should probably wait for "a few frames" of "no motion". The per-cell
+// scores are added as "motion_detect.grid" (see motion_detect.hpp).
 
+#include <string.h>
+
+#include <libcamera/formats.h>
 #include <libcamera/stream.h>
 
 #include "core/libcamera_app.hpp"
 
+#include "post_processing_stages/motion_detect.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/resize_pyramid.hpp"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using Stream = libcamera::Stream;
 
+// Compare n pixels of the current image against the reference, accumulating the sum of
+// absolute differences and the number of pixels counted as "different". A pixel is
+// different when (|new - old| << 8) > old * m + c, where m and c are the difference_m
+// and difference_c parameters in 8.8 fixed point. The right hand side saturates at 0xffff,
+// which no difference can exceed, so large thresholds behave just as they would unclamped.
+
+static void compare_pixels(uint8_t const *cur, uint8_t const *ref, unsigned int n, uint16_t m, uint16_t c,
+						   uint32_t &sad, uint32_t &changed)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	uint16x8_t vm = vdupq_n_u16(m), vc = vdupq_n_u16(c);
+	uint32x4_t sad_acc = vdupq_n_u32(0), changed_acc = vdupq_n_u32(0);
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16_t a = vld1q_u8(cur + x), b = vld1q_u8(ref + x);
+		uint8x16_t d = vabdq_u8(a, b);
+		sad_acc = vpadalq_u16(sad_acc, vpaddlq_u8(d));
+		uint16x8_t b_lo = vmovl_u8(vget_low_u8(b)), b_hi = vmovl_u8(vget_high_u8(b));
+		uint16x8_t t_lo = vqaddq_u16(vcombine_u16(vqmovn_u32(vmull_u16(vget_low_u16(b_lo), vget_low_u16(vm))),
+												  vqmovn_u32(vmull_u16(vget_high_u16(b_lo), vget_high_u16(vm)))),
+									 vc);
+		uint16x8_t t_hi = vqaddq_u16(vcombine_u16(vqmovn_u32(vmull_u16(vget_low_u16(b_hi), vget_low_u16(vm))),
+												  vqmovn_u32(vmull_u16(vget_high_u16(b_hi), vget_high_u16(vm)))),
+									 vc);
+		uint16x8_t gt_lo = vcgtq_u16(vshll_n_u8(vget_low_u8(d), 8), t_lo);
+		uint16x8_t gt_hi = vcgtq_u16(vshll_n_u8(vget_high_u8(d), 8), t_hi);
+		changed_acc = vpadalq_u16(changed_acc, vaddq_u16(vshrq_n_u16(gt_lo, 15), vshrq_n_u16(gt_hi, 15)));
+	}
+	uint64x2_t sad_sum = vpaddlq_u32(sad_acc), changed_sum = vpaddlq_u32(changed_acc);
+	sad += vgetq_lane_u64(sad_sum, 0) + vgetq_lane_u64(sad_sum, 1);
+	changed += vgetq_lane_u64(changed_sum, 0) + vgetq_lane_u64(changed_sum, 1);
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1), ones = _mm_set1_epi16(-1);
+	__m128i vm = _mm_set1_epi16(m), vc = _mm_set1_epi16(c);
+	__m128i sad_acc = zero, changed_acc = zero;
+	for (; x + 16 <= n; x += 16)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(cur + x));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(ref + x));
+		__m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+		sad_acc = _mm_add_epi64(sad_acc, _mm_sad_epu8(a, b));
+		// Interleaving zero below d gives us d << 8 in each 16-bit lane.
+		// Saturate old * m wherever the high half of the product is non-zero, then add c.
+		__m128i b_lo = _mm_unpacklo_epi8(b, zero), b_hi = _mm_unpackhi_epi8(b, zero);
+		__m128i ovf_lo = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_mulhi_epu16(b_lo, vm), zero), ones);
+		__m128i ovf_hi = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_mulhi_epu16(b_hi, vm), zero), ones);
+		__m128i t_lo = _mm_adds_epu16(_mm_or_si128(_mm_mullo_epi16(b_lo, vm), ovf_lo), vc);
+		__m128i t_hi = _mm_adds_epu16(_mm_or_si128(_mm_mullo_epi16(b_hi, vm), ovf_hi), vc);
+		// There's no unsigned 16-bit compare, but a saturating subtract is non-zero exactly when d > t.
+		__m128i le_lo = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_unpacklo_epi8(zero, d), t_lo), zero);
+		__m128i le_hi = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_unpackhi_epi8(zero, d), t_hi), zero);
+		__m128i gt = _mm_add_epi16(_mm_andnot_si128(le_lo, one), _mm_andnot_si128(le_hi, one));
+		changed_acc = _mm_add_epi32(changed_acc, _mm_madd_epi16(gt, one));
+	}
+	sad += _mm_cvtsi128_si32(sad_acc) + _mm_cvtsi128_si32(_mm_srli_si128(sad_acc, 8));
+	changed_acc = _mm_add_epi32(changed_acc, _mm_srli_si128(changed_acc, 8));
+	changed_acc = _mm_add_epi32(changed_acc, _mm_srli_si128(changed_acc, 4));
+	changed += _mm_cvtsi128_si32(changed_acc);
+#endif
+	for (; x < n; x++)
+	{
+		unsigned int d = std::abs(cur[x] - ref[x]);
+		sad += d;
+		changed += (d << 8) > ref[x] * (unsigned int)m + c;
+	}
+}
+
 class MotionDetectStage : public PostProcessingStage
 {
 public:
@@ -42,7 +131,8 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	// In the Config, dimensions are given as fractions of the lores image size.
+	// In the Config, dimensions are given as fractions of the lores image size (or of the
+	// scaled main image, when that's used instead).
 	struct Config
 	{
 		float roi_x, roi_y;
@@ -52,16 +142,32 @@ private:
 		int difference_c;
 		float region_threshold;
 		int frame_period;
+		int grid_cols, grid_rows;
+		float background_alpha;
+		bool use_pyramid;
+		int pyramid_width;
 		bool verbose;
 	} config_;
+	void updateReference(uint8_t const *cur, unsigned int y);
 	Stream *stream_;
 	unsigned lores_stride_;
+	// When there's no lores stream, the size the main image is scaled to, or zero.
+	unsigned int pyramid_width_, pyramid_height_;
 	// Here we convert the dimensions to pixel locations in the lores image, as if subsampled
 	// by hskip and vskip.
 	unsigned int roi_x_, roi_y_;
 	unsigned int roi_width_, roi_height_;
 	unsigned int region_threshold_;
+	// The difference threshold in 8.8 fixed point (see compare_pixels).
+	uint16_t difference_m_, difference_c_;
+	// Cell boundaries, in pixels of the subsampled ROI. There is one more entry than cells.
+	std::vector<unsigned int> col_starts_, row_starts_;
+	std::vector<unsigned int> cell_thresholds_;
+	// 8.8 fixed point running average, only used when background_alpha < 1.
+	std::vector<uint16_t> background_;
+	uint16_t alpha_;
 	std::vector<uint8_t> previous_frame_;
+	std::vector<uint8_t> row_;
 	bool first_time_;
 	bool motion_detected_;
 	std::mutex mutex_;
@@ -86,14 +192,47 @@ void MotionDetectStage::Read(boost::property_tree::ptree const &params)
 	config_.difference_c = params.get<int>("difference_c", 10);
 	config_.region_threshold = params.get<float>("region_threshold", 0.005);
 	config_.frame_period = params.get<int>("frame_period", 5);
+	config_.grid_cols = params.get<int>("grid_cols", 1);
+	config_.grid_rows = params.get<int>("grid_rows", 1);
+	config_.background_alpha = params.get<float>("background_alpha", 1.0);
+	config_.use_pyramid = params.get<int>("use_pyramid", 0);
+	config_.pyramid_width = params.get<int>("pyramid_width", 128);
 	config_.verbose = params.get<int>("verbose", 0);
+
+	// The threshold is worked out in 8.8 fixed point, clamped to 0xffff. Nothing can differ by
+	// more than 255 anyway, so that only matters for values that could never detect motion.
+	if (config_.difference_m < 0 || config_.difference_c < 0)
+		std::cerr << "MotionDetectStage: WARNING: negative difference_m/difference_c treated as 0" << std::endl;
+	else if (255 * config_.difference_m + config_.difference_c > 255)
+		std::cerr << "MotionDetectStage: WARNING: difference_m/difference_c too large to detect motion in the "
+					 "brightest pixels"
+				  << std::endl;
+	config_.difference_m = std::clamp<float>(config_.difference_m, 0, 255);
+	config_.difference_c = std::clamp(config_.difference_c, 0, 255);
+	if (config_.background_alpha <= 0 || config_.background_alpha > 1)
+		throw std::runtime_error("MotionDetectStage: background_alpha must be in (0, 1]");
 }
 
 void MotionDetectStage::Configure()
 {
 	unsigned lores_width, lores_height;
 	stream_ = app_->LoresStream(&lores_width, &lores_height, &lores_stride_);
-	if (!stream_)
+	pyramid_width_ = pyramid_height_ = 0;
+	if (!stream_ && config_.use_pyramid)
+	{
+		Stream *main_stream = app_->GetMainStream();
+		if (main_stream && main_stream->configuration().pixelFormat == libcamera::formats::YUV420)
+		{
+			unsigned int main_width, main_height;
+			app_->StreamDimensions(main_stream, &main_width, &main_height, nullptr);
+			// Keep the aspect ratio, and both dimensions even as the pyramid wants.
+			pyramid_width_ = std::clamp<unsigned int>(config_.pyramid_width, 2, main_width) & ~1;
+			pyramid_height_ = std::max(pyramid_width_ * main_height / main_width, 2u) & ~1;
+			lores_width = lores_stride_ = pyramid_width_;
+			lores_height = pyramid_height_;
+		}
+	}
+	if (!stream_ && !pyramid_width_)
 		return;
 
 	config_.hskip = std::max(config_.hskip, 1);
@@ -116,69 +255,155 @@ void MotionDetectStage::Configure()
 	roi_height_ = std::clamp(roi_height_, 0u, lores_height - roi_y_);
 	region_threshold_ = std::clamp(region_threshold_, 0u, roi_width_ * roi_height_);
 
+	difference_m_ = std::min(config_.difference_m * 256 + 0.5, 65535.0);
+	difference_c_ = config_.difference_c * 256;
+
+	// Work out the cell boundaries and how many pixels in each cell must change.
+	config_.grid_cols = std::clamp(config_.grid_cols, 1, std::max<int>(roi_width_, 1));
+	config_.grid_rows = std::clamp(config_.grid_rows, 1, std::max<int>(roi_height_, 1));
+	col_starts_.resize(config_.grid_cols + 1);
+	row_starts_.resize(config_.grid_rows + 1);
+	for (int i = 0; i <= config_.grid_cols; i++)
+		col_starts_[i] = i * roi_width_ / config_.grid_cols;
+	for (int i = 0; i <= config_.grid_rows; i++)
+		row_starts_[i] = i * roi_height_ / config_.grid_rows;
+	cell_thresholds_.resize(config_.grid_cols * config_.grid_rows);
+	for (int j = 0; j < config_.grid_rows; j++)
+	{
+		for (int i = 0; i < config_.grid_cols; i++)
+		{
+			unsigned int cell_size = (col_starts_[i + 1] - col_starts_[i]) * (row_starts_[j + 1] - row_starts_[j]);
+			cell_thresholds_[j * config_.grid_cols + i] = config_.region_threshold * cell_size;
+		}
+	}
+
 	if (config_.verbose)
 		std::cerr << "Lores: " << lores_width << "x" << lores_height << " roi: (" << roi_x_ << "," << roi_y_ << ") "
-				  << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_ << std::endl;
+				  << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_ << " grid: "
+				  << config_.grid_cols << "x" << config_.grid_rows << std::endl;
 
 	previous_frame_.resize(roi_width_ * roi_height_);
+	row_.resize(roi_width_);
+	alpha_ = config_.background_alpha * 256 + 0.5;
+	if (alpha_ < 256)
+		background_.resize(roi_width_ * roi_height_);
+	else
+		background_.clear();
 	first_time_ = true;
 	motion_detected_ = false;
 }
 
+// Replace row y of the reference image either with the new pixels, or move the running
+// average background towards them.
+
+void MotionDetectStage::updateReference(uint8_t const *cur, unsigned int y)
+{
+	uint8_t *ref = &previous_frame_[y * roi_width_];
+	if (background_.empty() || first_time_)
+	{
+		memcpy(ref, cur, roi_width_);
+		if (!background_.empty())
+		{
+			uint16_t *bg = &background_[y * roi_width_];
+			for (unsigned int x = 0; x < roi_width_; x++)
+				bg[x] = cur[x] << 8;
+		}
+		return;
+	}
+
+	// This is written so that the compiler can vectorise it.
+	uint16_t *bg = &background_[y * roi_width_];
+	int alpha = alpha_;
+	for (unsigned int x = 0; x < roi_width_; x++)
+	{
+		int value = bg[x] + ((((int)cur[x] << 8) - bg[x]) * alpha) / 256;
+		bg[x] = value;
+		ref[x] = (value + 128) >> 8;
+	}
+}
+
 bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 {
-	if (!stream_)
+	if (!stream_ && !pyramid_width_)
 		return false;
 
 	if (config_.frame_period && completed_request->sequence % config_.frame_period)
 		return false;
 
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
-	uint8_t *image = buffer.data();
+	std::shared_ptr<ResizePyramid> pyramid;
+	uint8_t const *image;
+	if (stream_)
+		image = app_->Mmap(completed_request->buffers[stream_])[0].data();
+	else
+	{
+		pyramid = ResizePyramid::Get(app_, completed_request);
+		image = pyramid->At(pyramid_width_, pyramid_height_).data.data();
+	}
 
-	// We need to protect access to first_time_, previous_frame_ and motion_detected_.
+	// We need to protect access to first_time_, previous_frame_, background_ and motion_detected_.
 	std::lock_guard<std::mutex> lock(mutex_);
 
-	if (first_time_)
+	MotionDetectGrid grid(config_.grid_cols, config_.grid_rows);
+	std::vector<uint32_t> sad(grid.cols * grid.rows), changed(grid.cols * grid.rows);
+
+	// In a single pass over the ROI, compare each row against the reference image, cell by
+	// cell, and update the reference as we go.
+	for (unsigned int y = 0, cell_row = 0; y < roi_height_; y++)
 	{
-		first_time_ = false;
-		for (unsigned int y = 0; y < roi_height_; y++)
+		uint8_t const *cur = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
+		if (config_.hskip > 1)
+		{
+			for (unsigned int x = 0; x < roi_width_; x++, cur += config_.hskip)
+				row_[x] = *cur;
+			cur = &row_[0];
+		}
+
+		if (!first_time_)
 		{
-			uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-			uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-			for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
-				*(old_value_ptr++) = *new_value_ptr;
+			while (y >= row_starts_[cell_row + 1])
+				cell_row++;
+			uint8_t const *ref = &previous_frame_[y * roi_width_];
+			for (unsigned int i = 0; i < grid.cols; i++)
+			{
+				unsigned int cell = cell_row * grid.cols + i, x = col_starts_[i];
+				compare_pixels(cur + x, ref + x, col_starts_[i + 1] - x, difference_m_, difference_c_, sad[cell],
+							   changed[cell]);
+			}
 		}
 
+		updateReference(cur, y);
+	}
+
+	if (first_time_)
+	{
+		first_time_ = false;
 		completed_request->post_process_metadata.Set("motion_detect.result", motion_detected_);
+		completed_request->post_process_metadata.Set("motion_detect.grid", std::move(grid));
 
 		return false;
 	}
 
-	bool motion_detected = false;
 	unsigned int regions = 0;
-
-	// Count the lores pixels where the difference between the new and previous values
-	// exceeds the threshold. At the same time, update the previous image buffer.
-	for (unsigned int y = 0; y < roi_height_; y++)
+	for (unsigned int j = 0; j < grid.rows; j++)
 	{
-		uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-		uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-		for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
+		for (unsigned int i = 0; i < grid.cols; i++)
 		{
-			int new_value = *new_value_ptr;
-			int old_value = *old_value_ptr;
-			*(old_value_ptr++) = new_value;
-			regions += std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c;
-			motion_detected = regions >= region_threshold_;
+			unsigned int cell = j * grid.cols + i;
+			unsigned int cell_size = (col_starts_[i + 1] - col_starts_[i]) * (row_starts_[j + 1] - row_starts_[j]);
+			regions += changed[cell];
+			grid.changed[cell] = cell_size ? changed[cell] / (float)cell_size : 0;
+			grid.energy[cell] = cell_size ? sad[cell] / (float)cell_size : 0;
+			grid.motion[cell] = changed[cell] >= cell_thresholds_[cell];
 		}
 	}
+	bool motion_detected = regions >= region_threshold_;
 
 	if (config_.verbose && motion_detected != motion_detected_)
 		std::cerr << "Motion " << (motion_detected ? "detected" : "stopped") << std::endl;
 
 	motion_detected_ = motion_detected;
 	completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
+	completed_request->post_process_metadata.Set("motion_detect.grid", std::move(grid));
 
 	return false;
 }
@@ -50,6 +50,8 @@ private:
 	void readLabelsFile(const std::string &file_name);
 
 	std::vector<Detection> output_results_;
+	// Counts the inferences, so that other stages can tell new results from repeated ones.
+	unsigned int generation_ = 0;
 	std::vector<std::string> labels_;
 	size_t label_count_;
 };
@@ -95,6 +97,7 @@ void ObjectDetectTfStage::checkConfiguration()
 void ObjectDetectTfStage::applyResults(CompletedRequestPtr &completed_request)
 {
 	completed_request->post_process_metadata.Set("object_detect.results", output_results_);
+	completed_request->post_process_metadata.Set("object_detect.generation", generation_);
 }
 
 static unsigned int area(const Rectangle &r)
@@ -113,6 +116,7 @@ void ObjectDetectTfStage::interpretOutputs()
 	float *classes = interpreter_->tensor(class_index)->data.f;
 
 	output_results_.clear();
+	generation_++;
 
 	for (int i = 0; i < num_detections; i++)
 	{
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * object_track.hpp - object tracker result
+ */
+
+#pragma once
+
+#include <sstream>
+
+#include "object_detect.hpp"
+
+struct Track
+{
+	Track(unsigned int i, const Detection &d, float vx, float vy, unsigned int a)
+		: id(i), detection(d), velocity_x(vx), velocity_y(vy), age(a)
+	{
+	}
+	// Stable identifier, kept for as long as the tracker can follow the object.
+	unsigned int id;
+	// The smoothed (and, between detector updates, predicted) detection.
+	Detection detection;
+	// Velocity of the box centre in pixels per frame.
+	float velocity_x, velocity_y;
+	// Number of frames since the detector last confirmed this track.
+	unsigned int age;
+	std::string toString() const
+	{
+		std::stringstream output;
+		output.precision(2);
+		output << "#" << id << " " << detection.toString() << " v " << velocity_x << "," << velocity_y << " age "
+			   << age;
+		return output.str();
+	}
+};
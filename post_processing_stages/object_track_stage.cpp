@@ -0,0 +1,398 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * object_track_stage.cpp - object tracker
+ */
+
+// A lightweight tracker that follows the boxes produced by an (expensive) detector
+// stage that only refreshes its results every "refresh_rate" frames. Detections are
+// associated to existing tracks by IoU, and each track's centre is run through a
+// constant velocity Kalman filter. On every frame the tracks are predicted forward,
+// so downstream consumers get smooth, up-to-date positions with stable ids even
+// though the detector itself might only run at a few Hz.
+
+// The detector stages re-attach their most recent results to every frame, along with a
+// generation number that counts the times they have actually run ("object_detect.generation"
+// or "face_detect.generation"). A new generation is a fresh set of detections even if it
+// finds exactly the same boxes, as it may in a static scene. For detectors that don't
+// supply one, we fall back to treating a set that differs from the last one as new.
+
+// Between detections the tracks are extrapolated, but only for as many frames as the
+// detector normally takes to refresh. A track that has gone longer than that without being
+// confirmed stays where it was last seen, rather than drifting away.
+
+// The stage must come after the detector in the JSON file. It adds
+// "object_track.results" to the metadata, and can optionally replace the detector's
+// own results ("object_detect.results" or "detected_faces") with the tracked boxes
+// so that drawing stages pick them up.
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+
+#include <libcamera/geometry.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+#include "object_detect.hpp"
+#include "object_track.hpp"
+
+using Rectangle = libcamera::Rectangle;
+
+class ObjectTrackStage : public PostProcessingStage
+{
+public:
+	ObjectTrackStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	// Constant velocity Kalman filter for one coordinate of the box centre.
+	struct Kalman1D
+	{
+		void Init(float position);
+		void Predict(float dt, float q);
+		void Update(float z, float r);
+		float x, v; // position and velocity (per frame)
+		float p00, p01, p10, p11; // covariance
+	};
+	struct TrackState
+	{
+		unsigned int id;
+		int category;
+		std::string name;
+		float confidence;
+		Kalman1D cx, cy;
+		float width, height;
+		unsigned int hits;
+		unsigned int missed; // consecutive detector updates without a match
+		unsigned int age; // frames since the last match
+	};
+	struct Config
+	{
+		bool faces;
+		float iou_threshold;
+		unsigned int max_missed;
+		unsigned int max_age;
+		unsigned int min_hits;
+		float process_noise;
+		float measurement_noise;
+		float size_smoothing;
+		bool replace_results;
+		bool verbose;
+	} config_;
+
+	std::vector<Detection> getDetections(CompletedRequestPtr &completed_request) const;
+	bool isNewDetections(std::vector<Detection> const &detections) const;
+	void predict(unsigned int frames);
+	void update(std::vector<Detection> const &detections);
+	void attachResults(CompletedRequestPtr &completed_request);
+
+	std::mutex mutex_;
+	std::vector<TrackState> tracks_;
+	std::vector<Detection> last_detections_;
+	unsigned int last_generation_;
+	unsigned int next_id_;
+	unsigned int last_sequence_;
+	bool first_time_;
+	// Frames between the last two detector updates, and when the last one was.
+	unsigned int update_interval_;
+	unsigned int last_update_sequence_;
+	bool updated_;
+};
+
+#define NAME "object_track"
+
+char const *ObjectTrackStage::Name() const
+{
+	return NAME;
+}
+
+void ObjectTrackStage::Read(boost::property_tree::ptree const &params)
+{
+	std::string source = params.get<std::string>("source", "object_detect");
+	if (source != "object_detect" && source != "faces")
+		throw std::runtime_error("ObjectTrackStage: unknown source " + source);
+	config_.faces = source == "faces";
+	config_.iou_threshold = params.get<float>("iou_threshold", 0.3);
+	config_.max_missed = params.get<unsigned int>("max_missed", 2);
+	config_.max_age = params.get<unsigned int>("max_age", 60);
+	config_.min_hits = params.get<unsigned int>("min_hits", 1);
+	config_.process_noise = params.get<float>("process_noise", 1.0);
+	config_.measurement_noise = params.get<float>("measurement_noise", 25.0);
+	config_.size_smoothing = params.get<float>("size_smoothing", 0.5);
+	config_.replace_results = params.get<int>("replace_results", 1);
+	config_.verbose = params.get<int>("verbose", 0);
+
+	config_.size_smoothing = std::clamp(config_.size_smoothing, 0.0f, 1.0f);
+}
+
+void ObjectTrackStage::Configure()
+{
+	tracks_.clear();
+	last_detections_.clear();
+	last_generation_ = 0;
+	next_id_ = 0;
+	last_sequence_ = 0;
+	first_time_ = true;
+	update_interval_ = 0;
+	last_update_sequence_ = 0;
+	updated_ = false;
+}
+
+void ObjectTrackStage::Kalman1D::Init(float position)
+{
+	x = position;
+	v = 0;
+	// Start out with a fairly uncertain velocity.
+	p00 = 10;
+	p01 = p10 = 0;
+	p11 = 100;
+}
+
+void ObjectTrackStage::Kalman1D::Predict(float dt, float q)
+{
+	x += v * dt;
+	// P = F P F^T + Q, where F = [1 dt; 0 1] and Q is the usual white-noise acceleration model.
+	float n00 = p00 + dt * (p10 + p01) + dt * dt * p11 + q * dt * dt * dt / 3;
+	float n01 = p01 + dt * p11 + q * dt * dt / 2;
+	float n10 = p10 + dt * p11 + q * dt * dt / 2;
+	float n11 = p11 + q * dt;
+	p00 = n00, p01 = n01, p10 = n10, p11 = n11;
+}
+
+void ObjectTrackStage::Kalman1D::Update(float z, float r)
+{
+	float s = p00 + r;
+	float k0 = p00 / s, k1 = p10 / s;
+	float y = z - x;
+	x += k0 * y;
+	v += k1 * y;
+	float n00 = (1 - k0) * p00, n01 = (1 - k0) * p01;
+	float n10 = p10 - k1 * p00, n11 = p11 - k1 * p01;
+	p00 = n00, p01 = n01, p10 = n10, p11 = n11;
+}
+
+static float iou(const Rectangle &a, const Rectangle &b)
+{
+	Rectangle overlap = a.boundedTo(b);
+	float intersection = (float)overlap.width * overlap.height;
+	float uni = (float)a.width * a.height + (float)b.width * b.height - intersection;
+	return uni > 0 ? intersection / uni : 0;
+}
+
+std::vector<Detection> ObjectTrackStage::getDetections(CompletedRequestPtr &completed_request) const
+{
+	std::vector<Detection> detections;
+	if (config_.faces)
+	{
+		std::vector<Rectangle> faces;
+		if (completed_request->post_process_metadata.Get("detected_faces", faces) == 0)
+		{
+			for (auto &f : faces)
+				detections.emplace_back(0, "face", 1.0, f.x, f.y, f.width, f.height);
+		}
+	}
+	else
+		completed_request->post_process_metadata.Get("object_detect.results", detections);
+	return detections;
+}
+
+bool ObjectTrackStage::isNewDetections(std::vector<Detection> const &detections) const
+{
+	if (detections.size() != last_detections_.size())
+		return true;
+	for (unsigned int i = 0; i < detections.size(); i++)
+	{
+		Detection const &a = detections[i], &b = last_detections_[i];
+		if (a.category != b.category || a.confidence != b.confidence || a.box != b.box)
+			return true;
+	}
+	return false;
+}
+
+void ObjectTrackStage::predict(unsigned int frames)
+{
+	for (auto &track : tracks_)
+	{
+		// Once the detector is overdue, stop moving the track and just let it age.
+		if (track.age + frames > update_interval_)
+			track.cx.v = track.cy.v = 0;
+		track.cx.Predict(frames, config_.process_noise);
+		track.cy.Predict(frames, config_.process_noise);
+		track.age += frames;
+	}
+
+	tracks_.erase(std::remove_if(tracks_.begin(), tracks_.end(),
+								 [this](TrackState const &t) { return t.age > config_.max_age; }),
+				  tracks_.end());
+}
+
+void ObjectTrackStage::update(std::vector<Detection> const &detections)
+{
+	// Greedy association: take the best remaining (track, detection) pair by IoU, so long
+	// as it beats the threshold and the categories match.
+	struct Candidate
+	{
+		float iou;
+		unsigned int track, detection;
+	};
+	std::vector<Candidate> candidates;
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		TrackState const &track = tracks_[t];
+		Rectangle predicted(track.cx.x - track.width / 2, track.cy.x - track.height / 2, track.width, track.height);
+		for (unsigned int d = 0; d < detections.size(); d++)
+		{
+			if (detections[d].category != track.category)
+				continue;
+			float overlap = iou(predicted, detections[d].box);
+			if (overlap >= config_.iou_threshold)
+				candidates.push_back({ overlap, t, d });
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(),
+			  [](Candidate const &a, Candidate const &b) { return a.iou > b.iou; });
+
+	std::vector<bool> track_matched(tracks_.size(), false), detection_matched(detections.size(), false);
+	float r = config_.measurement_noise, alpha = config_.size_smoothing;
+	for (auto &c : candidates)
+	{
+		if (track_matched[c.track] || detection_matched[c.detection])
+			continue;
+		track_matched[c.track] = detection_matched[c.detection] = true;
+
+		TrackState &track = tracks_[c.track];
+		Detection const &detection = detections[c.detection];
+		track.cx.Update(detection.box.x + detection.box.width / 2.0, r);
+		track.cy.Update(detection.box.y + detection.box.height / 2.0, r);
+		track.width = alpha * track.width + (1 - alpha) * detection.box.width;
+		track.height = alpha * track.height + (1 - alpha) * detection.box.height;
+		track.name = detection.name;
+		track.confidence = detection.confidence;
+		track.hits++;
+		track.missed = 0;
+		track.age = 0;
+	}
+
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		if (!track_matched[t])
+			tracks_[t].missed++;
+	}
+	tracks_.erase(std::remove_if(tracks_.begin(), tracks_.end(),
+								 [this](TrackState const &t) { return t.missed > config_.max_missed; }),
+				  tracks_.end());
+
+	for (unsigned int d = 0; d < detections.size(); d++)
+	{
+		if (detection_matched[d])
+			continue;
+		Detection const &detection = detections[d];
+		TrackState track;
+		track.id = next_id_++;
+		track.category = detection.category;
+		track.name = detection.name;
+		track.confidence = detection.confidence;
+		track.cx.Init(detection.box.x + detection.box.width / 2.0);
+		track.cy.Init(detection.box.y + detection.box.height / 2.0);
+		track.width = detection.box.width;
+		track.height = detection.box.height;
+		track.hits = 1;
+		track.missed = 0;
+		track.age = 0;
+		tracks_.push_back(std::move(track));
+	}
+}
+
+void ObjectTrackStage::attachResults(CompletedRequestPtr &completed_request)
+{
+	std::vector<Track> results;
+	for (auto &track : tracks_)
+	{
+		if (track.hits < config_.min_hits)
+			continue;
+		Detection detection(track.category, track.name, track.confidence, track.cx.x - track.width / 2,
+							track.cy.x - track.height / 2, track.width, track.height);
+		results.emplace_back(track.id, detection, track.cx.v, track.cy.v, track.age);
+	}
+
+	if (config_.verbose)
+	{
+		for (auto &result : results)
+			std::cerr << result.toString() << std::endl;
+	}
+
+	if (config_.replace_results)
+	{
+		if (config_.faces)
+		{
+			std::vector<Rectangle> faces;
+			for (auto &result : results)
+				faces.push_back(result.detection.box);
+			completed_request->post_process_metadata.Set("detected_faces", faces);
+		}
+		else
+		{
+			std::vector<Detection> detections;
+			for (auto &result : results)
+				detections.push_back(result.detection);
+			completed_request->post_process_metadata.Set("object_detect.results", detections);
+		}
+	}
+
+	completed_request->post_process_metadata.Set("object_track.results", results);
+}
+
+bool ObjectTrackStage::Process(CompletedRequestPtr &completed_request)
+{
+	std::vector<Detection> detections = getDetections(completed_request);
+	char const *generation_tag = config_.faces ? "face_detect.generation" : "object_detect.generation";
+	unsigned int generation = 0;
+	bool has_generation = completed_request->post_process_metadata.Get(generation_tag, generation) == 0;
+
+	// Requests can be processed in parallel, so we need to protect the track state.
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Requests may also arrive slightly out of order. Old ones simply get the current tracks.
+	if (first_time_ || completed_request->sequence > last_sequence_)
+	{
+		if (!first_time_)
+			predict(completed_request->sequence - last_sequence_);
+		first_time_ = false;
+		last_sequence_ = completed_request->sequence;
+
+		if (has_generation ? generation != last_generation_ : isNewDetections(detections))
+		{
+			if (updated_)
+				update_interval_ = completed_request->sequence - last_update_sequence_;
+			last_update_sequence_ = completed_request->sequence;
+			updated_ = true;
+
+			update(detections);
+			last_detections_ = std::move(detections);
+			if (has_generation)
+				last_generation_ = generation;
+		}
+	}
+
+	attachResults(completed_request);
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new ObjectTrackStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -20,18 +20,23 @@ void Pwl::Read(boost::property_tree::ptree const &params)
 		points_.push_back(Point(x, y));
 	}
 	assert(points_.size() >= 2);
+	invalidateLut();
 }
 
 void Pwl::Append(double x, double y, const double eps)
 {
-	if (points_.empty() || points_.back().x + eps < x)
+	if (points_.empty() || points_.back().x + eps < x) {
 		points_.push_back(Point(x, y));
+		invalidateLut();
+	}
 }
 
 void Pwl::Prepend(double x, double y, const double eps)
 {
-	if (points_.empty() || points_.front().x - eps > x)
+	if (points_.empty() || points_.front().x - eps > x) {
 		points_.insert(points_.begin(), Point(x, y));
+		invalidateLut();
+	}
 }
 
 Pwl::Interval Pwl::Domain() const
@@ -190,10 +195,30 @@ void Pwl::MatchDomain(Interval const &domain, bool clip, const double eps)
 	Append(domain.end, Eval(clip ? points_.back().x : domain.end, &span), eps);
 }
 
+std::vector<int> const &Pwl::IntLut(int num_entries, double scale) const
+{
+	if (lut_.valid && lut_.num_entries == num_entries && lut_.scale == scale)
+		return lut_.values;
+
+	// Consecutive x values mostly stay in the same span, so pass the last one back in.
+	lut_.values.resize(num_entries);
+	double start = points_[0].x, end = points_.back().x;
+	int span = 0;
+	for (int x = 0; x < num_entries; x++) {
+		double clipped = x < start ? start : (x > end ? end : x);
+		lut_.values[x] = lround(Eval(clipped, &span) * scale);
+	}
+	lut_.valid = true;
+	lut_.num_entries = num_entries;
+	lut_.scale = scale;
+	return lut_.values;
+}
+
 Pwl &Pwl::operator*=(double d)
 {
 	for (auto &pt : points_)
 		pt.y *= d;
+	invalidateLut();
 	return *this;
 }
 
@@ -85,10 +85,24 @@ public:
 			lut[x] = Eval(x, &span);
 		return lut;
 	}
+	// Compile the function into a table of integers for x = 0 to num_entries - 1, with
+	// the y values multiplied by scale and rounded. Values of x beyond the domain take
+	// the value at the nearest end. The table is cached until the Pwl changes or a
+	// different one is asked for, so per-pixel code can just index it. Note that it
+	// may be (re)built here, so don't call this from several threads at once.
+	std::vector<int> const &IntLut(int num_entries, double scale = 1.0) const;
 	Pwl &operator*=(double d);
 	void Debug(FILE *fp = stderr) const;
 
 private:
 	int findSpan(double x, int span) const;
+	void invalidateLut() { lut_.valid = false; }
 	std::vector<Point> points_;
+	struct LutCache {
+		bool valid = false;
+		int num_entries = 0;
+		double scale = 0;
+		std::vector<int> values;
+	};
+	mutable LutCache lut_;
 };
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * resize_pyramid.cpp - downscaled copies of the main image, shared between stages.
+ */
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <libcamera/formats.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "resize_pyramid.hpp"
+
+// Halve a plane with a 2x2 box filter. The destination may be smaller than exactly half.
+static void halve_plane(uint8_t const *src, unsigned int src_stride, uint8_t *dst, unsigned int dst_w,
+						unsigned int dst_h, unsigned int dst_stride)
+{
+	for (unsigned int y = 0; y < dst_h; y++)
+	{
+		uint8_t const *row0 = src + 2 * y * src_stride;
+		uint8_t const *row1 = row0 + src_stride;
+		uint8_t *out = dst + y * dst_stride;
+		unsigned int x = 0;
+#if defined(__ARM_NEON)
+		for (; x + 16 <= dst_w; x += 16)
+		{
+			uint8x16x2_t a = vld2q_u8(row0 + 2 * x);
+			uint8x16x2_t b = vld2q_u8(row1 + 2 * x);
+			uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a.val[0]), vget_low_u8(a.val[1])),
+									  vaddl_u8(vget_low_u8(b.val[0]), vget_low_u8(b.val[1])));
+			uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a.val[0]), vget_high_u8(a.val[1])),
+									  vaddl_u8(vget_high_u8(b.val[0]), vget_high_u8(b.val[1])));
+			vst1q_u8(out + x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+		}
+#endif
+		for (; x < dst_w; x++)
+			out[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+	}
+}
+
+// Bilinear resize of a plane, in 16.16 fixed point, sampling pixel centres.
+static void resize_plane(uint8_t const *src, unsigned int src_w, unsigned int src_h, unsigned int src_stride,
+						 uint8_t *dst, unsigned int dst_w, unsigned int dst_h, unsigned int dst_stride)
+{
+	std::vector<unsigned int> xs(dst_w), xf(dst_w);
+	for (unsigned int x = 0; x < dst_w; x++)
+	{
+		int pos = std::max<int64_t>(0, ((int64_t)(2 * x + 1) * src_w << 15) / dst_w - 32768);
+		xs[x] = std::min<unsigned int>(pos >> 16, src_w - 1);
+		xf[x] = xs[x] == src_w - 1 ? 0 : pos & 0xffff;
+	}
+	for (unsigned int y = 0; y < dst_h; y++)
+	{
+		int pos = std::max<int64_t>(0, ((int64_t)(2 * y + 1) * src_h << 15) / dst_h - 32768);
+		unsigned int ys = std::min<unsigned int>(pos >> 16, src_h - 1);
+		unsigned int yf = ys == src_h - 1 ? 0 : (pos & 0xffff) >> 8;
+		uint8_t const *row0 = src + ys * src_stride;
+		uint8_t const *row1 = yf ? row0 + src_stride : row0;
+		uint8_t *out = dst + y * dst_stride;
+		for (unsigned int x = 0; x < dst_w; x++)
+		{
+			unsigned int f = xf[x] >> 8, i = xs[x], j = f ? i + 1 : i;
+			unsigned int top = row0[i] * (256 - f) + row0[j] * f;
+			unsigned int bottom = row1[i] * (256 - f) + row1[j] * f;
+			out[x] = (top * (256 - yf) + bottom * yf + 32768) >> 16;
+		}
+	}
+}
+
+std::shared_ptr<ResizePyramid> ResizePyramid::Get(LibcameraApp *app, CompletedRequestPtr &completed_request)
+{
+	std::shared_ptr<ResizePyramid> pyramid;
+	if (completed_request->post_process_metadata.Get("resize_pyramid", pyramid) == 0)
+		return pyramid;
+
+	unsigned int width, height, stride;
+	libcamera::Stream *stream = app->GetMainStream();
+	if (!stream)
+		throw std::runtime_error("ResizePyramid: no main stream");
+	if (stream->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("ResizePyramid: main stream must be YUV420");
+	app->StreamDimensions(stream, &width, &height, &stride);
+	libcamera::Span<uint8_t> buffer = app->Mmap(completed_request->buffers[stream])[0];
+
+	pyramid = std::make_shared<ResizePyramid>(buffer.data(), width, height, stride);
+	completed_request->post_process_metadata.Set("resize_pyramid", pyramid);
+	return pyramid;
+}
+
+ResizePyramid::ResizePyramid(uint8_t const *mem, unsigned int width, unsigned int height, unsigned int stride)
+	: mem_(mem), width_(width), height_(height), stride_(stride)
+{
+}
+
+ResizePyramid::Image const &ResizePyramid::level(unsigned int n)
+{
+	while (levels_.size() < n)
+	{
+		// Each level halves the one before, the first halving the main image itself.
+		uint8_t const *src = levels_.empty() ? mem_ : levels_.back()->data.data();
+		unsigned int src_w = levels_.empty() ? width_ : levels_.back()->width;
+		unsigned int src_h = levels_.empty() ? height_ : levels_.back()->height;
+		unsigned int src_stride = levels_.empty() ? stride_ : src_w;
+
+		auto image = std::make_unique<Image>();
+		image->width = (src_w / 2) & ~1;
+		image->height = (src_h / 2) & ~1;
+		image->data.resize(image->width * image->height * 3 / 2);
+		unsigned int w = image->width, h = image->height;
+		uint8_t *Y = image->data.data(), *U = Y + w * h, *V = U + w * h / 4;
+		uint8_t const *src_U = src + src_stride * src_h, *src_V = src_U + src_stride / 2 * src_h / 2;
+		halve_plane(src, src_stride, Y, w, h, w);
+		halve_plane(src_U, src_stride / 2, U, w / 2, h / 2, w / 2);
+		halve_plane(src_V, src_stride / 2, V, w / 2, h / 2, w / 2);
+		levels_.push_back(std::move(image));
+	}
+	return *levels_[n - 1];
+}
+
+ResizePyramid::Image const &ResizePyramid::At(unsigned int width, unsigned int height)
+{
+	width = (width + 1) & ~1;
+	height = (height + 1) & ~1;
+	if (!width || !height || width > width_ || height > height_)
+		throw std::runtime_error("ResizePyramid: bad image size " + std::to_string(width) + "x" +
+								 std::to_string(height));
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto &image = images_[{ width, height }];
+	if (image)
+		return *image;
+
+	// Start from the smallest halving that is no smaller than what we want.
+	unsigned int n = 0;
+	for (unsigned int w = width_ / 2 & ~1, h = height_ / 2 & ~1; w >= width && h >= height;
+		 w = w / 2 & ~1, h = h / 2 & ~1)
+		n++;
+	uint8_t const *src = n ? level(n).data.data() : mem_;
+	unsigned int src_w = n ? level(n).width : width_;
+	unsigned int src_h = n ? level(n).height : height_;
+	unsigned int src_stride = n ? src_w : stride_;
+
+	image = std::make_unique<Image>();
+	image->width = width;
+	image->height = height;
+	image->data.resize(width * height * 3 / 2);
+	uint8_t *Y = image->data.data(), *U = Y + width * height, *V = U + width * height / 4;
+	uint8_t const *src_U = src + src_stride * src_h, *src_V = src_U + src_stride / 2 * src_h / 2;
+	if (src_w == width && src_h == height)
+	{
+		for (unsigned int y = 0; y < height; y++)
+			std::copy_n(src + y * src_stride, width, Y + y * width);
+		for (unsigned int y = 0; y < height / 2; y++)
+		{
+			std::copy_n(src_U + y * src_stride / 2, width / 2, U + y * width / 2);
+			std::copy_n(src_V + y * src_stride / 2, width / 2, V + y * width / 2);
+		}
+	}
+	else
+	{
+		resize_plane(src, src_w, src_h, src_stride, Y, width, height, width);
+		resize_plane(src_U, src_w / 2, src_h / 2, src_stride / 2, U, width / 2, height / 2, width / 2);
+		resize_plane(src_V, src_w / 2, src_h / 2, src_stride / 2, V, width / 2, height / 2, width / 2);
+	}
+	return *image;
+}
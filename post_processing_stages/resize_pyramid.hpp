@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Limited
+ *
+ * resize_pyramid.hpp - downscaled copies of the main image, shared between stages.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "core/completed_request.hpp"
+
+class LibcameraApp;
+
+// Stages that want a small image no longer have to rely on the low resolution stream
+// being there and being the right size. Instead they can ask for the main image at any
+// size they like. We make these by repeatedly halving the main image with a 2x2 box
+// filter, which is cheap and vectorises well, and then a bilinear resize from the smallest
+// halving that is still big enough. Everything is made only when first asked for and is
+// kept for the rest of the request, so several stages wanting the same size (or sizes
+// sharing halvings) don't repeat the work.
+
+class ResizePyramid
+{
+public:
+	// A YUV420 image, with the U and V planes following the Y plane. The stride is the
+	// width and both are even.
+	struct Image
+	{
+		unsigned int width = 0;
+		unsigned int height = 0;
+		std::vector<uint8_t> data;
+	};
+
+	// The pyramid for this request's main image, made the first time any stage asks. It
+	// lives in the request's post-processing metadata, but reads the image buffer directly,
+	// so may only be used while the request is being processed. The main stream must be
+	// YUV420.
+	static std::shared_ptr<ResizePyramid> Get(LibcameraApp *app, CompletedRequestPtr &completed_request);
+
+	ResizePyramid(uint8_t const *mem, unsigned int width, unsigned int height, unsigned int stride);
+
+	// The main image scaled to the given size, rounded up to even numbers as YUV420
+	// requires. Any thread may call this.
+	Image const &At(unsigned int width, unsigned int height);
+
+private:
+	// Halving n of the main image (n > 0).
+	Image const &level(unsigned int n);
+
+	uint8_t const *mem_;
+	unsigned int width_, height_, stride_;
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Image>> levels_;
+	std::map<std::pair<unsigned int, unsigned int>, std::unique_ptr<Image>> images_;
+};
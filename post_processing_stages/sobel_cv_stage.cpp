@@ -5,9 +5,21 @@
  * sobel_cv_stage.cpp - Sobel filter implementation, using OpenCV
  */
 
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <libcamera/stream.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "core/libcamera_app.hpp"
+#include "core/thread_pool.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
@@ -18,6 +30,16 @@ using namespace cv;
 
 using Stream = libcamera::Stream;
 
+// Working memory for one band of the fused filter (see below), big enough for either
+// kernel size.
+struct SobelScratch
+{
+	std::vector<uint16_t> hblur;
+	std::vector<uint8_t> blur;
+	std::vector<uint16_t> v;
+	std::vector<int16_t> d;
+};
+
 class SobelCvStage : public PostProcessingStage
 {
 public:
@@ -32,8 +54,20 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	// The usual 3x3 and 5x5 cases don't need OpenCV at all; see below.
+	void processFused(uint8_t *ptr, unsigned int w, unsigned int h, unsigned int stride);
+	void processCv(uint8_t *ptr, unsigned int w, unsigned int h, unsigned int stride);
+	void allocateScratch(unsigned int w, unsigned int h);
+
 	Stream *stream_;
 	int ksize_ = 3;
+	unsigned int num_threads_ = 0;
+	std::unique_ptr<ThreadPool> pool_;
+	// Allocated once at Configure time: scratch for each pool thread, and the saved rows
+	// around every band. Requests share them, so only one at a time can use them.
+	std::vector<SobelScratch> scratch_;
+	std::vector<uint8_t> halo_;
+	std::mutex scratch_mutex_;
 };
 
 #define NAME "sobel_cv"
@@ -46,6 +80,7 @@ char const *SobelCvStage::Name() const
 void SobelCvStage::Read(boost::property_tree::ptree const &params)
 {
 	ksize_ = params.get<int16_t>("ksize", 3);
+	num_threads_ = params.get<unsigned int>("num_threads", 0);
 }
 
 void SobelCvStage::Configure()
@@ -53,6 +88,14 @@ void SobelCvStage::Configure()
 	stream_ = app_->GetMainStream();
 	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("SobelCvStage: only YUV420 format supported");
+	if ((ksize_ == 3 || ksize_ == 5) && (!pool_ || (num_threads_ && pool_->Size() != num_threads_)))
+		pool_ = std::make_unique<ThreadPool>(num_threads_);
+	if (ksize_ == 3 || ksize_ == 5)
+	{
+		unsigned int w, h;
+		app_->StreamDimensions(stream_, &w, &h, nullptr);
+		allocateScratch(w, h);
+	}
 }
 
 bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
@@ -62,6 +105,368 @@ bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
 	uint8_t *ptr = (uint8_t *)buffer.data();
 
+	if ((ksize_ == 3 || ksize_ == 5) && w >= 5 && h >= 5)
+		processFused(ptr, w, h, stride);
+	else
+		processCv(ptr, w, h, stride);
+
+	return false;
+}
+
+// The fused version gives the same result as processCv for a ksize of 3 or 5, but in a
+// single pass over the image instead of six, and with no full size temporaries. Each band
+// of rows runs a 3x3 Gaussian (rounded as OpenCV does it) into a small ring of blurred
+// rows, and each output row is made from the blurred rows around it as soon as they exist:
+//
+//   gx, gy = Sobel of the blurred image, out = round(min(|gx|, 255) / 2 + min(|gy|, 255) / 2)
+//
+// Borders reflect without repeating the edge pixel, like OpenCV's BORDER_DEFAULT. The work
+// happens in place, so the rows next to each band are saved first, before any band can
+// overwrite them. The inner loops use NEON (or SSE2) where available, finishing off any
+// remaining pixels in plain C.
+
+static inline int reflect101(int i, int n)
+{
+	return i < 0 ? -i : (i >= n ? 2 * n - 2 - i : i);
+}
+
+namespace
+{
+
+// A handful of rows, each remembered by its row number. Rows are asked for in (nearly)
+// increasing order, so it's enough to replace whichever row has the lowest number. The
+// memory for the rows, N of them back to back, belongs to the caller.
+template <typename T, unsigned int N>
+struct RowCache
+{
+	RowCache(T *mem, unsigned int w)
+	{
+		for (unsigned int i = 0; i < N; i++)
+			rows[i] = mem + i * w, index[i] = -1;
+	}
+	T *Find(int row)
+	{
+		for (unsigned int i = 0; i < N; i++)
+			if (index[i] == row)
+				return rows[i];
+		return nullptr;
+	}
+	T *Replace(int row)
+	{
+		unsigned int oldest = 0;
+		for (unsigned int i = 1; i < N; i++)
+			if (index[i] < index[oldest])
+				oldest = i;
+		index[oldest] = row;
+		return rows[oldest];
+	}
+	T *rows[N];
+	int index[N];
+};
+
+// Sobel kernels of radius R (so size 2R + 1): the smoothing and derivative halves.
+template <int R>
+struct SobelKernel;
+template <>
+struct SobelKernel<1>
+{
+	static constexpr int smooth[3] = { 1, 2, 1 };
+	static constexpr int deriv[3] = { -1, 0, 1 };
+};
+template <>
+struct SobelKernel<2>
+{
+	static constexpr int smooth[5] = { 1, 4, 6, 4, 1 };
+	static constexpr int deriv[5] = { -1, -2, 0, 2, 1 };
+};
+
+// Rows cached by each band: a few horizontally blurred ones, and enough fully blurred ones
+// for the largest kernel.
+constexpr unsigned int HBLUR_ROWS = 4;
+constexpr unsigned int MAX_BLUR_ROWS = 6;
+
+// Rows whose pixels a band needs from outside itself (before reflection at the edges).
+template <int R>
+static void halo_rows(int y0, int y1, int rows[2 * R + 2])
+{
+	for (int i = 0; i <= R; i++)
+		rows[i] = y0 - R - 1 + i, rows[R + 1 + i] = y1 + i;
+}
+
+// Horizontal [1 2 1] filter of a source row, for pixels 1 to w - 2.
+static void hblur_row(uint8_t const *src, uint16_t *out, unsigned int w)
+{
+	unsigned int x = 1;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= w - 1; x += 8)
+	{
+		uint16x8_t l = vmovl_u8(vld1_u8(src + x - 1)), c = vmovl_u8(vld1_u8(src + x)),
+				   r = vmovl_u8(vld1_u8(src + x + 1));
+		vst1q_u16(out + x, vaddq_u16(vaddq_u16(l, r), vshlq_n_u16(c, 1)));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	for (; x + 8 <= w - 1; x += 8)
+	{
+		__m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(src + x - 1)), zero);
+		__m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(src + x)), zero);
+		__m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(src + x + 1)), zero);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + x),
+						 _mm_add_epi16(_mm_add_epi16(l, r), _mm_slli_epi16(c, 1)));
+	}
+#endif
+	for (; x < w - 1; x++)
+		out[x] = src[x - 1] + 2 * src[x] + src[x + 1];
+}
+
+// Vertical [1 2 1] filter of horizontally filtered rows, scaled and rounded back to 8 bits.
+static void vblur_row(uint16_t const *a, uint16_t const *b, uint16_t const *c, uint8_t *out, unsigned int w)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= w; x += 8)
+	{
+		uint16x8_t sum = vaddq_u16(vaddq_u16(vld1q_u16(a + x), vld1q_u16(c + x)), vshlq_n_u16(vld1q_u16(b + x), 1));
+		vst1_u8(out + x, vrshrn_n_u16(sum, 4));
+	}
+#elif defined(__SSE2__)
+	__m128i eight = _mm_set1_epi16(8);
+	for (; x + 8 <= w; x += 8)
+	{
+		__m128i va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + x));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + x));
+		__m128i vc = _mm_loadu_si128(reinterpret_cast<__m128i const *>(c + x));
+		__m128i sum = _mm_add_epi16(_mm_add_epi16(va, vc), _mm_add_epi16(_mm_slli_epi16(vb, 1), eight));
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(out + x), _mm_packus_epi16(_mm_srli_epi16(sum, 4), sum));
+	}
+#endif
+	for (; x < w; x++)
+		out[x] = (a[x] + 2 * b[x] + c[x] + 8) >> 4;
+}
+
+// The vertical halves of both Sobel filters, over the 2R + 1 blurred rows around an output row.
+template <int R>
+static void sobel_vertical(uint8_t const *const rows[2 * R + 1], uint16_t *vp, int16_t *dp, unsigned int w)
+{
+	using K = SobelKernel<R>;
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 8 <= w; x += 8)
+	{
+		int16x8_t sv = vdupq_n_s16(0), sd = vdupq_n_s16(0);
+		for (int j = 0; j <= 2 * R; j++)
+		{
+			int16x8_t p = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[j] + x)));
+			sv = vmlaq_n_s16(sv, p, K::smooth[j]);
+			sd = vmlaq_n_s16(sd, p, K::deriv[j]);
+		}
+		vst1q_u16(vp + x, vreinterpretq_u16_s16(sv));
+		vst1q_s16(dp + x, sd);
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	for (; x + 8 <= w; x += 8)
+	{
+		__m128i sv = zero, sd = zero;
+		for (int j = 0; j <= 2 * R; j++)
+		{
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(rows[j] + x)), zero);
+			sv = _mm_add_epi16(sv, _mm_mullo_epi16(p, _mm_set1_epi16(K::smooth[j])));
+			sd = _mm_add_epi16(sd, _mm_mullo_epi16(p, _mm_set1_epi16(K::deriv[j])));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(vp + x), sv);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dp + x), sd);
+	}
+#endif
+	for (; x < w; x++)
+	{
+		int sv = 0, sd = 0;
+		for (int j = 0; j <= 2 * R; j++)
+			sv += K::smooth[j] * rows[j][x], sd += K::deriv[j] * rows[j][x];
+		vp[x] = sv;
+		dp[x] = sd;
+	}
+}
+
+// The horizontal halves, and the output. v and d start R pixels to the left of the row.
+// Everything stays well within 16 bits: |gx| and |gy| can't exceed 16 * 3 * 255.
+template <int R>
+static void sobel_horizontal(uint16_t const *v, int16_t const *d, uint8_t *out, unsigned int w)
+{
+	using K = SobelKernel<R>;
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t max = vdupq_n_s16(255);
+	for (; x + 8 <= w; x += 8)
+	{
+		int16x8_t gx = vdupq_n_s16(0), gy = vdupq_n_s16(0);
+		for (int i = 0; i <= 2 * R; i++)
+		{
+			gx = vmlaq_n_s16(gx, vreinterpretq_s16_u16(vld1q_u16(v + x + i)), K::deriv[i]);
+			gy = vmlaq_n_s16(gy, vld1q_s16(d + x + i), K::smooth[i]);
+		}
+		uint16x8_t s = vreinterpretq_u16_s16(vaddq_s16(vminq_s16(vabsq_s16(gx), max), vminq_s16(vabsq_s16(gy), max)));
+		s = vaddq_u16(s, vandq_u16(vshrq_n_u16(s, 1), vdupq_n_u16(1)));
+		vst1_u8(out + x, vshrn_n_u16(s, 1));
+	}
+#elif defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1), max = _mm_set1_epi16(255);
+	for (; x + 8 <= w; x += 8)
+	{
+		__m128i gx = zero, gy = zero;
+		for (int i = 0; i <= 2 * R; i++)
+		{
+			__m128i vv = _mm_loadu_si128(reinterpret_cast<__m128i const *>(v + x + i));
+			__m128i dd = _mm_loadu_si128(reinterpret_cast<__m128i const *>(d + x + i));
+			gx = _mm_add_epi16(gx, _mm_mullo_epi16(vv, _mm_set1_epi16(K::deriv[i])));
+			gy = _mm_add_epi16(gy, _mm_mullo_epi16(dd, _mm_set1_epi16(K::smooth[i])));
+		}
+		// No 16-bit abs in SSE2, but max(g, -g) does the same.
+		gx = _mm_min_epi16(_mm_max_epi16(gx, _mm_sub_epi16(zero, gx)), max);
+		gy = _mm_min_epi16(_mm_max_epi16(gy, _mm_sub_epi16(zero, gy)), max);
+		__m128i s = _mm_add_epi16(gx, gy);
+		s = _mm_srli_epi16(_mm_add_epi16(s, _mm_and_si128(_mm_srli_epi16(s, 1), one)), 1);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(out + x), _mm_packus_epi16(s, s));
+	}
+#endif
+	for (; x < w; x++)
+	{
+		int gx = 0, gy = 0;
+		for (int i = 0; i <= 2 * R; i++)
+			gx += K::deriv[i] * v[x + i], gy += K::smooth[i] * d[x + i];
+		unsigned int s = std::min(std::abs(gx), 255) + std::min(std::abs(gy), 255);
+		out[x] = (s + ((s >> 1) & 1)) >> 1; // rounds halves to even, as OpenCV does
+	}
+}
+
+template <int R>
+void sobel_band(uint8_t *ptr, unsigned int w, unsigned int h, unsigned int stride, int y0, int y1,
+				uint8_t const *halo, SobelScratch &scratch)
+{
+	static_assert(2 * R + 2 <= MAX_BLUR_ROWS);
+	RowCache<uint16_t, HBLUR_ROWS> hblur(scratch.hblur.data(), w);
+	RowCache<uint8_t, 2 * R + 2> blur(scratch.blur.data(), w);
+	// The vertically filtered rows get R reflected pixels at each end, so that the
+	// horizontal filters needn't worry about the edges.
+	uint16_t *vp = &scratch.v[R];
+	int16_t *dp = &scratch.d[R];
+	int halo_index[2 * R + 2];
+	halo_rows<R>(y0, y1, halo_index);
+
+	// Source row, horizontally blurred (unscaled).
+	auto get_hblur = [&](int row) {
+		row = reflect101(row, h);
+		uint16_t *out = hblur.Find(row);
+		if (out)
+			return out;
+		out = hblur.Replace(row);
+		uint8_t const *src = nullptr;
+		if (row >= y0 && row < y1)
+			src = ptr + row * stride;
+		else
+		{
+			for (int i = 0; !src; i++)
+				if (reflect101(halo_index[i], h) == row)
+					src = halo + i * w;
+		}
+		out[0] = 2 * src[0] + 2 * src[1];
+		hblur_row(src, out, w);
+		out[w - 1] = 2 * src[w - 2] + 2 * src[w - 1];
+		return out;
+	};
+
+	// Fully blurred row, which is what the Sobel filter sees.
+	auto get_blur = [&](int row) {
+		row = reflect101(row, h);
+		uint8_t *out = blur.Find(row);
+		if (out)
+			return out;
+		uint16_t const *a = get_hblur(row - 1), *b = get_hblur(row), *c = get_hblur(row + 1);
+		out = blur.Replace(row);
+		vblur_row(a, b, c, out, w);
+		return out;
+	};
+
+	for (int y = y0; y < y1; y++)
+	{
+		// Make sure everything this row depends on exists before the row is overwritten.
+		uint8_t const *rows[2 * R + 1];
+		for (int j = -R; j <= R; j++)
+			rows[j + R] = get_blur(y + j);
+
+		sobel_vertical<R>(rows, vp, dp, w);
+		for (int i = 1; i <= R; i++)
+		{
+			vp[-i] = vp[i], vp[w - 1 + i] = vp[w - 1 - i];
+			dp[-i] = dp[i], dp[w - 1 + i] = dp[w - 1 - i];
+		}
+
+		sobel_horizontal<R>(vp - R, dp - R, ptr + y * stride, w);
+	}
+
+	// The colour planes just become grey.
+	unsigned int uv_begin = y0 * stride / 2, uv_end = y1 * stride / 2;
+	memset(ptr + stride * h + uv_begin, 128, uv_end - uv_begin);
+}
+
+} // namespace
+
+// Bands of at least 32 rows, a few per thread so that they even out.
+static unsigned int sobel_num_bands(unsigned int h, ThreadPool const &pool)
+{
+	return std::max(1u, std::min(pool.Size() * 2, h / 32));
+}
+
+template <int R>
+static void sobel_fused(uint8_t *ptr, unsigned int w, unsigned int h, unsigned int stride, ThreadPool &pool,
+						std::vector<SobelScratch> &scratch, std::vector<uint8_t> &halo)
+{
+	unsigned int num_bands = sobel_num_bands(h, pool);
+	auto band_begin = [&](unsigned int band) { return (int)(band * h / num_bands); };
+	constexpr unsigned int HALO = 2 * R + 2;
+
+	// Save the rows either side of every band first.
+	pool.ParallelFor(num_bands, [&](unsigned int band, unsigned int) {
+		int rows[HALO];
+		halo_rows<R>(band_begin(band), band_begin(band + 1), rows);
+		for (unsigned int i = 0; i < HALO; i++)
+		{
+			uint8_t const *src = ptr + reflect101(rows[i], h) * stride;
+			memcpy(&halo[(band * HALO + i) * w], src, w);
+		}
+	});
+
+	pool.ParallelFor(num_bands, [&](unsigned int band, unsigned int thread) {
+		sobel_band<R>(ptr, w, h, stride, band_begin(band), band_begin(band + 1), &halo[band * HALO * w],
+					  scratch[thread]);
+	});
+}
+
+void SobelCvStage::allocateScratch(unsigned int w, unsigned int h)
+{
+	constexpr unsigned int MAX_R = 2;
+	scratch_.resize(pool_->Size());
+	for (SobelScratch &scratch : scratch_)
+	{
+		scratch.hblur.resize(HBLUR_ROWS * w);
+		scratch.blur.resize(MAX_BLUR_ROWS * w);
+		scratch.v.resize(w + 2 * MAX_R);
+		scratch.d.resize(w + 2 * MAX_R);
+	}
+	halo_.resize(sobel_num_bands(h, *pool_) * (2 * MAX_R + 2) * w);
+}
+
+void SobelCvStage::processFused(uint8_t *ptr, unsigned int w, unsigned int h, unsigned int stride)
+{
+	std::lock_guard<std::mutex> lock(scratch_mutex_);
+	if (ksize_ == 3)
+		sobel_fused<1>(ptr, w, h, stride, *pool_, scratch_, halo_);
+	else
+		sobel_fused<2>(ptr, w, h, stride, *pool_, scratch_, halo_);
+}
+
+void SobelCvStage::processCv(uint8_t *ptr, unsigned int w, unsigned int h, unsigned int stride)
+{
 	//Everything beyond this point is image processing...
 
 	uint8_t value = 128;
@@ -89,8 +494,6 @@ bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 
 	//weight the x and y gradients and add their magnitudes
 	addWeighted(grad_x, 0.5, grad_y, 0.5, 0, src);
-
-	return false;
 }
 
 static PostProcessingStage *Create(LibcameraApp *app)
@@ -5,6 +5,9 @@
  * tf_stage.hpp - base class for TensorFlowLite stages
  */
 
+#include <libcamera/formats.h>
+
+#include "resize_pyramid.hpp"
 #include "tf_stage.hpp"
 
 TfStage::TfStage(LibcameraApp *app, int tf_w, int tf_h) : PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h)
@@ -21,6 +24,7 @@ void TfStage::Read(boost::property_tree::ptree const &params)
 	config_->verbose = params.get<int>("verbose", 0);
 	config_->normalisation_offset = params.get<float>("normalisation_offset", 127.5);
 	config_->normalisation_scale = params.get<float>("normalisation_scale", 127.5);
+	config_->use_pyramid = params.get<int>("use_pyramid", 0);
 
 	initialise();
 
@@ -90,12 +94,25 @@ void TfStage::Configure()
 	else if (config_->verbose)
 		std::cerr << "TfStage: No main stream" << std::endl;
 
+	// Scaling the main image instead has to be asked for, otherwise (for example) every
+	// full resolution still capture would pay for an inference.
+	use_pyramid_ = false;
+	if (config_->use_pyramid && !lores_stream_ && main_stream_ &&
+		main_stream_->configuration().pixelFormat == libcamera::formats::YUV420)
+	{
+		use_pyramid_ = true;
+		lores_w_ = lores_stride_ = (tf_w_ + 1) & ~1;
+		lores_h_ = (tf_h_ + 1) & ~1;
+		if (config_->verbose)
+			std::cerr << "TfStage: Scaling main stream to " << lores_w_ << "x" << lores_h_ << std::endl;
+	}
+
 	checkConfiguration();
 }
 
 bool TfStage::Process(CompletedRequestPtr &completed_request)
 {
-	if (!lores_stream_)
+	if (!lores_stream_ && !use_pyramid_)
 		return false;
 
 	{
@@ -103,12 +120,17 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
 			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[lores_stream_])[0];
-
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
-			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			if (use_pyramid_)
+				lores_copy_ = ResizePyramid::Get(app_, completed_request)->At(tf_w_, tf_h_).data;
+			else
+			{
+				libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[lores_stream_])[0];
+
+				// Copy the lores image here and let the asynchronous thread convert it to RGB.
+				// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
+				// memory into cached memory, which is then *much* quicker.
+				lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			}
 
 			future_ = std::make_unique<std::future<void>>();
 			*future_ = std::async(std::launch::async, [this] {
@@ -35,6 +35,7 @@ struct TfConfig
 	bool verbose = false;
 	float normalisation_offset = 127.5;
 	float normalisation_scale = 127.5;
+	bool use_pyramid = false;
 };
 
 class TfStage : public PostProcessingStage
@@ -83,9 +84,12 @@ protected:
 	// The width and height that TFLite wants.
 	unsigned int tf_w_, tf_h_;
 
-	// We run TFLite on the low resolution image, details of which are here.
+	// We run TFLite on the low resolution image, details of which are here. Without a
+	// suitable low resolution stream, and if use_pyramid is set, we scale the main image to
+	// the size TFLite wants instead, in which case these describe that image.
 	libcamera::Stream *lores_stream_;
 	unsigned int lores_w_, lores_h_, lores_stride_;
+	bool use_pyramid_;
 
 	// The stage may or may not make use of the larger or "main" image stream.
 	libcamera::Stream *main_stream_;
@@ -5,6 +5,14 @@
  * drm_preview.cpp - DRM-based preview window.
  */
 
+#include <poll.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <drm.h>
 #include <drm_fourcc.h>
 #include <drm_mode.h>
@@ -23,6 +31,8 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, int width, int height, int stride) override;
+	// Import the buffer now, rather than when it is first shown.
+	virtual void ImportBuffer(int fd, libcamera::Span<uint8_t> span, int width, int height, int stride) override;
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() override;
@@ -45,9 +55,23 @@ private:
 		uint32_t bo_handle;
 		unsigned int fb_handle;
 	};
+	// A frame that has been, or is waiting to be, committed to the display.
+	struct Frame
+	{
+		Frame() : fd(-1) {}
+		int fd;
+		unsigned int x, y, w, h;
+		std::chrono::steady_clock::time_point show_time;
+	};
 	void makeBuffer(int fd, size_t size, unsigned int width, unsigned int height, unsigned int stride, Buffer &buffer);
 	void findCrtc();
 	void findPlane();
+	void setupAtomic();
+	void commit(Frame const &frame);
+	void eventThread();
+	static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+								void *user_data);
+	void flipComplete(unsigned int tv_sec, unsigned int tv_usec);
 	int drmfd_;
 	int conId_;
 	uint32_t crtcId_;
@@ -64,6 +88,27 @@ private:
 	int last_fd_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
+	// With atomic modesetting, frames are committed without waiting for the display. A commit
+	// completes on the next vblank, when the frame it replaced can be released. Any frame
+	// that arrives meanwhile waits for that to happen, and gets replaced by any newer one.
+	bool atomic_;
+	struct
+	{
+		uint32_t fb_id, crtc_id;
+		uint32_t src_x, src_y, src_w, src_h;
+		uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+	} props_;
+	std::mutex mutex_;
+	std::condition_variable flip_cond_var_;
+	Frame pending_; // committed, but not yet on screen
+	Frame queued_; // waiting for the pending frame to go on screen
+	std::atomic<bool> abort_;
+	std::thread event_thread_;
+	// Statistics, for frames committed with atomic modesetting.
+	unsigned int frames_displayed_;
+	unsigned int frames_dropped_;
+	double total_latency_ms_;
+	double max_latency_ms_;
 };
 
 #define ERRSTR strerror(errno)
@@ -225,7 +270,46 @@ void DrmPreview::findPlane()
 	drmModeFreePlaneResources(planes);
 }
 
-DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1)
+void DrmPreview::setupAtomic()
+{
+	// Look up the plane properties we need. If anything is missing we'll have to make do
+	// with the legacy interface.
+	atomic_ = false;
+	if (drmSetClientCap(drmfd_, DRM_CLIENT_CAP_ATOMIC, 1))
+		return;
+
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drmfd_, planeId_, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return;
+	const std::pair<char const *, uint32_t *> names[] = {
+		{ "FB_ID", &props_.fb_id },		{ "CRTC_ID", &props_.crtc_id }, { "SRC_X", &props_.src_x },
+		{ "SRC_Y", &props_.src_y },		{ "SRC_W", &props_.src_w },		{ "SRC_H", &props_.src_h },
+		{ "CRTC_X", &props_.crtc_x },	{ "CRTC_Y", &props_.crtc_y },	{ "CRTC_W", &props_.crtc_w },
+		{ "CRTC_H", &props_.crtc_h }
+	};
+	unsigned int found = 0;
+	for (unsigned int i = 0; i < props->count_props; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(drmfd_, props->props[i]);
+		if (!prop)
+			continue;
+		for (auto const &[name, id] : names)
+		{
+			if (!strcmp(prop->name, name))
+				*id = prop->prop_id, found++;
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	atomic_ = found == sizeof(names) / sizeof(names[0]);
+	if (!atomic_)
+		drmSetClientCap(drmfd_, DRM_CLIENT_CAP_ATOMIC, 0);
+}
+
+DrmPreview::DrmPreview(Options const *options)
+	: Preview(options), last_fd_(-1), atomic_(false), abort_(false), frames_displayed_(0), frames_dropped_(0),
+	  total_latency_ms_(0), max_latency_ms_(0)
 {
 	drmfd_ = drmOpen("vc4", NULL);
 	if (drmfd_ < 0)
@@ -246,7 +330,10 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1)
 		conId_ = 0;
 		findCrtc();
 		out_fourcc_ = DRM_FORMAT_YUV420;
+		// Find the plane first, as asking for atomic modesetting makes all the planes
+		// visible, and we don't want to take over the primary one.
 		findPlane();
+		setupAtomic();
 	}
 	catch (std::exception const &e)
 	{
@@ -262,10 +349,22 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1)
 		width_ = screen_width_;
 		height_ = screen_height_;
 	}
+
+	if (atomic_)
+		event_thread_ = std::thread(&DrmPreview::eventThread, this);
+	if (options_->verbose)
+		std::cerr << "DRM preview using " << (atomic_ ? "atomic" : "legacy") << " modesetting" << std::endl;
 }
 
 DrmPreview::~DrmPreview()
 {
+	abort_ = true;
+	if (event_thread_.joinable())
+		event_thread_.join();
+	if (options_->verbose && frames_displayed_)
+		std::cerr << "DRM preview: displayed " << frames_displayed_ << " frames, dropped " << frames_dropped_
+				  << ", latency " << total_latency_ms_ / frames_displayed_ << "ms average, " << max_latency_ms_
+				  << "ms max" << std::endl;
 	close(drmfd_);
 }
 
@@ -289,8 +388,109 @@ void DrmPreview::makeBuffer(int fd, size_t size, unsigned int width, unsigned in
 		throw std::runtime_error("drmModeAddFB2 failed: " + std::string(ERRSTR));
 }
 
+void DrmPreview::ImportBuffer(int fd, libcamera::Span<uint8_t> span, int width, int height, int stride)
+{
+	if ((unsigned int)width > max_image_width_ || (unsigned int)height > max_image_height_)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	Buffer &buffer = buffers_[fd];
+	if (buffer.fd != -1)
+		return;
+	try
+	{
+		makeBuffer(fd, span.size(), width, height, stride, buffer);
+	}
+	catch (std::exception const &e)
+	{
+		// Show will try again, and complain then, if this buffer ever does get shown.
+		buffers_.erase(fd);
+		if (options_->verbose)
+			std::cerr << "DRM preview: " << e.what() << std::endl;
+	}
+}
+
+void DrmPreview::commit(Frame const &frame)
+{
+	Buffer const &buffer = buffers_[frame.fd];
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if (!req)
+		throw std::runtime_error("drmModeAtomicAlloc failed");
+	drmModeAtomicAddProperty(req, planeId_, props_.fb_id, buffer.fb_handle);
+	drmModeAtomicAddProperty(req, planeId_, props_.crtc_id, crtcId_);
+	drmModeAtomicAddProperty(req, planeId_, props_.src_x, 0);
+	drmModeAtomicAddProperty(req, planeId_, props_.src_y, 0);
+	drmModeAtomicAddProperty(req, planeId_, props_.src_w, buffer.width << 16);
+	drmModeAtomicAddProperty(req, planeId_, props_.src_h, buffer.height << 16);
+	drmModeAtomicAddProperty(req, planeId_, props_.crtc_x, frame.x);
+	drmModeAtomicAddProperty(req, planeId_, props_.crtc_y, frame.y);
+	drmModeAtomicAddProperty(req, planeId_, props_.crtc_w, frame.w);
+	drmModeAtomicAddProperty(req, planeId_, props_.crtc_h, frame.h);
+	int ret = drmModeAtomicCommit(drmfd_, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, this);
+	drmModeAtomicFree(req);
+	if (ret)
+		throw std::runtime_error("drmModeAtomicCommit failed: " + std::string(ERRSTR));
+	pending_ = frame;
+}
+
+void DrmPreview::eventThread()
+{
+	drmEventContext context = {};
+	context.version = 2;
+	context.page_flip_handler = &DrmPreview::pageFlipHandler;
+	pollfd p = { drmfd_, POLLIN, 0 };
+	while (!abort_)
+	{
+		if (poll(&p, 1, 100) > 0)
+			drmHandleEvent(drmfd_, &context);
+	}
+}
+
+void DrmPreview::pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+								 void *user_data)
+{
+	static_cast<DrmPreview *>(user_data)->flipComplete(tv_sec, tv_usec);
+}
+
+void DrmPreview::flipComplete(unsigned int tv_sec, unsigned int tv_usec)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (pending_.fd < 0)
+		return; // a Reset got here first
+
+	// The event's timestamp comes from the same monotonic clock as steady_clock.
+	std::chrono::steady_clock::time_point flip_time(std::chrono::seconds(tv_sec) +
+													std::chrono::microseconds(tv_usec));
+	double latency_ms = std::chrono::duration<double, std::milli>(flip_time - pending_.show_time).count();
+	total_latency_ms_ += latency_ms;
+	max_latency_ms_ = std::max(max_latency_ms_, latency_ms);
+	frames_displayed_++;
+
+	// The previous frame is off the screen now.
+	if (last_fd_ >= 0)
+		done_callback_(last_fd_);
+	last_fd_ = pending_.fd;
+	pending_ = Frame();
+	flip_cond_var_.notify_all();
+
+	if (queued_.fd >= 0)
+	{
+		try
+		{
+			commit(queued_);
+		}
+		catch (std::exception const &e)
+		{
+			std::cerr << "DRM preview: " << e.what() << std::endl;
+			done_callback_(queued_.fd);
+		}
+		queued_ = Frame();
+	}
+}
+
 void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, int width, int height, int stride)
 {
+	std::lock_guard<std::mutex> lock(mutex_);
 	Buffer &buffer = buffers_[fd];
 	if (buffer.fd == -1)
 		makeBuffer(fd, span.size(), width, height, stride, buffer);
@@ -302,6 +502,27 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, int width, int heig
 	else
 		w = height_ * width / height, x_off = (width_ - w) / 2;
 
+	if (atomic_)
+	{
+		Frame frame;
+		frame.fd = fd;
+		frame.x = x_off + x_, frame.y = y_off + y_, frame.w = w, frame.h = h;
+		frame.show_time = std::chrono::steady_clock::now();
+		if (pending_.fd < 0)
+			commit(frame);
+		else
+		{
+			// Only the latest frame is worth waiting for.
+			if (queued_.fd >= 0)
+			{
+				done_callback_(queued_.fd);
+				frames_dropped_++;
+			}
+			queued_ = frame;
+		}
+		return;
+	}
+
 	if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
 						buffer.width << 16, buffer.height << 16))
 		throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
@@ -312,10 +533,16 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, int width, int heig
 
 void DrmPreview::Reset()
 {
+	std::unique_lock<std::mutex> lock(mutex_);
+	// Don't remove a framebuffer that a commit is still waiting to show.
+	if (pending_.fd >= 0)
+		flip_cond_var_.wait_for(lock, std::chrono::milliseconds(200), [this]() { return pending_.fd < 0; });
 	for (auto &it : buffers_)
 		drmModeRmFB(drmfd_, it.second.fb_handle);
 	buffers_.clear();
 	last_fd_ = -1;
+	pending_ = Frame();
+	queued_ = Frame();
 }
 
 Preview *make_drm_preview(Options const *options)
@@ -25,6 +25,9 @@ public:
 	// is no longer displaying the buffer and it can be safely recycled.
 	void SetDoneCallback(DoneCallback callback) { done_callback_ = callback; }
 	virtual void SetInfoText(const std::string &text) {}
+	// Optionally get a buffer ready for display ahead of time, so that showing it later
+	// is quicker. Buffers that can't be shown are ignored.
+	virtual void ImportBuffer(int fd, libcamera::Span<uint8_t> span, int width, int height, int stride) {}
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, int width, int height, int stride) = 0;
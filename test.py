@@ -15,8 +15,10 @@ import argparse
 import json
 import os
 import os.path
+import socket
 import subprocess
 import sys
+import time
 from timeit import default_timer as timer
 
 class TestFailure(Exception):
@@ -28,7 +30,7 @@ def check_exists(file, preamble):
     if not os.path.isfile(file):
         raise TestFailure(preamble + ": " + file + " not found")
 
-def clean_dir(dir, exts = ('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', 'log.txt')):
+def clean_dir(dir, exts = ('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', '.yuv', 'log.txt')):
     for file in os.listdir(dir):
         if file.endswith(exts):
             os.remove(os.path.join(dir, file))
@@ -162,6 +164,24 @@ def test_still(exe_dir, output_dir):
     if os.path.isfile(os.path.join(output_dir, 'test002.jpg')):
                raise("test_still: timelapse test, unexpected output file")
 
+    # "burst test". Check that a burst saves one dng per frame.
+    print("    burst test")
+    clean_dir(output_dir)
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '--burst', '3', '-o', os.path.join(output_dir, 'test%03d.jpg')], logfile)
+    check_retcode(retcode, "test_still: burst test")
+    check_time(time_taken, 1.2, 15, "test_still: burst test")
+    for i in range(3):
+        check_size(os.path.join(output_dir, 'test%03d.dng' % i), 1024 * 1024, "test_still: burst test")
+
+    # "zsl test". Capture from the zero shutter lag ring, with no mode switch.
+    print("    zsl test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '--zsl', '2', '-o', output_jpg], logfile)
+    check_retcode(retcode, "test_still: zsl test")
+    check_time(time_taken, 1.2, 8, "test_still: zsl test")
+    check_size(output_jpg, 1024, "test_still: zsl test")
+
     print("libcamera-still tests passed")
     
 def check_jpeg_shutter(file, shutter_string, iso_string, preamble):
@@ -250,6 +270,7 @@ def test_vid(exe_dir, output_dir):
     executable = os.path.join(exe_dir, 'libcamera-vid')
     output_h264 = os.path.join(output_dir, 'test.h264')
     output_mjpeg = os.path.join(output_dir, 'test.mjpeg')
+    output_lores = os.path.join(output_dir, 'lores.mjpeg')
     output_circular = os.path.join(output_dir, 'circular.h264')
     output_pause = os.path.join(output_dir, 'pause.h264')
     output_timestamps = os.path.join(output_dir, 'timestamps.txt')
@@ -311,6 +332,35 @@ def test_vid(exe_dir, output_dir):
     check_size(output_h264, 1024, "test_vid: timestamp test")
     check_timestamps(output_timestamps, "test_vid: timestamp test")
 
+    # "libx264 test". As the h264 test, but with the software encoder, if it was built.
+    print("    libx264 test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'libx264',
+                                          '-o', output_h264], logfile)
+    if retcode and open(logfile, 'r').read().find('libx264 codec not available') >= 0:
+        print("WARNING: test_vid: libx264 test - libx264 not built, skipping test")
+    else:
+        check_retcode(retcode, "test_vid: libx264 test")
+        check_time(time_taken, 2, 8, "test_vid: libx264 test")
+        check_size(output_h264, 1024, "test_vid: libx264 test")
+
+    # "lores output test". Encode the low resolution stream to a second file.
+    print("    lores output test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--lores-output', output_lores], logfile)
+    check_retcode(retcode, "test_vid: lores output test")
+    check_time(time_taken, 2, 6, "test_vid: lores output test")
+    check_size(output_h264, 1024, "test_vid: lores output test")
+    check_size(output_lores, 1024, "test_vid: lores output test")
+
+    # "rate control test". Rate control should run without upsetting the recording.
+    print("    rate control test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--bitrate', '4000000', '--rate-control'], logfile)
+    check_retcode(retcode, "test_vid: rate control test")
+    check_time(time_taken, 2, 6, "test_vid: rate control test")
+    check_size(output_h264, 1024, "test_vid: rate control test")
+
     print("libcamera-vid tests passed")
 
 
@@ -333,6 +383,90 @@ def test_raw(exe_dir, output_dir):
     print("libcamera-raw tests passed")
 
 
+def daemon_command(socket_name, command):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.settimeout(10)
+        s.connect(socket_name)
+        s.sendall((command + '\n').encode('utf-8'))
+        return s.makefile().readline().strip()
+
+
+def test_daemon(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'libcamera-daemon')
+    output_jpg = os.path.join(output_dir, 'test.jpg')
+    output_h264 = os.path.join(output_dir, 'test.h264')
+    socket_name = os.path.join(output_dir, 'test.sock')
+    logfile = os.path.join(output_dir, 'log.txt')
+    print("Testing", executable)
+    check_exists(executable, 'test_daemon')
+    clean_dir(output_dir)
+
+    # "command test". Start the daemon, then capture, record and quit through its socket.
+    print("    command test")
+    if os.path.exists(socket_name):
+        os.remove(socket_name)
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '--socket', socket_name], stdout = log, stderr = subprocess.STDOUT)
+        try:
+            for i in range(50):
+                if os.path.exists(socket_name) or p.poll() is not None:
+                    break
+                time.sleep(0.1)
+            if not os.path.exists(socket_name):
+                raise TestFailure("test_daemon: command test - socket never appeared")
+            if not daemon_command(socket_name, 'status').startswith('OK idle'):
+                raise TestFailure("test_daemon: command test - bad status reply")
+            if not daemon_command(socket_name, 'capture ' + output_jpg).startswith('OK'):
+                raise TestFailure("test_daemon: command test - capture failed")
+            if not daemon_command(socket_name, 'record ' + output_h264 + ' 1000').startswith('OK'):
+                raise TestFailure("test_daemon: command test - record failed")
+            time.sleep(2)
+            if not daemon_command(socket_name, 'status').startswith('OK idle'):
+                raise TestFailure("test_daemon: command test - recording did not finish")
+            daemon_command(socket_name, 'quit')
+            p.wait(10)
+        except (OSError, subprocess.TimeoutExpired) as e:
+            raise TestFailure("test_daemon: command test - " + str(e))
+        finally:
+            if p.poll() is None:
+                p.kill()
+                p.wait()
+    check_retcode(p.returncode, "test_daemon: command test")
+    check_size(output_jpg, 1024, "test_daemon: command test")
+    check_size(output_h264, 1024, "test_daemon: command test")
+
+    print("libcamera-daemon tests passed")
+
+
+def test_shm(exe_dir, output_dir):
+    publisher = os.path.join(exe_dir, 'libcamera-ros-publisher')
+    executable = os.path.join(exe_dir, 'libcamera-shm-subscriber')
+    output_yuv = os.path.join(output_dir, 'frame.yuv')
+    logfile = os.path.join(output_dir, 'log.txt')
+    publisher_logfile = os.path.join(output_dir, 'publisher_log.txt')
+    print("Testing", executable)
+    check_exists(executable, 'test_shm')
+    clean_dir(output_dir)
+
+    # "subscribe test". Read some frames published to shared memory by another process.
+    print("    subscribe test")
+    if not os.path.isfile(publisher):
+        print("WARNING: test_shm: subscribe test - no publisher, skipping test")
+    else:
+        with open(publisher_logfile, 'w') as log:
+            p = subprocess.Popen([publisher, '-t', '5000', '--shm', '/libcamera-test-frames'],
+                                 stdout = log, stderr = subprocess.STDOUT)
+            time.sleep(2)
+            retcode, time_taken = run_executable([executable, '/libcamera-test-frames', '10', output_yuv],
+                                                 logfile)
+            p.wait()
+        check_retcode(retcode, "test_shm: subscribe test")
+        check_time(time_taken, 0, 4, "test_shm: subscribe test")
+        check_size(output_yuv, 1024, "test_shm: subscribe test")
+
+    print("libcamera-shm-subscriber tests passed")
+
+
 def test_post_processing(exe_dir, output_dir, json_dir):
     logfile = os.path.join(output_dir, 'log.txt')
     print("Testing post-processing")
@@ -424,6 +558,10 @@ def test_all(apps, exe_dir, output_dir, json_dir):
             test_vid(exe_dir, output_dir)
         if 'raw' in apps:
             test_raw(exe_dir, output_dir)
+        if 'daemon' in apps:
+            test_daemon(exe_dir, output_dir)
+        if 'shm' in apps:
+            test_shm(exe_dir, output_dir)
         if 'post-processing' in apps:
             test_post_processing(exe_dir, output_dir, json_dir)
 
@@ -438,7 +576,7 @@ def test_all(apps, exe_dir, output_dir, json_dir):
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description = 'libcamera-apps automated tests')
-    parser.add_argument('--apps', '-a', action='store', default='hello,still,vid,jpeg,raw,post-processing',
+    parser.add_argument('--apps', '-a', action='store', default='hello,still,vid,jpeg,raw,daemon,shm,post-processing',
                         help='List of apps to test')
     parser.add_argument('--exe-dir', '-d', action='store', default='build',
                         help='Directory name for executables to test')